@@ -1,7 +1,23 @@
 #pragma once
 #include <vector>
+#include <array>
 #include <iostream>
 #include <iterator>
+#include <stdexcept>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <set>
+#include "b+tree_search.h"
+#include "b+tree_allocator.h"
+#include "b+tree_parallel.h"
+#include "b+tree_image.h"
+#include "b+tree_stats.h"
 using namespace std;
 
 
@@ -9,23 +25,45 @@ using namespace std;
 
 
       B+Tree synopsis
-namespace BPlusTree 
+namespace BPlusTree
 {
-  
 
-template <class key_type, class val_type>
-class Node 
+
+template <class key_type, class val_type, size_t max_children>
+class Node
+{
+public:
+  Node(bool leaf);
+  size_t num_keys;
+  bool is_leaf;
+  size_t birth;                                   // epoch of the tree when the node was created
+  array <key_type, max_children> keys;            // cache-line aligned
+};
+
+template <class key_type, class val_type, size_t max_children, bool counted = false>
+class InnerNode : public Node<key_type, val_type, max_children>
+{
+public:
+  InnerNode();
+  array <Node<key_type,val_type,max_children>*, max_children + 1> nodes;  // children
+  array <size_t, counted ? max_children + 1 : 0> counts;                    // records under each child (order_statistics only)
+};
+
+template <class key_type, class val_type, size_t max_children, bool tombstones = false>
+class LeafNode : public Node<key_type, val_type, max_children>
 {
 public:
-  Node();
-  vector <key_type> keys;
-  vector <val_type> vals;
-  vector <Node<key_type,val_type>*> nodes;   // children
-  class Node <key_type, val_type>*next_leaf; // right right neighbor
-  class Node <key_type, val_type>*prev_leaf; // left neighbor
+  LeafNode();
+  LeafNode *next_leaf; // right neighbor
+  LeafNode *prev_leaf; // left neighbor
+  array <val_type, max_children> vals;           // cache-line aligned
+  array <bool, tombstones ? max_children : 0> dead;  // erased but not removed yet (lazy_erase only)
 };
 
-template <class key_type, class val_type, size_t max_children = 3>
+template <class key_type, class val_type, size_t max_children = 3, class allocator_type = NodeSlabAllocator<>,
+          bool order_statistics = false,  // keep subtree counts: O(log n) advance, nth, rank, count_range
+          bool lazy_erase = false,        // erase(key) leaves a tombstone, leaves are compacted later
+          class search_type = NodeSearch<key_type> >  // in-node search, or InterpolationSearch<key_type> (b+tree_search.h)
 
 
 
@@ -38,16 +76,16 @@ public:
   class reverse_iterator {
 
   private:
-    Node<key_type,val_type> *node;
+    LeafNode<key_type,val_type,max_children> *node;
     size_t idx;
     friend class Tree;
-  
+
   public:
-     
+
     key_type get_key() const;   // get key
 
     val_type get_val() const;   // get val
-  
+
     void set_val(val_type v);   // set val
 
     void advance(int distance); // advance iteraton by distance. (call ++(rit) for advance times)
@@ -56,7 +94,7 @@ public:
 
     const reverse_iterator& operator--(); // --rit
 
-    reverse_iterator operator++(int);     // rit++ 
+    reverse_iterator operator++(int);     // rit++
 
     const reverse_iterator& operator++(); // ++rit
 
@@ -65,12 +103,12 @@ public:
 
   };
 
-  class iterator 
+  class iterator
   {
 
   private:
     friend class Tree;
-    Node<key_type,val_type> *node;
+    LeafNode<key_type,val_type,max_children> *node;
     size_t idx;
 
 
@@ -101,23 +139,115 @@ public:
 
 
 
-  Tree();
+  class Snapshot {  // read-only view returned by snapshot()
+  public:
+    class iterator;   // get_key, get_val, advance, ++, --, ==, != (keeps its root-to-leaf path)
+    iterator find(const key_type key) const;
+    iterator lower_bound(const key_type key) const;
+    iterator upper_bound(const key_type key) const;
+    bool contains(const key_type key) const;
+    iterator begin() const;
+    iterator end() const;
+    size_t size() const;
+    bool empty() const;
+    vector <key_type> get_keys() const;
+    vector <val_type> get_vals() const;
+  };
 
-  void insert(const key_type key, const val_type val);
+  class Cursor {    // returned by cursor(), keeps the root-to-leaf path of its last search
+  public:
+    iterator find(const key_type key);
+    iterator lower_bound(const key_type key);   // hops a few leaves right, or climbs only as far as needed
+    iterator upper_bound(const key_type key);
+    bool contains(const key_type key);
+  };
+
+  Tree();
+  Tree(const Tree &t);              // deep copy
+  Tree(Tree &&t);
+  Tree &operator=(const Tree &t);
+  Tree &operator=(Tree &&t);
+
+  Snapshot snapshot();              // O(1), shares the nodes, later writes copy the nodes they change
+
+  void insert(const key_type key, const val_type val);  // a key past the last one goes straight into the last leaf
+  iterator insert(const iterator &hint, const key_type key, const val_type val);  // no descent if key falls in hint's leaf
+  // one descent each, return (the record of key, true if it was inserted) like std::map
+  template <class... Args>
+  pair<iterator, bool> emplace(Args&&... args);                          // constructs pair<key, val>(args...), inserts it if key is new
+  template <class... Args>
+  pair<iterator, bool> try_emplace(const key_type &key, Args&&... args); // val_type(args...) only if key is new (also key_type &&)
+  template <class M>
+  pair<iterator, bool> insert_or_assign(const key_type &key, M &&obj);
+  template <class Func>
+  pair<iterator, bool> update(const key_type &key, Func f);              // f(val &), val_type() is inserted first if key is new
   iterator find(const key_type key) const;
+  void find_batch(const vector <key_type> &keys, vector <iterator> &out) const;   // out[i] = find(keys[i])
+  void contains_batch(const vector <key_type> &keys, vector <bool> &out) const;   // out[i] = contains(keys[i])
   void erase(const key_type key);
   void erase(const iterator &it);
   void erase(const reverse_iterator &rit);
+  size_t erase_range(const key_type &lo, const key_type &hi);    // erase [lo, hi), return the number of records erased
+  iterator erase(const iterator &first, const iterator &last);   // erase [first, last), return the record after them
+  Tree split_at(const key_type &key);   // move the records >= key into a new tree by cutting the nodes on one path
+                                        // O(log n) with order_statistics, otherwise O(leaves of the smaller part) to count it;
+                                        // copies the upper part (O(its size)) while snapshots are alive
+  void join(Tree &&other);              // take all records of other (keys must not overlap) by stitching the roots
+                                        // O(log n), or O(size of other) when other has live snapshots (its nodes are copied)
+  size_t compact();                     // lazy_erase: remove all tombstones and rebalance, return how many were removed
+  void set_tombstone_ratio(double r);   // lazy_erase: purge a leaf once tombstones >= r * its keys (default 0.5)
+
+  template <class ForwardIt>
+  void insert_batch(ForwardIt first, ForwardIt last);  // sorted (key, val) pairs
+  template <class ForwardIt>
+  void erase_batch(ForwardIt first, ForwardIt last);   // sorted keys
+  template <class ForwardIt>
+  void apply_batch(ForwardIt first, ForwardIt last);   // sorted BatchOp (upserts and erases)
+
   bool contains(const key_type k);
-  size_t size() const; 
+
+  // order_statistics = true only, O(log n)
+  iterator nth(size_t k) const;                                  // the k-th record (from 0), end() if k >= size()
+  size_t rank(const key_type key) const;                         // number of keys < key
+  size_t count_range(const key_type lo, const key_type hi) const;  // number of keys in [lo, hi)
+
+  size_t size() const;
   bool empty() const;
   void clear();
 
+  TreeStats stats() const;          // shape of the tree, and operation counters with -DBPLUSTREE_STATS (b+tree_stats.h)
+  void reset_stats();
+
+  template <class InputIt>
+  void bulk_load(InputIt first, InputIt last, double fill_factor = 1.0);           // sorted (key, val) pairs
+  template <class InputIt>
+  void bulk_load_unsorted(InputIt first, InputIt last, double fill_factor = 1.0,
+                          size_t num_threads = default_threads());               // sorted in parallel first
+
+  // images (b+tree_image.h), trivially copyable key_type and val_type only
+  void save(const string &path) const;                                  // sorted image, written to path.tmp and renamed
+  static MappedTree<key_type, val_type> open_readonly(const string &path);  // mmap, find/lower_bound/iteration straight from the file
+  void load(const string &path, double fill_factor = 1.0);              // checks the crc32, then bulk_load, linear time
+
   iterator upper_bound(const key_type key) const;
   iterator lower_bound(const key_type key) const;
+  Cursor cursor() const;            // find/lower_bound/upper_bound that start from the last path, valid until the tree changes
+
+  vector <key_type> get_keys(size_t num_threads = 1) const;  // pre-sized, filled by num_threads threads
+  vector <val_type> get_vals(size_t num_threads = 1) const;
+
+  vector <pair<iterator, iterator> > split_range(const key_type lo, const key_type hi, size_t parts) const;
+  template <class Func>
+  void parallel_scan(const key_type lo, const key_type hi, Func f, size_t num_threads = default_threads()) const;  // f(key, val)
+  template <class Func>
+  void parallel_scan(Func f, size_t num_threads = default_threads()) const;  // the whole tree
+  template <class Func>
+  void for_each_range(const key_type lo, const key_type hi, Func f) const;   // f(const key &, const val &) in order, no copies
 
-  vector <key_type> get_keys() const;
-  vector <val_type> get_vals() const;
+  class block_iterator;              // one run of a leaf: keys(), vals() (const pointers into the leaf), size(), ++, ==, !=
+  block_iterator block_begin() const;
+  block_iterator block_begin(const key_type lo, const key_type hi) const;  // the runs of [lo, hi)
+  block_iterator block_end() const;
 
   val_type at(key_type key) const;
   val_type & operator[] (key_type key);
@@ -128,12 +258,15 @@ public:
   iterator begin() const;
   iterator end() const;
 
-  
+
 private:
   size_t num_elements;
-  Node<key_type, val_type>*root;
-  size_t max_degree;
-  void recursive_clear_tree(const Node<key_type, val_type> *n);
+  Node<key_type, val_type, max_children>*root;
+  static const size_t max_degree = max_children;
+  allocator_type alloc;  // every node comes from here
+  size_t epoch;          // birth of new nodes, snapshot() increases it
+  shared_ptr <SnapshotState> snapshot_state;  // live snapshots and the nodes retired while they live
+  void destroy_tree(Node<key_type, val_type, max_children> *n);
 
 };
 
@@ -144,37 +277,158 @@ private:
 
 namespace BPlusTree {
 
-template <class key_type, class val_type>
-class Node  
+/* 定长数组的插入/删除: a[0, n) 是有效元素 */
+
+// 在 pos 的位置插入 v，a[pos, n) 整体右移一格
+template <class T, size_t N, class U>
+inline void array_insert(array <T, N> &a, size_t n, size_t pos, U &&v) {
+  std::move_backward(a.begin() + pos, a.begin() + n, a.begin() + n + 1);
+  a[pos] = std::forward<U>(v);
+}
+
+// 删除 pos 的元素，a[pos + 1, n) 整体左移一格
+template <class T, size_t N>
+inline void array_erase(array <T, N> &a, size_t n, size_t pos) {
+  std::move(a.begin() + pos + 1, a.begin() + n, a.begin() + pos);
+}
+
+
+/* 所有node的公共部分。
+   keys/vals/nodes 都是放在node里面的定长数组，容量由 max_children 在编译期决定，
+   这样一个node只需要一次分配，查找key的时候也不用再跳到另外一块内存。
+   插入的时候允许一个node暂时放 M 个key，然后马上分裂，所以keys的容量是 M。
+*/
+template <class key_type, class val_type, size_t max_children>
+class Node
+{
+public:
+  Node(bool leaf) {
+    num_keys = 0;
+    is_leaf = leaf;
+    birth = 0;
+  };
+
+  // C++14的new不保证超过16字节的对齐，所以这里自己按cache line对齐分配
+  static void *operator new(size_t size) {
+    void *p;
+    if (posix_memalign(&p, cache_line_size, size) != 0) throw std::bad_alloc();
+    return p;
+  }
+  static void operator delete(void *p) { free(p); }
+
+  size_t num_keys;  // keys里面有效key的个数
+  bool is_leaf;
+  size_t birth;     // 创建这个node时tree的epoch，epoch < birth的snapshot看不到它 (见snapshot)
+
+  alignas(cache_line_size) array <key_type, max_children> keys;
+
+};
+
+// 中间node，有指向下一层的nodes，孩子数 = num_keys + 1
+// counted的时候counts[i]是nodes[i]这颗子树里record的个数 (Tree的order_statistics)，否则counts是空的
+template <class key_type, class val_type, size_t max_children, bool counted = false>
+class InnerNode : public Node<key_type, val_type, max_children>
+{
+public:
+  InnerNode() : Node<key_type, val_type, max_children>(false) {};
+
+  alignas(cache_line_size) array <Node<key_type, val_type, max_children>*, max_children + 1> nodes;
+  array <size_t, counted ? max_children + 1 : 0> counts;
+
+};
+
+// 叶子，存vals，并且是双向链表
+// tombstones的时候dead[i]表示keys[i]已经被删掉了，只是还没有从leaf里拿走 (Tree的lazy_erase)，否则dead是空的
+template <class key_type, class val_type, size_t max_children, bool tombstones = false>
+class LeafNode : public Node<key_type, val_type, max_children>
 {
 public:
-  Node() {
+  LeafNode() : Node<key_type, val_type, max_children>(true) {
     next_leaf = nullptr;
     prev_leaf = nullptr;
+    dead.fill(false);
   };
 
-  vector <key_type> keys;  
-  vector <val_type> vals;
+  class LeafNode <key_type, val_type, max_children, tombstones>*next_leaf;
+  class LeafNode <key_type, val_type, max_children, tombstones>*prev_leaf;
+
+  alignas(cache_line_size) array <val_type, max_children> vals;
+  array <bool, tombstones ? max_children : 0> dead;
+
+};
 
-  vector <Node<key_type,val_type>*> nodes;  // 对于中间node，有指向下一层的nodes
-  // 对于叶子，是双向链表
-  class Node <key_type, val_type>*next_leaf;
-  class Node <key_type, val_type>*prev_leaf;  
 
+// apply_batch里的一个修改: erase为true时删除key，否则插入(或覆盖)key-val
+template <class key_type, class val_type>
+struct BatchOp
+{
+  key_type key;
+  val_type val;
+  bool erase;
 };
 
 
 // M阶，node里最大size=M-1，最大孩子数=M
-template <class key_type, class val_type, size_t max_children = 3>  
+// order_statistics: inner node记下每个孩子下面有多少个record，advance/nth/rank/count_range就是O(log n)的
+// search_type: node里找key的方法，NodeSearch或者InterpolationSearch
+template <class key_type, class val_type, size_t max_children = 3, class allocator_type = NodeSlabAllocator<>,
+          bool order_statistics = false, bool lazy_erase = false, class search_type = NodeSearch<key_type> >
 class Tree
 {
 
+  static_assert(max_children >= 3, "B+Tree - max_children must be >= 3"); // validation
+
+  typedef Node<key_type, val_type, max_children> node_type;
+  typedef InnerNode<key_type, val_type, max_children, order_statistics> inner_node;
+  typedef LeafNode<key_type, val_type, max_children, lazy_erase> leaf_node;
+
+  /* tree和它的snapshot共用的状态。
+     live是活着的snapshot的epoch，snapshot在别的线程里析构的时候也会改，所以用lock保护，
+     writer只读live_max (live里最大的epoch) 来判断一个node是不是可能被snapshot看到。
+     retired是被复制或者删掉、但是可能还有snapshot看得到的node，只有writer会动它。
+     tree先析构的话，alloc会交给这里，最后一个snapshot析构的时候释放剩下的node。
+  */
+  struct SnapshotState
+  {
+    std::mutex lock;
+    std::multiset <size_t> live;
+    std::atomic <size_t> live_max;       // 没有snapshot的时候是0
+    std::atomic <bool> released;         // 有snapshot析构了，writer下次可以回收retired
+    vector <pair<node_type*, size_t> > retired;  // (node, 被retire时tree的epoch)
+    allocator_type alloc;
+
+    SnapshotState() : live_max(0), released(false) {}
+
+    ~SnapshotState() {
+      size_t i;
+      for (i = 0; i < retired.size(); i++) {
+        if (retired[i].first->is_leaf) alloc.destroy(as_leaf(retired[i].first));
+        else alloc.destroy(as_inner(retired[i].first));
+      }
+    }
+
+    void add(size_t e) {
+      std::lock_guard <std::mutex> guard(lock);
+      live.insert(e);
+      live_max.store(*live.rbegin(), std::memory_order_release);
+    }
+
+    void remove(size_t e) {
+      std::lock_guard <std::mutex> guard(lock);
+      live.erase(live.find(e));
+      live_max.store(live.empty() ? 0 : *live.rbegin(), std::memory_order_release);
+      released.store(true, std::memory_order_release);
+    }
+  };
+
 public:
 
+  typedef BatchOp<key_type, val_type> batch_op;
+
   class reverse_iterator {
 
   public:
-    
+
     key_type get_key() const {
       if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
       return node->keys[idx];
@@ -187,15 +441,35 @@ public:
 
     void set_val(val_type v) {
       if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
+      if (tree->shared(node)) node = const_cast<Tree*>(tree)->writable_leaf(node->keys[idx]);  // a snapshot can see this leaf
       node->vals[idx] = v;
     }
 
     void advance(int distance) {
+      size_t q;
+
+      /* order_statistics: jump to the position directly. rend() is position 0, rbegin() is size() */
+      if (order_statistics && (size_t) std::abs(distance) > max_children) {
+        q = (node == nullptr) ? 0 : tree->position(node, idx) + 1;
+        if ((distance > 0 && (size_t) distance > q) || (distance < 0 && q + (size_t) -distance > tree->num_elements)) {
+          throw std::out_of_range("B+Tree: iterator is out of range");
+        }
+        q -= distance;
+        if (q == 0) {
+          node = nullptr;
+          idx = 0;
+        } else {
+          iterator it = tree->nth_record(q - 1);
+          node = it.node;
+          idx = it.idx;
+        }
+        return;
+      }
 
       if (distance < 0) {
         while (distance != 0) {
           --(*this);
-          distance++; 
+          distance++;
          }
        } else {
         while (distance != 0) {
@@ -218,20 +492,21 @@ public:
     const reverse_iterator& operator--() {
 
       if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
-      if (idx + 1 < node->vals.size()) {
+      if (idx + 1 < node->num_keys) {
         idx++;
       }
       else {
         idx = 0;
         node = node->next_leaf;
       }
+      skip_dead(node, idx);
       return *this;
-      
+
     }
 
     // postfix increment operator (it++). It makes a copy.
     reverse_iterator operator++(int) {
-    
+
       reverse_iterator rit = *this;
       ++(*this);
       return rit;
@@ -244,12 +519,13 @@ public:
       if (idx == 0) {
         node = node->prev_leaf;
         if (node == nullptr) idx = 0;
-        else idx = node->vals.size() - 1;
+        else idx = node->num_keys - 1;
       } else {
         idx--;
       }
+      skip_dead_back(node, idx);
       return *this;
-      
+
     }
 
     bool operator!=(const reverse_iterator &rit) const{
@@ -262,14 +538,15 @@ public:
 
 
   private:
-    Node<key_type,val_type> *node;
+    leaf_node *node;
     size_t idx;
+    const Tree *tree;
     friend class Tree;
 
   }; // end of reverse_iterator
 
 
-  class iterator 
+  class iterator
   {
 
   public:
@@ -286,15 +563,27 @@ public:
 
     void set_val(val_type v) {
       if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
+      if (tree->shared(node)) node = const_cast<Tree*>(tree)->writable_leaf(node->keys[idx]);  // a snapshot can see this leaf
       node->vals[idx] = v;
     }
 
     void advance(int distance) {
+      size_t p;
+
+      /* order_statistics: find the position of the iterator and jump there in O(log n) */
+      if (order_statistics && (size_t) std::abs(distance) > max_children) {
+        p = tree->position(node, idx);
+        if ((distance < 0 && (size_t) -distance > p) || (distance > 0 && p + distance > tree->num_elements)) {
+          throw std::out_of_range("B+Tree: iterator is out of range");
+        }
+        *this = tree->nth_record(p + distance);
+        return;
+      }
 
       if (distance < 0) {
         while (distance != 0) {
           --(*this);
-          distance++; 
+          distance++;
         }
       } else {
         while (distance != 0) {
@@ -318,17 +607,18 @@ public:
       if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
       if (idx == 0) {
         node = node->prev_leaf;
-        idx = node->vals.size() - 1;
+        idx = node->num_keys - 1;
       } else {
         idx--;
       }
+      skip_dead_back(node, idx);
 
       return *this;
     }
 
     // postfix increment operator (it++). It makes a copy.
     iterator operator++(int) {
-    
+
       iterator it = *this;
       ++(*this);
       return it;
@@ -338,13 +628,14 @@ public:
     const iterator& operator++() {
 
       if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
-      if (idx + 1 < node->vals.size()) {
+      if (idx + 1 < node->num_keys) {
         idx++;
       }
       else {
         idx = 0;
         node = node->next_leaf;
       }
+      skip_dead(node, idx);
       return *this;
     }
 
@@ -360,697 +651,3070 @@ public:
 
   private:
     friend class Tree;
-    Node<key_type,val_type> *node;
+    leaf_node *node;
     size_t idx;
+    const Tree *tree;
 
 
 
   }; // end of iterator
 
 
+  /* block_begin()返回的iterator，每一步是一个leaf里连续的一段records: keys()[0, size()) 和 vals()[0, size())，
+     直接指着leaf里的数组，不复制。lazy_erase的时候tombstone把一个leaf分成几段。
+     走到一个leaf的时候prefetch下一个leaf。和iterator一样，tree被修改以后就不能再用了。
+  */
+  class block_iterator
+  {
+  public:
 
-// B+Tree public functions
-
-Tree() {
-
-  if (max_children < 3) throw std::runtime_error("B+Tree - max_degree must > 3"); // validation
-  this->max_degree = max_children; 
-  root = new Node<key_type, val_type>;  
-  num_elements = 0;
-}
-
-~Tree() {
-
-  clear();
-  delete root;
-}
-
-// 在这个树里面插入key-value
-void insert(const key_type &key,  val_type val) {
-  /** insert
-   * 1.找到要插入的叶子结点n
-   * 2.如果叶子结点中key存在了，那么直接修改value，然后return;   如果key不存在，那么继续走到3
-   * 3.num_elements++     (num_elements表示这颗树中存的key-value的数量)
-   * 4.将这个key-value插入到keys和vals数组中
-   * 5.插入后检查size，如果size==M，表明要分裂了，分裂的过程在split单独说
-   */ 
-
-  /** split:分裂的做法是一个递归的分裂，每当这个node满了就会分裂，并可能递归导致parent分裂
-   * 1.inner node: L split to L and L2, MOVE L2 to parent
-   * 2.leaf node: L split to L and L2, COPY L2 to parent
-   * 3.root node: when root node need to split , need to new a root
-   */ 
-  size_t i, j, traverse_index;
-  key_type median_key;
-  vector <size_t> traverse_indices; // record the index of  node in search path
-  vector <Node<key_type, val_type>*> parents; // record the node in search path
+    const key_type *keys() const { return node->keys.data() + from; }
 
-  Node<key_type, val_type>*right;
-  Node<key_type, val_type>*n = root;  
-  Node<key_type, val_type>*parent;
-  bool records = true;  // means isLeafNode
+    const val_type *vals() const { return node->vals.data() + from; }
 
+    size_t size() const { return to - from; }
 
-  // it = find(key);
-  // if (it != end()) {
-  //   it.set_val(val);
-  //   return;
-  // }
+    block_iterator operator++(int) {
+      block_iterator it = *this;
+      ++(*this);
+      return it;
+    }
 
-  
-  /* find the leaf node */
-  while (1) {
-    /* 找到应该遍历的子节点node[i] */
-    for (i = 0; i < n->keys.size(); i++) {
-      if (key < n->keys[i]) break;  
+    const block_iterator& operator++() {
+      if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
+      from = to;
+      settle();
+      return *this;
     }
-    /* 记录路径中的各个parent，并判断为叶子节点时终止，更新n */
-    if (n->nodes.size() != 0) {  // 如果n不是叶子节点才会去记录
-      traverse_indices.push_back(i);  // 记录遍历路径中node的下标
-      parents.push_back(n);   // 记录遍历路径中的node
-      n = n->nodes[i];
-    } else break; // n的size为0，表示这个node是叶子结点了，ok就找到啦
-  } 
 
-  /* key exists */
-  for (j = 0; j < n->keys.size(); j++) {  
-    if (n->keys[j] == key) { // 如果key存在了，那么就直接修改对应的value，return
-      n->vals[j] = val;
-      return;
+    bool operator!=(const block_iterator &it) const {
+      return !(*this == it);
     }
-  }
 
-  /* key not exists */
-  num_elements++;
-  /* put the val and key in the proper postion */
-  // 这个地方挺巧妙的，这里在i的位置插入是因为前面最后一次while循环中，i遍历了keys,使得keys[i-1]<key<keys[i]，所以在i的位置插入
-  n->keys.insert(n->keys.begin() + i, key);
-  n->vals.insert(n->vals.begin() + i, val);
- 
-  /* split the node until the bucket(key) is not full any more */
-  while (n->keys.size() == max_degree) {  // 如果节点n满了
-    median_key = n->keys[max_degree / 2]; // 中间节点
-    
-    /* no matter weather we split the internal node or root node 
-       We need the "right" node. When we split the nodes that contain records, the median was kept. 
-       Otherwise, the median was deleted. 
-    */
-    right = new Node<key_type, val_type>;
-    // j表示right的第一个key index 
-    if (records) {  // 如果是叶子节点,是median index是right的第一个元素，
-     j = max_degree / 2;  
-    } else {
-      j = max_degree / 2 + 1; // 对于中间节点是median+1,因为第一个元素是MOVE到上层，舍弃
+    bool operator==(const block_iterator &it) const {
+      return (this->node == it.node && this->from == it.from);
     }
 
-    /* move half key-value to right */
-    for (i = j; i < max_degree; i++) {
-      if (records) {  // 叶子节点才需要vals
-        right->vals.push_back(n->vals[i]);
+  private:
+    friend class Tree;
+    const leaf_node *node;       // nullptr: end
+    size_t from, to;             // 这一段是node的 [from, to)
+    const leaf_node *stop_node;  // 停在 (stop_node, stop_idx)，stop_node是nullptr的时候走到最后
+    size_t stop_idx;
+
+    // 从 (node, from) 往后找到第一个record，to是它所在的那一段的结尾
+    void settle() {
+      size_t limit;
+
+      for (;;) {
+        if (node == nullptr) {
+          from = to = 0;
+          return;
+        }
+        limit = (node == stop_node) ? stop_idx : node->num_keys;
+        while (from < limit && is_dead(node, from)) from++;
+        if (from < limit) break;
+        node = (node == stop_node) ? nullptr : node->next_leaf;
+        from = 0;
       }
-      right->keys.push_back(n->keys[i]);
-    }
-    
-    // 对于中间节点,nodes.size() = M+1,所以i的起始为(M+1+1)/2 = M/2 + 1，因为L1的node是[0,M/2]
-    // 对于叶子节点,nodes.size() = 0,不会执行for循环里面的
-    for (i = (n->nodes.size() + 1) / 2; i < n->nodes.size(); i++) {
-      right->nodes.push_back(n->nodes[i]);
+
+      for (to = from + 1; to < limit && !is_dead(node, to); to++);
+      if (from == 0 && node->next_leaf != nullptr) prefetch_leaf(node->next_leaf);
     }
 
-     // when we split the root node, create the new parent node.
-     //   The original node became the "left" node.
-    
-    if (traverse_indices.size() == 0) { // no parent, means spliting root
+  }; // end of block_iterator
 
-      /* parent is created as new root*/
-      // parent only have one key, is right key's first ,just is median_key 
-      parent = new Node<key_type, val_type>;
-      parent->nodes.push_back(n);
-      parent->nodes.push_back(right);
-      parent->keys.push_back(median_key);
-      
-      /* connect nodes */
-      // ??? 不是只有叶子才去链表吗 ???
 
-      // pre: a <-> n <-> b
-      // now: a <-> n <-> right <-> b
-      right->next_leaf = n->next_leaf;
-      if (n->next_leaf != nullptr) { 
-        n->next_leaf->prev_leaf = right;
+  /* snapshot()返回的只读视图。它和tree共用node，tree之后的修改(复制要改的node)不会影响它，
+     所以可以在别的线程里一边读，tree一边被修改，读多久都行。
+     writer会改leaf之间的链表，所以snapshot不用next_leaf/prev_leaf，它的iterator自己记住从root下来的路径。
+  */
+  class Snapshot
+  {
+  public:
+
+    class iterator
+    {
+    public:
+
+      key_type get_key() const {
+        if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
+        return node->keys[idx];
       }
-      n->next_leaf = right;
-      right->prev_leaf = n;
 
-      
+      val_type get_val() const {
+        if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
+        return node->vals[idx];
+      }
 
-      
-      root = parent;  //update root
+      void advance(int distance) {
+        while (distance < 0) {
+          --(*this);
+          distance++;
+        }
+        while (distance > 0) {
+          ++(*this);
+          distance--;
+        }
+      }
 
-      /* resize */
-      n->keys.resize(max_degree / 2);
-      if (records) {
-        n->vals.resize(max_degree / 2);
+      iterator operator--(int) {
+        iterator it = *this;
+        --(*this);
+        return it;
       }
-      if (n->nodes.size() != 0) {
-        n->nodes.resize((n->nodes.size() + 1)/ 2);  
+
+      const iterator& operator--() {
+        if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
+        do {
+          step_back();
+        } while (node != nullptr && is_dead(node, idx));  // tombstones (lazy_erase)
+        return *this;
       }
-      // cout << "size: " << parent->nodes.size() << " " << n->nodes.size() << " " << right->nodes.size() << endl;
 
+      iterator operator++(int) {
+        iterator it = *this;
+        ++(*this);
+        return it;
+      }
 
-    } else {  // the split node is not root
+      const iterator& operator++() {
+        if (node == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
+        do {
+          step();
+        } while (node != nullptr && is_dead(node, idx));
+        return *this;
+      }
 
-      /* when we split the internal node, the original node keeps the half capacity as the left node.
-         Also, the median key was added to it's parent.
-       */
-      
-      if(records) {
-        n->vals.resize(max_degree/2);
+      bool operator!=(const iterator &it) const {
+        return !(*this == it);
       }
-      n->keys.resize(max_degree/2);
 
-      if (n->nodes.size() != 0) {
-        n->nodes.resize((n->nodes.size() + 1) / 2); // internal node
+      bool operator==(const iterator &it) const {
+        return (this->node == it.node && this->idx == it.idx);
       }
 
-      /* connect the split nodes */
-      right->next_leaf = n->next_leaf;
-      if (n->next_leaf != nullptr) n->next_leaf->prev_leaf = right;
-      n->next_leaf = right;
-      right->prev_leaf = n;
-      
-      /* get parent by path*/
-      parent = parents[parents.size() - 1]; 
-      parents.pop_back();
+    private:
+      friend class Snapshot;
+      vector <pair<inner_node*, size_t> > path;  // 从root下来经过的inner node，和走的是第几个孩子
+      leaf_node *node;
+      size_t idx;
+
+      // 下一个slot
+      void step() {
+        if (idx + 1 < node->num_keys) {
+          idx++;
+          return;
+        }
 
-      traverse_index = traverse_indices[traverse_indices.size() - 1];
-      traverse_indices.pop_back();
+        /* go up until we can step right, then down along the leftmost children */
+        while (!path.empty() && path.back().second == path.back().first->num_keys) path.pop_back();
+        if (path.empty()) {
+          node = nullptr;
+          idx = 0;
+          return;
+        }
+        path.back().second++;
+        descend(path.back().first->nodes[path.back().second], true);
+      }
 
-      parent->keys.insert(parent->keys.begin() + traverse_index, median_key);
-      parent->nodes.insert(parent->nodes.begin() + traverse_index + 1, right);
-   
-      n = parent; 
-      records = false;
-     
-    } 
-  }
+      // 上一个slot
+      void step_back() {
+        if (idx > 0) {
+          idx--;
+          return;
+        }
 
-  return;
-}
+        /* go up until we can step left, then down along the rightmost children */
+        while (!path.empty() && path.back().second == 0) path.pop_back();
+        if (path.empty()) {
+          node = nullptr;
+          idx = 0;
+          return;
+        }
+        path.back().second--;
+        descend(path.back().first->nodes[path.back().second], false);
+      }
 
-iterator find(const key_type &key) const {
+      // 从n一直走最左边(最右边)的孩子到leaf
+      void descend(node_type *n, bool leftmost) {
+        size_t i;
+        while (!n->is_leaf) {
+          i = leftmost ? 0 : n->num_keys;
+          path.push_back(make_pair(as_inner(n), i));
+          n = as_inner(n)->nodes[i];
+        }
+        node = as_leaf(n);
+        idx = leftmost ? 0 : n->num_keys - 1;
+      }
 
-  Node<key_type,val_type> *n = root; 
-  iterator it;
-  size_t i;
+    }; // end of Snapshot::iterator
 
-  /* find the leaf node first */
-  while (n->nodes.size() != 0) {
-    for (i = 0; i < n->keys.size(); i++) {
-      if (key < n->keys[i]) break;
+    Snapshot(const Snapshot &s) : root(s.root), num_elements(s.num_elements), epoch(s.epoch), state(s.state) {
+      if (state != nullptr) state->add(epoch);
     }
 
-    if (n->nodes.size() != 0) n = n->nodes[i];
-  }
+    Snapshot(Snapshot &&s) : root(s.root), num_elements(s.num_elements), epoch(s.epoch), state(std::move(s.state)) {
+      s.state = nullptr;
+    }
 
-  /* check to see if we find the key */
-  for (i = 0; i < n->keys.size(); i++) {
-    if (key == n->keys[i]) {
-      it.idx = i;
-      it.node = n;
-      return it;
+    Snapshot &operator=(Snapshot s) {
+      std::swap(root, s.root);
+      std::swap(num_elements, s.num_elements);
+      std::swap(epoch, s.epoch);
+      std::swap(state, s.state);
+      return *this;
     }
-  }
-  return end();
-}
 
+    ~Snapshot() {
+      if (state != nullptr) state->remove(epoch);
+    }
 
-void erase(const key_type &key) {
+    iterator find(const key_type &key) const {
+      iterator it = path_to(key);
+      size_t i = child_index(it.node, key);
 
-  Node<key_type, val_type> *n = root; 
-  size_t i;
-  int delete_index = -1;
-  size_t min_keys = (max_degree - 1) / 2;
-  size_t size;
-  Node<key_type, val_type> *left, *right;
-  Node<key_type, val_type> *parent;
-  size_t traverse_index;
-  vector <size_t> traverse_indices;
-  vector <Node<key_type, val_type>*> parents;
-  bool records = true;
+      if (i > 0 && it.node->keys[i - 1] == key && !is_dead(it.node, i - 1)) {
+        it.idx = i - 1;
+        return it;
+      }
+      return end();
+    }
 
-  /* remember an internal node along with index, whose key is euqal to param "key" 
-     when we delete the leftmost key in the subtree, we will update the internal node's key,
-     which has the same value as param "key". The new key will be the new replaced element.
-  */
-  Node<key_type, val_type> *same_value_node = nullptr;
-  int same_value_index = -1;
+    iterator lower_bound(const key_type &key) const {
+      iterator it = path_to(key);
 
-  /* find the leaf node first */
-  while (n->nodes.size() != 0) {
-    for (i = 0; i < n->keys.size(); i++) {
-      if (key == n->keys[i]) {
-        same_value_node = n;
-        same_value_index = i;
+      it.idx = search_type::lower_bound(it.node->keys.data(), it.node->num_keys, key);
+      if (it.idx < it.node->num_keys) {
+        if (is_dead(it.node, it.idx)) ++it;
+        return it;
       }
-      if (key < n->keys[i]) break;
+      if (it.node->num_keys == 0) return end();
+      it.idx = it.node->num_keys - 1;
+      return ++it;
     }
 
-    if (n->nodes.size() != 0) {
-      traverse_indices.push_back(i);
-      parents.push_back(n);
-      n = n->nodes[i];
+    iterator upper_bound(const key_type &key) const {
+      iterator it = lower_bound(key);
+      if (it != end() && it.get_key() == key) ++it;
+      return it;
     }
-  }
 
-  /* find the index */
-  for (i = 0; i < n->keys.size(); i++) {
-    if (key == n->keys[i]) {
-      delete_index = i;
-      break;
+    bool contains(const key_type &key) const { return find(key) != end(); }
+
+    iterator begin() const {
+      iterator it;
+      if (num_elements == 0) return end();
+      it.descend(root, true);
+      if (is_dead(it.node, it.idx)) ++it;
+      return it;
     }
-  }
 
-  /* key is not found in tree */
-  if (delete_index == -1) return;
-  
-  
-  num_elements--;
-  /* delete the record */
-  n->keys.erase(n->keys.begin() + delete_index);
-  n->vals.erase(n->vals.begin() + delete_index);
-  if (n == root) return;
-  
+    iterator end() const {
+      iterator it;
+      it.node = nullptr;
+      it.idx = 0;
+      return it;
+    }
 
-  left = n->prev_leaf;
-  right = n->next_leaf;
+    size_t size() const { return num_elements; }
+    bool empty() const { return num_elements == 0; }
 
-  /* case1: the bucket is big enough after deletion operation */
-  if (n->keys.size() >= min_keys) {
-    
-    /* the leftmost key is deleted */
-    if (same_value_node != nullptr) {
-        same_value_node->keys[same_value_index] = n->keys[0];
+    vector <key_type> get_keys() const {
+      vector <key_type> rv;
+      iterator it;
+      for (it = begin(); it != end(); ++it) rv.push_back(it.node->keys[it.idx]);
+      return rv;
     }
-    return;
-  }
-  
-  /* merge or borrow the node from neighbors 
-     until the size of current bucket is >= min_keys or get to root node 
-  */
-  while (n->keys.size() < min_keys && n != root) {
 
+    vector <val_type> get_vals() const {
+      vector <val_type> rv;
+      iterator it;
+      for (it = begin(); it != end(); ++it) rv.push_back(it.node->vals[it.idx]);
+      return rv;
+    }
 
-    left = n->prev_leaf;
-    right = n->next_leaf;
-    parent = parents[parents.size() - 1];
-    parents.pop_back();
-    traverse_index = traverse_indices[traverse_indices.size() - 1];
-    traverse_indices.pop_back();
-      
-    /* case:2 borrow from left node 
-       when it's not the leftmost node in the substree and the left node's size is big enought.
-       traverse_index minus 1 is because the index of key is one less than the index of nodes.
-    */
-    if (left != nullptr && traverse_index != 0) {
-      size = left->keys.size();
+  private:
+    friend class Tree;
+    node_type *root;
+    size_t num_elements;
+    size_t epoch;        // 能看到birth <= epoch的node
+    std::shared_ptr <SnapshotState> state;
+
+    Snapshot(node_type *r, size_t n, size_t e, const std::shared_ptr <SnapshotState> &s)
+      : root(r), num_elements(n), epoch(e), state(s) {
+      state->add(epoch);
+    }
 
-      if (size > min_keys) {
-      
-        traverse_index--;
-        /* if it's leaf nodes, we steal the rightmost key and val in the left node 
-           and update the parent's key with its key.
-           Otherwise we bring down the parent key to the current node and 
-           bring up the rightmost key in the left node.
-        */
-        if(records) {
-          n->keys.insert(n->keys.begin(), left->keys[size - 1]);
-          parent->keys[traverse_index] = n->keys[0];
+    // 走到key所在的leaf，记住路径
+    iterator path_to(const key_type &key) const {
+      iterator it;
+      node_type *n = root;
+      size_t i;
 
-          n->vals.insert(n->vals.begin(), left->vals[size - 1]);
-          left->vals.pop_back();
-        } else {
-          n->keys.insert(n->keys.begin(), parent->keys[traverse_index]);
-          parent->keys[traverse_index] = left->keys[size - 1];
-          n->nodes.insert(n->nodes.begin(), left->nodes[left->nodes.size() - 1]);
-          left->nodes.pop_back();
-        }
-       
-        left->keys.pop_back();
-      
-        return;
+      while (!n->is_leaf) {
+        i = child_index(n, key);
+        it.path.push_back(make_pair(as_inner(n), i));
+        n = as_inner(n)->nodes[i];
       }
+      it.node = as_leaf(n);
+      it.idx = 0;
+      return it;
+    }
 
-    /* case3: borrow from right node */
-    } else if (right != nullptr && traverse_index != parent->nodes.size() - 1) {
+  }; // end of Snapshot
 
-     
-      size = right->keys.size();
 
-      if (size > min_keys){
-         /* the leftmost key in the subtree could be deleted */
-         if (same_value_node != nullptr) {
-          same_value_node->keys[same_value_index] = n->keys[0];
-         }
-        
-        /* if it's leaf nodes, we steal the leftmost key and val in the right node 
+  /* cursor()返回的游标，给merge join、skip scan这种一个接一个地找慢慢变大的key用。
+     它记住上一次从root走到leaf的路径，和路径上每个孩子管的key的范围 [lo, hi)。
+     下一次找的时候key还在这个leaf里就不用往下走；在右边的话先沿着next_leaf往右跳几个同一个parent下面的leaf，
+     再不行才往上走到范围包含key的那一层，从那里往下走。key往左走也一样。
+     和iterator一样，tree被修改以后cursor就不能再用了，要重新cursor()。
+  */
+  class Cursor
+  {
+  public:
+
+    iterator find(const key_type &key) {
+      return tree->cursor_search(*this, key, true);
+    }
+
+    iterator lower_bound(const key_type &key) {
+      return tree->cursor_search(*this, key, false);
+    }
+
+    iterator upper_bound(const key_type &key) {
+      iterator it = lower_bound(key);
+      if (it != tree->end() && it.get_key() == key) ++it;
+      return it;
+    }
+
+    bool contains(const key_type &key) { return find(key) != tree->end(); }
+
+  private:
+    friend class Tree;
+
+    // 路径上的一层: node往下走的是第idx个孩子，这个孩子下面的key都在 [*lo, *hi) 里 (nullptr表示这一边没有界)
+    struct Level {
+      inner_node *node;
+      size_t idx;
+      const key_type *lo, *hi;
+    };
+
+    const Tree *tree;
+    vector <Level> path;  // 从root下来经过的inner node
+    leaf_node *leaf;      // 上一次走到的leaf，nullptr表示还没有走过
+
+    explicit Cursor(const Tree *t) : tree(t), leaf(nullptr) {}
+
+  }; // end of Cursor
+
+
+
+// B+Tree public functions
+
+Tree() {
+
+  epoch = 1;
+  root = new_leaf();
+  num_elements = 0;
+  tombstone_ratio = 0.5;
+  tail = nullptr;
+}
+
+// 复制所有的node，新的tree和原来的tree没有任何共用的东西
+Tree(const Tree &t) {
+  leaf_node *last = nullptr;
+
+  epoch = 1;
+  root = copy_subtree(t.root, last);
+  num_elements = t.num_elements;
+  tombstone_ratio = t.tombstone_ratio;
+  tail = nullptr;
+}
+
+Tree(Tree &&t) : alloc(std::move(t.alloc)) {
+  epoch = t.epoch;
+  root = t.root;
+  num_elements = t.num_elements;
+  tombstone_ratio = t.tombstone_ratio;
+  snapshot_state = std::move(t.snapshot_state);
+  tail = t.tail;
+
+  t.snapshot_state = nullptr;
+  t.epoch = 1;
+  t.root = t.new_leaf();
+  t.num_elements = 0;
+  t.tail = nullptr;
+}
+
+Tree &operator=(const Tree &t) {
+  if (this != &t) *this = Tree(t);
+  return *this;
+}
+
+Tree &operator=(Tree &&t) {
+  if (this == &t) return *this;
+  release();
+  alloc = std::move(t.alloc);
+  epoch = t.epoch;
+  root = t.root;
+  num_elements = t.num_elements;
+  tombstone_ratio = t.tombstone_ratio;
+  snapshot_state = std::move(t.snapshot_state);
+  tail = t.tail;
+
+  t.snapshot_state = nullptr;
+  t.epoch = 1;
+  t.root = t.new_leaf();
+  t.num_elements = 0;
+  t.tail = nullptr;
+  return *this;
+}
+
+~Tree() {
+
+  release();
+}
+
+/* O(1)地拿到现在这颗树的只读snapshot。
+   之后writer要改一个snapshot看得到的node的时候，先把它和它上面的路径复制一份再改 (path copying)，
+   旧的node等到没有snapshot看得到它了再释放。
+   snapshot()和所有修改tree的函数一样只能在writer的线程里调用，snapshot本身可以交给别的线程读和析构。
+*/
+Snapshot snapshot() {
+  if (snapshot_state == nullptr) snapshot_state = std::make_shared<SnapshotState>();
+  reclaim();
+  Snapshot s(root, num_elements, epoch, snapshot_state);
+  epoch++;
+  return s;
+}
+
+// 在这个树里面插入key-value，key已经在的话覆盖value
+void insert(const key_type &key, val_type val) {
+  pair <iterator, bool> r = insert_unique(key, [&val]() -> val_type && { return std::move(val); });
+  if (!r.second) r.first.node->vals[r.first.idx] = std::move(val);
+}
+
+/* 和insert一样，只是先看hint (这颗树的一个iterator，比如上一次insert返回的) 的leaf：
+   key在这个leaf的范围里 (第一个和最后一个key之间，最左/最右的leaf往外也算)、leaf还放得下的时候，
+   不从root走，直接在leaf里插入或者覆盖。近似有序的key拿上一次返回的iterator当hint，大部分insert都不用走。
+   hint是end()、key不在这个leaf里、leaf满了、snapshot看得到它、order_statistics的时候和insert一样。
+   返回key的record。
+*/
+iterator insert(const iterator &hint, const key_type &key, val_type val) {
+  leaf_node *leaf = hint.node;
+  iterator it;
+  size_t i;
+
+  if (leaf != nullptr && hint.tree == this && !order_statistics && leaf->num_keys > 0 && leaf->num_keys + 1 < max_degree
+      && (leaf->prev_leaf == nullptr || !(key < leaf->keys[0]))
+      && (leaf->next_leaf == nullptr || !(leaf->keys[leaf->num_keys - 1] < key)) && !shared(leaf)) {
+    BPLUSTREE_STAT(inserts);
+    BPLUSTREE_STAT(direct_inserts);
+    auto make_val = [&val]() -> val_type && { return std::move(val); };
+    it.tree = this;
+    it.node = leaf;
+    i = search_type::upper_bound(leaf->keys.data(), leaf->num_keys, key);
+    if (i > 0 && leaf->keys[i - 1] == key) {
+      it.idx = i - 1;
+      leaf->vals[it.idx] = std::move(val);
+      if (is_dead(leaf, it.idx)) {
+        leaf->dead[it.idx] = false;
+        num_elements++;
+      }
+      return it;
+    }
+    it.idx = insert_in_leaf(leaf, i, key, make_val);
+    return it;
+  }
+
+  pair <iterator, bool> r = insert_unique(key, [&val]() -> val_type && { return std::move(val); });
+  if (!r.second) r.first.node->vals[r.first.idx] = std::move(val);
+  return r.first;
+}
+
+/* 和std::map一样: 用args构造一个 (key, val) pair，key不在的时候把它move进树里。
+   返回 (这个key的record, 是不是新插入的)。只从root往下走一次。
+*/
+template <class... Args>
+pair <iterator, bool> emplace(Args&&... args) {
+  pair <key_type, val_type> kv(std::forward<Args>(args)...);
+  return insert_unique(std::move(kv.first), [&kv]() -> val_type && { return std::move(kv.second); });
+}
+
+// key不在的时候才用args构造value (key在的时候args不会被动)
+template <class... Args>
+pair <iterator, bool> try_emplace(const key_type &key, Args&&... args) {
+  return insert_unique(key, [&]() { return val_type(std::forward<Args>(args)...); });
+}
+
+template <class... Args>
+pair <iterator, bool> try_emplace(key_type &&key, Args&&... args) {
+  return insert_unique(std::move(key), [&]() { return val_type(std::forward<Args>(args)...); });
+}
+
+// key在的时候把obj赋给value，不在的时候插入。second是true表示插入了
+template <class M>
+pair <iterator, bool> insert_or_assign(const key_type &key, M &&obj) {
+  pair <iterator, bool> r = insert_unique(key, [&]() { return val_type(std::forward<M>(obj)); });
+  if (!r.second) r.first.node->vals[r.first.idx] = std::forward<M>(obj);
+  return r;
+}
+
+/* 对key的value调用f(val_type &)，key不在的时候先插入val_type()。只走一次，也不复制value。
+   返回 (这个key的record, 是不是新插入的)。f抛异常的时候刚插入的record会被删掉。
+*/
+template <class Func>
+pair <iterator, bool> update(const key_type &key, Func f) {
+  pair <iterator, bool> r = insert_unique(key, []() { return val_type(); });
+  try {
+    f(r.first.node->vals[r.first.idx]);
+  } catch (...) {
+    if (r.second) erase(key);
+    throw;
+  }
+  return r;
+}
+
+iterator find(const key_type &key) const {
+
+  node_type *n = root;
+  iterator it;
+  size_t i;
+
+  BPLUSTREE_STAT(finds);
+
+  /* find the leaf node first */
+  while (!n->is_leaf) {
+    BPLUSTREE_STAT(nodes_visited);
+    n = as_inner(n)->nodes[child_index(n, key)];
+  }
+  BPLUSTREE_STAT(nodes_visited);
+
+  /* check to see if we find the key */
+  i = child_index(n, key);
+  if (i > 0 && n->keys[i - 1] == key && !is_dead(as_leaf(n), i - 1)) {
+    it.idx = i - 1;
+    it.node = as_leaf(n);
+    it.tree = this;
+    return it;
+  }
+  return end();
+}
+
+
+/* 一次查很多个key。一个find是从root到leaf一连串互相依赖的cache miss，
+   这里把find_batch_group个查找放在一起一层一层往下走: 每个查找算出下一层的node以后先prefetch，
+   等这一组都走完一层再回来访问它，这样这一组的内存延迟就重叠在一起了。
+   B+Tree所有leaf的深度一样，所以一组查找总是在同一层。
+*/
+void find_batch(const vector <key_type> &keys, vector <iterator> &out) const {
+  node_type *nodes[find_batch_group];
+  size_t start, count, i, j;
+
+  out.resize(keys.size());
+  for (start = 0; start < keys.size(); start += count) {
+    count = std::min(keys.size() - start, (size_t) find_batch_group);
+    for (j = 0; j < count; j++) nodes[j] = root;
+    BPLUSTREE_STAT_ADD(finds, count);
+
+    /* go down one level for the whole group */
+    while (!nodes[0]->is_leaf) {
+      BPLUSTREE_STAT_ADD(nodes_visited, count);
+      for (j = 0; j < count; j++) {
+        nodes[j] = as_inner(nodes[j])->nodes[child_index(nodes[j], keys[start + j])];
+        prefetch_node(nodes[j]);
+      }
+    }
+
+    BPLUSTREE_STAT_ADD(nodes_visited, count);
+    for (j = 0; j < count; j++) {
+      i = child_index(nodes[j], keys[start + j]);
+      if (i > 0 && nodes[j]->keys[i - 1] == keys[start + j] && !is_dead(as_leaf(nodes[j]), i - 1)) {
+        out[start + j].node = as_leaf(nodes[j]);
+        out[start + j].idx = i - 1;
+        out[start + j].tree = this;
+      } else {
+        out[start + j] = end();
+      }
+    }
+  }
+}
+
+void contains_batch(const vector <key_type> &keys, vector <bool> &out) const {
+  vector <iterator> its;
+  size_t i;
+
+  find_batch(keys, its);
+  out.resize(keys.size());
+  for (i = 0; i < keys.size(); i++) out[i] = (its[i] != end());
+}
+
+void erase(const key_type &key) {
+
+  node_type *n;
+  size_t i;
+  int delete_index = -1;
+  size_t min_keys = (max_degree - 1) / 2;
+  size_t size;
+  node_type *left, *right;
+  inner_node *parent;
+  leaf_node *leaf, *left_leaf, *right_leaf;
+  inner_node *inner, *left_inner, *right_inner;
+  size_t traverse_index;
+  vector <size_t> traverse_indices;
+  vector <inner_node*> parents;
+
+  /* remember an internal node along with index, whose key is euqal to param "key"
+     when we delete the leftmost key in the subtree, we will update the internal node's key,
+     which has the same value as param "key". The new key will be the new replaced element.
+  */
+  node_type *same_value_node = nullptr;
+  int same_value_index = -1;
+
+  if (lazy_erase) {
+    erase_lazily(key);
+    return;
+  }
+  BPLUSTREE_STAT(erases);
+
+  /* with live snapshots the path is copied on the way down, don't do that for nothing */
+  if (snapshot_state != nullptr && snapshot_state->live_max.load(std::memory_order_acquire) != 0 && find(key) == end()) return;
+
+  /* find the leaf node first */
+  n = writable(root, nullptr, 0);
+  while (!n->is_leaf) {
+    BPLUSTREE_STAT(nodes_visited);
+    i = child_index(n, key);
+    if (i > 0 && n->keys[i - 1] == key) {
+      same_value_node = n;
+      same_value_index = i - 1;
+    }
+
+    traverse_indices.push_back(i);
+    parents.push_back(as_inner(n));
+    n = writable(as_inner(n)->nodes[i], as_inner(n), i);
+  }
+  leaf = as_leaf(n);
+
+  /* find the index */
+  BPLUSTREE_STAT(nodes_visited);
+  i = child_index(leaf, key);
+  if (i > 0 && leaf->keys[i - 1] == key) delete_index = i - 1;
+
+  /* key is not found in tree */
+  if (delete_index == -1) return;
+
+
+  num_elements--;
+  count_path(parents, traverse_indices, -1);
+  /* delete the record */
+  array_erase(leaf->keys, leaf->num_keys, delete_index);
+  array_erase(leaf->vals, leaf->num_keys, delete_index);
+  leaf->num_keys--;
+  if (n == root) return;
+
+
+  /* case1: the bucket is big enough after deletion operation */
+  if (n->num_keys >= min_keys) {
+
+    /* the leftmost key is deleted */
+    if (same_value_node != nullptr) {
+        same_value_node->keys[same_value_index] = n->keys[0];
+    }
+    return;
+  }
+
+  /* merge or borrow the node from neighbors
+     until the size of current bucket is >= min_keys or get to root node
+  */
+  while (n->num_keys < min_keys && n != root) {
+
+
+    parent = parents[parents.size() - 1];
+    parents.pop_back();
+    traverse_index = traverse_indices[traverse_indices.size() - 1];
+    traverse_indices.pop_back();
+
+    /* the neighbors under the same parent. left is always modified (borrow or merge), right only when borrowing */
+    left = (traverse_index != 0) ? writable(parent->nodes[traverse_index - 1], parent, traverse_index - 1) : nullptr;
+    right = (traverse_index != parent->num_keys) ? parent->nodes[traverse_index + 1] : nullptr;
+
+    /* case:2 borrow from left node
+       when it's not the leftmost node in the substree and the left node's size is big enought.
+       traverse_index minus 1 is because the index of key is one less than the index of nodes.
+    */
+    if (left != nullptr) {
+      size = left->num_keys;
+
+      if (size > min_keys) {
+
+        traverse_index--;
+        /* if it's leaf nodes, we steal the rightmost key and val in the left node
            and update the parent's key with its key.
-           Otherwise we bring down the parent key to the current node and 
+           Otherwise we bring down the parent key to the current node and
+           bring up the rightmost key in the left node.
+        */
+        if(n->is_leaf) {
+          BPLUSTREE_STAT(leaf_borrows);
+          leaf = as_leaf(n);
+          left_leaf = as_leaf(left);
+          array_insert(leaf->keys, leaf->num_keys, 0, left_leaf->keys[size - 1]);
+          array_insert(leaf->vals, leaf->num_keys, 0, left_leaf->vals[size - 1]);
+          parent->keys[traverse_index] = KeySeparator<key_type>::between(left_leaf->keys[size - 2], leaf->keys[0]);
+        } else {
+          BPLUSTREE_STAT(inner_borrows);
+          inner = as_inner(n);
+          left_inner = as_inner(left);
+          array_insert(inner->keys, inner->num_keys, 0, parent->keys[traverse_index]);
+          array_insert(inner->nodes, inner->num_keys + 1, 0, left_inner->nodes[size]);
+          if (order_statistics) array_insert(inner->counts, inner->num_keys + 1, 0, left_inner->counts[size]);
+          parent->keys[traverse_index] = left_inner->keys[size - 1];
+        }
+        n->num_keys++;
+        left->num_keys--;
+        if (order_statistics) {
+          parent->counts[traverse_index] = subtree_size(left);
+          parent->counts[traverse_index + 1] = subtree_size(n);
+        }
+
+        return;
+      }
+
+    /* case3: borrow from right node */
+    } else if (right != nullptr) {
+
+
+      size = right->num_keys;
+
+      if (size > min_keys){
+        right = writable(right, parent, traverse_index + 1);
+         /* the leftmost key in the subtree could be deleted */
+         if (same_value_node != nullptr && n->num_keys != 0) {
+          same_value_node->keys[same_value_index] = n->keys[0];
+         }
+
+        /* if it's leaf nodes, we steal the leftmost key and val in the right node
+           and update the parent's key with its key.
+           Otherwise we bring down the parent key to the current node and
            bring up the leftmost key in the right node.
         */
 
-        if(records) {
-          n->keys.push_back(right->keys[0]);
-          // I haven't delete it, so we use index 1.
-          parent->keys[traverse_index] = right->keys[1]; 
-          
-          n->vals.push_back(right->vals[0]);
-          right->vals.erase(right->vals.begin());       
+        if(n->is_leaf) {
+          BPLUSTREE_STAT(leaf_borrows);
+          leaf = as_leaf(n);
+          right_leaf = as_leaf(right);
+          leaf->keys[leaf->num_keys] = right_leaf->keys[0];
+          leaf->vals[leaf->num_keys] = right_leaf->vals[0];
+          // I haven't delete it, so we use index 1.
+          parent->keys[traverse_index] = KeySeparator<key_type>::between(right_leaf->keys[0], right_leaf->keys[1]);
+
+          array_erase(right_leaf->vals, size, 0);
+
+        } else {
+          BPLUSTREE_STAT(inner_borrows);
+          inner = as_inner(n);
+          right_inner = as_inner(right);
+          inner->keys[inner->num_keys] = parent->keys[traverse_index];
+          inner->nodes[inner->num_keys + 1] = right_inner->nodes[0];
+          parent->keys[traverse_index] = right_inner->keys[0];
+
+          array_erase(right_inner->nodes, size + 1, 0);
+          if (order_statistics) {
+            inner->counts[inner->num_keys + 1] = right_inner->counts[0];
+            array_erase(right_inner->counts, size + 1, 0);
+          }
+        }
+
+        array_erase(right->keys, size, 0);
+        n->num_keys++;
+        right->num_keys--;
+        if (order_statistics) {
+          parent->counts[traverse_index] = subtree_size(n);
+          parent->counts[traverse_index + 1] = subtree_size(right);
+        }
+
+        return;
+
+      }
+    }
+
+    /* case:4 merge the node to left node */
+    if (left != nullptr) {
+
+      if (n->is_leaf) {
+        BPLUSTREE_STAT(leaf_merges);
+        leaf = as_leaf(n);
+        left_leaf = as_leaf(left);
+
+        /* reset the next and prev leaf */
+        left_leaf->next_leaf = leaf->next_leaf;
+        if (leaf->next_leaf != nullptr) leaf->next_leaf->prev_leaf = left_leaf;
+
+        /* merge keys */
+        std::move(leaf->keys.begin(), leaf->keys.begin() + leaf->num_keys, left_leaf->keys.begin() + left_leaf->num_keys);
+        std::move(leaf->vals.begin(), leaf->vals.begin() + leaf->num_keys, left_leaf->vals.begin() + left_leaf->num_keys);
+        left_leaf->num_keys += leaf->num_keys;
+
+      /* when it's not leaf nodes, bring down the parent key and merge nodes as well */
+      } else {
+        BPLUSTREE_STAT(inner_merges);
+        inner = as_inner(n);
+        left_inner = as_inner(left);
+        left_inner->keys[left_inner->num_keys] = parent->keys[traverse_index - 1];
+        std::move(inner->keys.begin(), inner->keys.begin() + inner->num_keys, left_inner->keys.begin() + left_inner->num_keys + 1);
+        std::copy(inner->nodes.begin(), inner->nodes.begin() + inner->num_keys + 1, left_inner->nodes.begin() + left_inner->num_keys + 1);
+        if (order_statistics) std::copy(inner->counts.begin(), inner->counts.begin() + inner->num_keys + 1, left_inner->counts.begin() + left_inner->num_keys + 1);
+        left_inner->num_keys += inner->num_keys + 1;
+      }
+
+
+      // erase the parent key and node
+      array_erase(parent->keys, parent->num_keys, traverse_index - 1);
+      array_erase(parent->nodes, parent->num_keys + 1, traverse_index);
+      if (order_statistics) {
+        array_erase(parent->counts, parent->num_keys + 1, traverse_index);
+        parent->counts[traverse_index - 1] = subtree_size(left);
+      }
+      parent->num_keys--;
+
+
+      /* merge into a root node */
+      if(parent->num_keys == 0 && parent == root) {
+        BPLUSTREE_STAT(root_collapses);
+        free_node(n);
+        free_node(root);
+        root = left;
+        return;
+      }
+
+      free_node(n);
+      n = parent;
+
+
+    /* case5: merge the right node to n node */
+    } else if (right != nullptr) {
+
+      /* we may delete the leftmost key in the subtree */
+      if (same_value_node != nullptr && n->num_keys != 0) {
+        same_value_node->keys[same_value_index] = n->keys[0];
+      }
+
+      if (n->is_leaf) {
+        BPLUSTREE_STAT(leaf_merges);
+        leaf = as_leaf(n);
+        right_leaf = as_leaf(right);
+
+        leaf->next_leaf = right_leaf->next_leaf;
+        if (right_leaf->next_leaf != nullptr) right_leaf->next_leaf->prev_leaf = leaf;
+
+        /* get keys and vals */
+        take(right, right_leaf->keys.begin(), right_leaf->keys.begin() + right_leaf->num_keys, leaf->keys.begin() + leaf->num_keys);
+        take(right, right_leaf->vals.begin(), right_leaf->vals.begin() + right_leaf->num_keys, leaf->vals.begin() + leaf->num_keys);
+        leaf->num_keys += right_leaf->num_keys;
+
+      /* when it's not leaf nodes, bring down the parent key and merge nodes as well */
+      } else {
+        BPLUSTREE_STAT(inner_merges);
+        inner = as_inner(n);
+        right_inner = as_inner(right);
+        inner->keys[inner->num_keys] = parent->keys[traverse_index];
+        take(right, right_inner->keys.begin(), right_inner->keys.begin() + right_inner->num_keys, inner->keys.begin() + inner->num_keys + 1);
+        std::copy(right_inner->nodes.begin(), right_inner->nodes.begin() + right_inner->num_keys + 1, inner->nodes.begin() + inner->num_keys + 1);
+        if (order_statistics) std::copy(right_inner->counts.begin(), right_inner->counts.begin() + right_inner->num_keys + 1, inner->counts.begin() + inner->num_keys + 1);
+        inner->num_keys += right_inner->num_keys + 1;
+      }
+
+      /* update parent nodes and keys */
+      array_erase(parent->keys, parent->num_keys, traverse_index);
+      array_erase(parent->nodes, parent->num_keys + 1, traverse_index + 1);
+      if (order_statistics) {
+        array_erase(parent->counts, parent->num_keys + 1, traverse_index + 1);
+        parent->counts[traverse_index] = subtree_size(n);
+      }
+      parent->num_keys--;
+
+
+      if(parent->num_keys == 0 && parent == root) {
+        BPLUSTREE_STAT(root_collapses);
+        free_node(right);
+        free_node(root);
+        root = n;
+        return;
+      }
+
+      free_node(right);
+      n = parent;
+
+    }
+
+    same_value_node =nullptr;
+  }
+
+}
+
+void erase(const reverse_iterator &rit) {
+  erase(rit.get_key());
+}
+
+void erase(const iterator &it) {
+  erase(it.get_key());
+}
+
+/* 删掉 [lo, hi) 里所有的records，返回删掉的个数。
+   整个在范围里的leaf和子树直接摘掉，只有包含lo和hi的两条路径上的node会被部分修改，
+   之后也只沿着这两条路径合并或者平分太小的node，不像erase(key)那样每个key都从root走一次。
+*/
+size_t erase_range(const key_type &lo, const key_type &hi) {
+  if (!(lo < hi)) return 0;
+  return erase_between(lo, &hi);
+}
+
+// 和std::map一样，删掉 [first, last)，返回删完以后last指向的record (它原来的iterator不能再用了)
+iterator erase(const iterator &first, const iterator &last) {
+  key_type hi;
+
+  if (first == last) return last;
+  if (last == end()) {
+    erase_between(first.get_key(), nullptr);
+    return end();
+  }
+  hi = last.get_key();
+  erase_between(first.get_key(), &hi);
+  return lower_bound(hi);
+}
+
+/* 把 >= key 的records切下来，作为一颗新的树返回，这颗树留下 < key 的。
+   只沿着key的路径把每层的node一分为二，两边的子树整个交给新树，不移动records，
+   再沿着切口从上往下合并或者平分太小的node。有order_statistics的时候是O(log n)，
+   没有的话还要数一遍小的那一边的leaf才知道两边各有多少records。
+   两颗树以后共用allocator的chunk。这颗树有活着的snapshot的时候，它们还看得到切下来的node，
+   只好把上半部分复制一份给新树。
+*/
+Tree split_at(const key_type &key) {
+  Tree upper;
+  node_type *left, *right;
+  leaf_node *last, *first, *l;
+  size_t moved;
+  bool snapshots = reclaim();
+
+  if (lower_bound(key) == end()) return upper;  // 没有要切下来的，有snapshot的时候也不复制路径
+
+  cut(writable(root, nullptr, 0), key, left, right);
+
+  /* the two halves of the leaf chain */
+  last = (left == nullptr) ? nullptr : last_leaf_of(left);
+  first = (right == nullptr) ? nullptr : first_leaf_of(right);
+  moved = order_statistics ? subtree_size(right) : count_after(last, first);
+  if (last != nullptr) last->next_leaf = nullptr;
+  first->prev_leaf = nullptr;
+
+  root = (left == nullptr) ? new_leaf() : left;
+  num_elements -= moved;
+  tail = nullptr;  // 可能已经是upper的了
+  repair_path(key, true);
+
+  upper.free_node(upper.root);
+  upper.epoch = epoch;  // the nodes keep their birth
+  if (snapshots) {
+    l = nullptr;
+    upper.root = upper.copy_subtree(right, l);
+    free_subtree(right);
+  } else {
+    upper.alloc.share(alloc);
+    upper.root = right;
+  }
+  upper.num_elements = moved;
+  upper.repair_path(key, false);
+  return upper;
+}
+
+/* 把other的records都拿过来，other变成空的。两颗树的key不能有重叠 (other整个在左边或者右边都可以)，
+   否则抛出 invalid_argument，两颗树都不变。
+   矮的那颗树的root接到高的那颗树边上同样高度的地方，和insert一样可能一路分裂上去，
+   再把接口处太小的node合并或者平分，O(log n)。
+   other有活着的snapshot的时候先复制一份 (snapshot还要读它的node)。
+*/
+void join(Tree &&other) {
+  node_type *left, *right;
+  leaf_node *last, *first;
+  key_type sep;
+  size_t left_size, right_size;
+  bool append = true;
+
+  if (&other == this || other.empty()) return;
+  if (!empty()) {
+    if (rbegin().get_key() < other.begin().get_key()) {
+      append = true;
+    } else if (other.rbegin().get_key() < begin().get_key()) {
+      append = false;
+    } else {
+      throw std::invalid_argument("B+Tree: join needs two trees whose keys don't overlap");
+    }
+    if (lazy_erase && !(append ? ends_before(other) : other.ends_before(*this))) {  // only the tombstones overlap
+      compact();
+      other.compact();
+    }
+  }
+
+  if (other.reclaim()) {
+    Tree copy(other);
+    other.clear();
+    join(std::move(copy));
+    return;
+  }
+
+  alloc.share(other.alloc);
+  epoch = std::max(epoch, other.epoch);  // other的node的birth不能比这颗树以后的snapshot新
+  right = other.root;
+  other.root = other.new_leaf();
+  other.tail = nullptr;
+  tail = nullptr;
+  if (empty()) {
+    free_subtree(root);  // tombstones
+    root = right;
+    std::swap(num_elements, other.num_elements);
+    return;
+  }
+
+  left = root;
+  left_size = num_elements;
+  right_size = other.num_elements;
+  if (!append) {
+    std::swap(left, right);
+    std::swap(left_size, right_size);
+  }
+  last = last_leaf_of(left);
+  first = first_leaf_of(right);
+  last->next_leaf = first;
+  first->prev_leaf = last;
+  sep = KeySeparator<key_type>::between(last->keys[last->num_keys - 1], first->keys[0]);
+
+  stitch(left, left_size, right, right_size, sep);
+  num_elements += other.num_elements;
+  other.num_elements = 0;
+  repair_path(sep, true);
+  repair_path(sep, false);
+}
+
+/* lazy_erase: 去掉所有的tombstone，太小的leaf和兄弟合并或者平分，返回去掉的tombstone的个数。
+   沿着leaf的链表走，只有有tombstone的leaf才从root走一次 (复制路径、rebalance)。不是lazy_erase的时候什么都不做。
+*/
+size_t compact() {
+  leaf_node *leaf;
+  size_t removed = 0;
+
+  if (!lazy_erase) return 0;
+  leaf = leftmost_leaf();
+  while (leaf != nullptr) {
+    if (subtree_size(leaf) == leaf->num_keys) {
+      leaf = leaf->next_leaf;
+      continue;
+    }
+    key_type last = leaf->keys[leaf->num_keys - 1];
+    removed += purge_at(leaf->keys[0]);
+    leaf = leaf_of(last);  // 合并的时候可能从右边的兄弟拿来了新的tombstone，再看一次
+  }
+  return removed;
+}
+
+/* erase(key)以后leaf里tombstone的比例 >= ratio就purge这个leaf。
+   0是每次erase都马上删 (和没有lazy_erase差不多)，> 1是只有compact()和insert碰到满的leaf的时候才删
+*/
+void set_tombstone_ratio(double ratio) {
+  tombstone_ratio = ratio;
+}
+
+/* 批量修改，[first, last) 必须按key排好序，相同的key按先后顺序生效。
+   落在同一个leaf里的key只从root走一次: 先把这些修改和leaf原来的records merge在一起再写回去，
+   leaf放不下就一次分裂成几个leaf，太小就和兄弟合并或者平分一次，而不是每个key都分裂/合并一次。
+   输入没有排序会抛出 invalid_argument，这时候树没有被修改。
+*/
+template <class ForwardIt>
+void insert_batch(ForwardIt first, ForwardIt last) {
+  apply_sorted(first, last,
+    [](const ForwardIt &it) -> const key_type & { return it->first; },
+    [](const ForwardIt &) { return false; },
+    [](const ForwardIt &it) -> const val_type & { return it->second; });
+}
+
+template <class ForwardIt>
+void erase_batch(ForwardIt first, ForwardIt last) {
+  apply_sorted(first, last,
+    [](const ForwardIt &it) -> const key_type & { return *it; },
+    [](const ForwardIt &) { return true; },
+    [](const ForwardIt &) { return val_type(); });
+}
+
+template <class ForwardIt>
+void apply_batch(ForwardIt first, ForwardIt last) {
+  apply_sorted(first, last,
+    [](const ForwardIt &it) -> const key_type & { return it->key; },
+    [](const ForwardIt &it) { return it->erase; },
+    [](const ForwardIt &it) -> const val_type & { return it->val; });
+}
+
+bool contains(const key_type &k) {
+  return (find(k) != end());
+}
+
+
+/* order_statistics = true 才有的函数，都是O(log n) */
+
+// 第k个record (从0开始)，k >= size()的时候返回end()
+iterator nth(size_t k) const {
+  static_assert(order_statistics, "B+Tree: nth() needs order_statistics = true");
+  return nth_record(k);
+}
+
+// 比key小的record的个数，也就是lower_bound(key)的位置
+size_t rank(const key_type &key) const {
+  static_assert(order_statistics, "B+Tree: rank() needs order_statistics = true");
+  return rank_of(key);
+}
+
+// [lo, hi) 里record的个数
+size_t count_range(const key_type &lo, const key_type &hi) const {
+  static_assert(order_statistics, "B+Tree: count_range() needs order_statistics = true");
+  if (!(lo < hi)) return 0;
+  return rank_of(hi) - rank_of(lo);
+}
+
+size_t size() const { return num_elements; };
+bool empty() const { return (num_elements == 0); };
+
+// 删除了所有的node
+void clear() {
+  destroy_tree(root);
+  root = new_leaf();
+  num_elements = 0;
+}
+
+/* 一层一层地走一遍整棵树，数每层的node和key；计数器是BPLUSTREE_STATS的时候每个操作顺便加的 */
+TreeStats stats() const {
+  TreeStats s;
+  vector <const node_type*> level, next;
+  size_t i, j, keys;
+
+  s.size = num_elements;
+  for (level.push_back(root); !level.empty(); level.swap(next)) {
+    next.clear();
+    keys = 0;
+    for (i = 0; i < level.size(); i++) {
+      keys += level[i]->num_keys;
+      if (level[i]->is_leaf) {
+        s.tombstones += level[i]->num_keys - subtree_size(level[i]);
+        continue;
+      }
+      for (j = 0; j <= level[i]->num_keys; j++) next.push_back(as_inner(level[i])->nodes[j]);
+    }
+    s.nodes_per_level.push_back(level.size());
+    s.keys_per_level.push_back(keys);
+    s.fill_per_level.push_back((double) keys / (level.size() * (max_degree - 1)));
+    if (level[0]->is_leaf) s.leaf_nodes = level.size();
+    else s.inner_nodes += level.size();
+  }
+  s.height = s.nodes_per_level.size();
+  s.leaf_fill = s.fill_per_level.back();
+  s.node_bytes = s.inner_nodes * sizeof(inner_node) + s.leaf_nodes * sizeof(leaf_node);
+#ifdef BPLUSTREE_STATS
+  counters.copy_to(s);
+#endif
+  return s;
+}
+
+void reset_stats() {
+#ifdef BPLUSTREE_STATS
+  counters.reset();
+#endif
+}
+
+/* 从按key排好序的 (key, val) pair 自底向上建树，线性时间，代替一个一个insert。
+   1.先把pair按顺序放满leaf (fill_factor * (M-1) 个key)，最后一个leaf太小的话和前一个leaf合并或者平分
+   2.再把每一层的node按 fill_factor * M 个孩子一组建上一层，直到只剩一个node，就是root
+   原来树里的内容会被清空。相同的key只保留最后一个，和依次insert的结果一样。
+   输入不是有序的会抛出 invalid_argument，树变成空的。
+*/
+template <class InputIt>
+void bulk_load(InputIt first, InputIt last, double fill_factor = 1.0) {
+  size_t min_keys = (max_degree - 1) / 2;
+  size_t leaf_target, inner_target;
+  size_t i, j, total, moved;
+  vector <leaf_node*> leaves;
+  vector <node_type*> level, next_level;
+  vector <key_type> mins, next_mins;  // mins[i]是level[i]左边的separator (<= 这颗子树里最小的key)
+  vector <size_t> groups;
+  leaf_node *leaf, *prev;
+  inner_node *inner;
+
+  if (!(fill_factor > 0 && fill_factor <= 1)) throw std::invalid_argument("B+Tree: fill_factor must be in (0, 1]");
+  leaf_target = fill_target(fill_factor, max_degree - 1, min_keys);
+  inner_target = fill_target(fill_factor, max_degree, min_keys + 1);
+
+  clear();
+
+  /* fill the leaves from left to right */
+  leaf = as_leaf(root);
+  leaves.push_back(leaf);
+  for (; first != last; ++first) {
+    if (num_elements != 0) {
+      if (first->first < leaf->keys[leaf->num_keys - 1]) {
+        for (i = 0; i < leaves.size(); i++) free_node(leaves[i]);
+        root = new_leaf();
+        num_elements = 0;
+        throw std::invalid_argument("B+Tree: bulk_load input is not sorted");
+      }
+      /* the same key again, the later value wins */
+      if (first->first == leaf->keys[leaf->num_keys - 1]) {
+        leaf->vals[leaf->num_keys - 1] = first->second;
+        continue;
+      }
+    }
+
+    if (leaf->num_keys == leaf_target) {
+      prev = leaf;
+      leaf = new_leaf();
+      prev->next_leaf = leaf;
+      leaf->prev_leaf = prev;
+      leaves.push_back(leaf);
+    }
+    leaf->keys[leaf->num_keys] = first->first;
+    leaf->vals[leaf->num_keys] = first->second;
+    leaf->num_keys++;
+    num_elements++;
+  }
+
+  /* the last leaf is too small: merge it into the previous one, or split the two evenly */
+  if (leaves.size() > 1 && leaf->num_keys < min_keys) {
+    prev = leaf->prev_leaf;
+    total = prev->num_keys + leaf->num_keys;
+    if (total <= max_degree - 1) {
+      std::move(leaf->keys.begin(), leaf->keys.begin() + leaf->num_keys, prev->keys.begin() + prev->num_keys);
+      std::move(leaf->vals.begin(), leaf->vals.begin() + leaf->num_keys, prev->vals.begin() + prev->num_keys);
+      prev->num_keys = total;
+      prev->next_leaf = nullptr;
+      free_node(leaf);
+      leaves.pop_back();
+    } else {
+      moved = total / 2 - leaf->num_keys;
+      std::move_backward(leaf->keys.begin(), leaf->keys.begin() + leaf->num_keys, leaf->keys.begin() + leaf->num_keys + moved);
+      std::move_backward(leaf->vals.begin(), leaf->vals.begin() + leaf->num_keys, leaf->vals.begin() + leaf->num_keys + moved);
+      std::move(prev->keys.begin() + prev->num_keys - moved, prev->keys.begin() + prev->num_keys, leaf->keys.begin());
+      std::move(prev->vals.begin() + prev->num_keys - moved, prev->vals.begin() + prev->num_keys, leaf->vals.begin());
+      prev->num_keys -= moved;
+      leaf->num_keys += moved;
+    }
+  }
+
+  for (i = 0; i < leaves.size(); i++) {
+    level.push_back(leaves[i]);
+    if (i == 0) mins.push_back(leaves[i]->keys[0]);
+    else mins.push_back(KeySeparator<key_type>::between(leaves[i - 1]->keys[leaves[i - 1]->num_keys - 1], leaves[i]->keys[0]));
+  }
+
+  /* build the inner levels bottom-up */
+  while (level.size() > 1) {
+    groups = group_sizes(level.size(), inner_target, min_keys + 1, max_degree);
+    next_level.clear();
+    next_mins.clear();
+
+    for (i = 0, j = 0; i < groups.size(); i++) {
+      inner = new_inner();
+      inner->num_keys = groups[i] - 1;
+      next_mins.push_back(mins[j]);
+      inner->nodes[0] = level[j++];
+      for (total = 1; total < groups[i]; total++, j++) {
+        inner->keys[total - 1] = mins[j];
+        inner->nodes[total] = level[j];
+      }
+      if (order_statistics) recount(inner);
+      next_level.push_back(inner);
+    }
+
+    level.swap(next_level);
+    mins.swap(next_mins);
+  }
+
+  root = level[0];
+}
+
+/* 输入没有排序的时候，先用num_threads个线程并行排序(stable，所以重复的key还是最后一个生效)，再bulk_load */
+template <class InputIt>
+void bulk_load_unsorted(InputIt first, InputIt last, double fill_factor = 1.0, size_t num_threads = default_threads()) {
+  vector <pair<key_type, val_type> > v;
+
+  for (; first != last; ++first) v.push_back(make_pair(first->first, first->second));
+  parallel_stable_sort(v, [](const pair<key_type, val_type> &a, const pair<key_type, val_type> &b) {
+    return a.first < b.first;
+  }, num_threads);
+  bulk_load(v.begin(), v.end(), fill_factor);
+}
+
+/* 按顺序把所有records写成一个image (格式见b+tree_image.h)。先写path.tmp，fsync以后rename，
+   所以path要么是旧的image，要么是完整的新image。
+*/
+void save(const string &path) const {
+  ImageWriter<key_type, val_type> w(path);
+  leaf_node *leaf;
+  size_t i;
+
+  for (leaf = (num_elements == 0) ? nullptr : leftmost_leaf(); leaf != nullptr; leaf = leaf->next_leaf) {
+    for (i = 0; i < leaf->num_keys; i++) {
+      if (!is_dead(leaf, i)) w.add(leaf->keys[i], leaf->vals[i]);
+    }
+  }
+  w.finish();
+}
+
+/* 只检查header，不读数据，所以打开是常数时间；查询只碰到用到的几个page */
+static MappedTree<key_type, val_type> open_readonly(const string &path) {
+  return MappedTree<key_type, val_type>(path);
+}
+
+/* image里的records已经排好序，检查整个文件的crc32以后直接bulk_load */
+void load(const string &path, double fill_factor = 1.0) {
+  MappedTree<key_type, val_type> image(path, true);
+  bulk_load(image.records_begin(), image.records_end(), fill_factor);
+}
+
+iterator upper_bound(const key_type &key) const {
+
+  iterator it = lower_bound(key);
+  if (it == end()) return it;
+  if (it.get_key() == key) it++;
+  return it;
+
+}
+
+iterator lower_bound(const key_type &key) const {
+  iterator it;
+
+  BPLUSTREE_STAT(lower_bounds);
+  it = first_slot(key);
+  skip_dead(it.node, it.idx);
+  return it;
+}
+
+// 一个新的Cursor，第一次find/lower_bound/upper_bound从root走
+Cursor cursor() const {
+  return Cursor(this);
+}
+
+
+// num_threads > 1 的时候分段并行地填 (树很小的时候还是一个线程)
+vector <key_type> get_keys(size_t num_threads = 1) const {
+  vector <key_type> rv;
+  export_all(rv, num_threads, [](const leaf_node *n, size_t i) -> const key_type & { return n->keys[i]; });
+  return rv;
+}
+
+vector <val_type> get_vals(size_t num_threads = 1) const {
+  vector <val_type> rv;
+  export_all(rv, num_threads, [](const leaf_node *n, size_t i) -> const val_type & { return n->vals[i]; });
+  return rv;
+}
+
+/* 把 [lo, hi) 按inner node的separator切成大约parts段，每段是几颗相邻子树里的records。
+   返回每段的 [first, last)，段和段不重叠，按顺序接起来正好是 [lower_bound(lo), lower_bound(hi))，空的段不返回。
+   每一段可以交给一个线程去遍历 (只读)。
+*/
+vector <pair<iterator, iterator> > split_range(const key_type &lo, const key_type &hi, size_t parts) const {
+  if (!(lo < hi)) return vector <pair<iterator, iterator> >();
+  return split(&lo, &hi, parts);
+}
+
+/* 对 [lo, hi) 里的每个record调用 f(key, val)，用num_threads个线程同时处理split_range分出来的段。
+   同一段里的records在一个线程里按顺序访问，f会被几个线程同时调用。
+*/
+template <class Func>
+void parallel_scan(const key_type &lo, const key_type &hi, Func f, size_t num_threads = default_threads()) const {
+  vector <pair<iterator, iterator> > parts = split_range(lo, hi, num_threads * scan_parts_per_thread);
+  parallel_for(parts.size(), num_threads, [&](size_t p) { scan(parts[p].first, parts[p].second, f); });
+}
+
+// 整棵树
+template <class Func>
+void parallel_scan(Func f, size_t num_threads = default_threads()) const {
+  vector <pair<iterator, iterator> > parts = split(nullptr, nullptr, num_threads * scan_parts_per_thread);
+  parallel_for(parts.size(), num_threads, [&](size_t p) { scan(parts[p].first, parts[p].second, f); });
+}
+
+/* 对 [lo, hi) 里的每个record按顺序调用 f(const key_type &, const val_type &)，在一个线程里。
+   直接读leaf里的数组，key和val都不复制，也不用iterator一个一个加 */
+template <class Func>
+void for_each_range(const key_type &lo, const key_type &hi, Func f) const {
+  if (!(lo < hi)) return;
+  scan(first_slot(lo), first_slot(hi), f);  // 不跳过tombstone，否则lo的位置可能跳到hi的后面去
+}
+
+val_type at(const key_type &key) const {
+  iterator it = find(key);
+  return it.get_val();
+}
+// key不在的时候插入val_type()。只走一次，路径上的node已经是writable的，所以引用不会指向snapshot看得到的node
+val_type & operator[] (const key_type &key) {
+  BPLUSTREE_STAT(subscripts);
+  pair <iterator, bool> r = insert_unique(key, []() { return val_type(); });
+  return r.first.node->vals[r.first.idx];
+}
+
+reverse_iterator rbegin() const {
+  reverse_iterator rit;
+  node_type *n = root;
+
+  rit.tree = this;
+  if(num_elements == 0) {
+    rit.node = nullptr;
+    rit.idx = 0;
+    return rit;
+  }
+
+  /* find the rightmost node */
+  while (!n->is_leaf) {
+    n = as_inner(n)->nodes[n->num_keys];
+  }
+
+  rit.node = as_leaf(n);
+  rit.idx = n->num_keys - 1;
+  skip_dead_back(rit.node, rit.idx);
+
+
+  return rit;
+}
+
+reverse_iterator rend() const {
+  reverse_iterator rit;
+  rit.tree = this;
+  rit.node = nullptr;
+  rit.idx = 0;
+  return rit;
+}
+
+iterator begin() const {
+
+  iterator it;
+
+  it.tree = this;
+  if(num_elements == 0) {
+    it.node = nullptr;
+    it.idx = 0;
+    return it;
+  }
+
+  /* find the leftmost node */
+  it.node = leftmost_leaf();
+  it.idx = 0;
+  skip_dead(it.node, it.idx);
+
+  return it;
+}
+
+iterator end() const {
+  iterator it;
+  it.tree = this;
+  it.node = nullptr;
+  it.idx = 0;
+  return it;
+}
+
+// 整棵树的第一段
+block_iterator block_begin() const {
+  block_iterator b;
+  b.node = leftmost_leaf();
+  b.from = 0;
+  b.stop_node = nullptr;
+  b.stop_idx = 0;
+  b.settle();
+  return b;
+}
+
+// [lo, hi) 的第一段
+block_iterator block_begin(const key_type &lo, const key_type &hi) const {
+  block_iterator b;
+  iterator first, last;
+
+  if (!(lo < hi)) return block_end();
+  first = first_slot(lo);
+  last = first_slot(hi);
+  b.node = first.node;
+  b.from = first.idx;
+  b.stop_node = last.node;
+  b.stop_idx = last.idx;
+  b.settle();
+  return b;
+}
+
+block_iterator block_end() const {
+  block_iterator b;
+  b.node = nullptr;
+  b.from = b.to = 0;
+  b.stop_node = nullptr;
+  b.stop_idx = 0;
+  return b;
+}
+
+
+
+private:
+  size_t num_elements;  // 这颗树中存的key-value的数量
+  node_type *root;  // Tree Root
+  static const size_t max_degree = max_children;  // M
+  allocator_type alloc;  // 所有node都从这里分配
+  static const size_t find_batch_group = 32;  // find_batch里一起往下走的查找个数
+  static const size_t cursor_hops = 4;  // Cursor最多沿着next_leaf往右跳几个leaf，再远就往上走
+  static const size_t scan_parts_per_thread = 4;   // parallel_scan给每个线程分几段，子树大小不一样，多分几段好平衡
+  static const size_t parallel_export_min = 1 << 16;  // 比这个小的树get_keys/get_vals不开线程
+  size_t epoch;  // 新node的birth。每次snapshot()加一
+  std::shared_ptr <SnapshotState> snapshot_state;  // 第一次snapshot()的时候才创建
+  vector <inner_node*> path_nodes;  // insert_unique从root下来的路径
+  vector <size_t> path_indices;
+  double tombstone_ratio;  // lazy_erase: leaf里tombstone占到这个比例就purge
+  leaf_node *tail;        // 最右边的leaf，比最大的key还大的key直接插到这里。nullptr表示不知道，下一次insert走到它的时候再记下来
+#ifdef BPLUSTREE_STATS
+  mutable TreeCounters counters;  // 只在BPLUSTREE_STATS的时候有，见b+tree_stats.h
+#endif
+
+/* insert/emplace/try_emplace/insert_or_assign/update/operator[] 共用的插入，从root往下只走一次。
+   key已经在的时候什么都不改，返回 (那个record, false)；
+   否则插入key和make_val()的结果，返回 (新的record, true)。make_val只在插入的时候调用。
+   node里的slot一直是构造好的对象，所以value是move赋值进slot的。
+*/
+template <class K, class MakeVal>
+pair <iterator, bool> insert_unique(K &&key, MakeVal make_val) {
+  /** insert
+   * 1.找到要插入的叶子结点n
+   * 2.如果叶子结点中key存在了，那么直接返回;   如果key不存在，那么继续走到3
+   * 3.num_elements++     (num_elements表示这颗树中存的key-value的数量)
+   * 4.将这个key-value插入到keys和vals数组中
+   * 5.插入后检查size，如果size==M，表明要分裂了，分裂的过程在split单独说
+   */
+
+  /** split:分裂的做法是一个递归的分裂，每当这个node满了就会分裂，并可能递归导致parent分裂
+   * 1.inner node: L split to L and L2, MOVE L2 to parent
+   * 2.leaf node: L split to L and L2, COPY L2 to parent
+   * 3.root node: when root node need to split , need to new a root
+   *
+   * 顺序插入 (新key在leaf的最后一个slot，而且是最右边的leaf或者上一个新key就在它前面一个slot) 的时候，
+   * leaf在新key后面切开而不是在中间，左边的leaf是满的，以后也不会再有key插进来；
+   * 新的leaf放在parent最后的时候parent也只留一个key给右边，所以一直append的树每个node都是满的
+   */
+  size_t i, j, traverse_index;
+  key_type median_key;
+  // 路径放在成员里，capacity留着，每次insert不用再分配
+  vector <size_t> &traverse_indices = path_indices; // record the index of  node in search path
+  vector <inner_node*> &parents = path_nodes; // record the node in search path
+
+  node_type *n;
+  node_type *right;
+  inner_node *parent;
+  leaf_node *leaf, *right_leaf;
+  inner_node *inner, *right_inner;
+  iterator it;  // 返回的record，leaf分裂的时候可能到右边的leaf里去
+  bool sequential;
+
+
+  BPLUSTREE_STAT(inserts);
+  it.tree = this;
+
+  /* key比最后一个key大，最后一个leaf放得下的时候不用从root走 */
+  leaf = tail;
+  if (leaf != nullptr && leaf->next_leaf == nullptr && leaf->num_keys > 0 && leaf->num_keys + 1 < max_degree
+      && leaf->keys[leaf->num_keys - 1] < key && !shared(leaf)) {
+    if (order_statistics) {
+      for (n = root; !n->is_leaf; n = as_inner(n)->nodes[n->num_keys]) as_inner(n)->counts[n->num_keys]++;
+    }
+    BPLUSTREE_STAT(direct_inserts);
+    it.node = leaf;
+    it.idx = insert_in_leaf(leaf, leaf->num_keys, std::forward<K>(key), make_val);
+    return make_pair(it, true);
+  }
+
+  n = writable(root, nullptr, 0);  // 有snapshot的时候，沿路复制会被改的node
+  traverse_indices.clear();
+  parents.clear();
+
+  /* find the leaf node */
+  while (1) {
+    /* 找到应该遍历的子节点node[i] */
+    BPLUSTREE_STAT(nodes_visited);
+    i = child_index(n, key);
+    /* 记录路径中的各个parent，并判断为叶子节点时终止，更新n */
+    if (!n->is_leaf) {  // 如果n不是叶子节点才会去记录
+      traverse_indices.push_back(i);  // 记录遍历路径中node的下标
+      parents.push_back(as_inner(n));   // 记录遍历路径中的node
+      n = writable(as_inner(n)->nodes[i], as_inner(n), i);
+    } else break; // n是叶子结点了，ok就找到啦
+  }
+  leaf = as_leaf(n);
+
+  /* key exists */
+  // keys[i-1] <= key < keys[i]，所以只需要看keys[i-1]
+  if (i > 0 && leaf->keys[i - 1] == key) { // 如果key存在了，那么就直接返回它
+    it.node = leaf;
+    it.idx = i - 1;
+    if (!is_dead(leaf, i - 1)) return make_pair(it, false);
+
+    /* a tombstone of key (lazy_erase): bring it back in its slot */
+    leaf->vals[i - 1] = make_val();
+    leaf->dead[i - 1] = false;
+    num_elements++;
+    count_path(parents, traverse_indices, 1);
+    return make_pair(it, true);
+  }
+
+  /* key not exists */
+  /* put the val and key in the proper postion */
+  // 这个地方挺巧妙的，这里在i的位置插入是因为前面最后一次while循环中，i遍历了keys,使得keys[i-1]<key<keys[i]，所以在i的位置插入
+  // 只有追加到最后一个leaf的末尾才算顺序插入: 在树中间按最后的key分裂会留下很空的leaf
+  sequential = (i == leaf->num_keys && leaf->next_leaf == nullptr);
+  insert_in_leaf(leaf, i, std::forward<K>(key), make_val);
+  count_path(parents, traverse_indices, 1);
+  it.node = leaf;
+  it.idx = i;
+  if (leaf->next_leaf == nullptr) tail = leaf;
+
+  /* lazy_erase: a full leaf drops its tombstones instead of splitting, it may be too small after that */
+  if (lazy_erase && leaf->num_keys == max_degree && subtree_size(leaf) < max_degree) {
+    it.idx = live_keys(leaf, 0, i);
+    purge(leaf);
+    if (leaf->num_keys < (max_degree - 1) / 2 && leaf != root) {
+      key_type k = leaf->keys[it.idx];
+      rebalance(parents, traverse_indices, leaf);
+      it.node = leaf_of(k);
+      it.idx = search_type::lower_bound(it.node->keys.data(), it.node->num_keys, k);
+    }
+    return make_pair(it, true);
+  }
+
+  /* split the node until the bucket(key) is not full any more */
+  while (n->num_keys == max_degree) {  // 如果节点n满了
+
+    /* no matter weather we split the internal node or root node
+       We need the "right" node. When we split the nodes that contain records, the median was kept.
+       Otherwise, the median was deleted.
+    */
+    if (n->is_leaf) {  // 如果是叶子节点,是median index是right的第一个元素，(string key只留下能分开两个叶子的最短前缀)
+      BPLUSTREE_STAT(leaf_splits);
+      leaf = as_leaf(n);
+      right_leaf = new_leaf();
+      j = sequential ? std::min(it.idx + 1, max_degree - 1) : max_degree / 2;
+      median_key = KeySeparator<key_type>::between(leaf->keys[j - 1], leaf->keys[j]);
+
+      /* move half key-value to right */
+      std::move(leaf->keys.begin() + j, leaf->keys.begin() + max_degree, right_leaf->keys.begin());
+      std::move(leaf->vals.begin() + j, leaf->vals.begin() + max_degree, right_leaf->vals.begin());
+      right_leaf->num_keys = max_degree - j;
+      leaf->num_keys = j;
+      if (it.idx >= j) {
+        it.node = right_leaf;
+        it.idx -= j;
+      }
+
+      /* connect the split leaves */
+      // pre: a <-> n <-> b
+      // now: a <-> n <-> right <-> b
+      right_leaf->next_leaf = leaf->next_leaf;
+      if (leaf->next_leaf != nullptr) {
+        leaf->next_leaf->prev_leaf = right_leaf;
+      }
+      leaf->next_leaf = right_leaf;
+      right_leaf->prev_leaf = leaf;
+      if (right_leaf->next_leaf == nullptr) tail = right_leaf;
+
+      right = right_leaf;
+
+    } else { // 对于中间节点,median是MOVE到上层，舍弃，right的第一个key是median+1
+      BPLUSTREE_STAT(inner_splits);
+      inner = as_inner(n);
+      right_inner = new_inner();
+      j = (sequential ? max_degree - 2 : max_degree / 2) + 1;  // 顺序插入的时候右边只有最后两个孩子
+      median_key = inner->keys[j - 1];
+
+      // 对于中间节点,孩子数 = M+1, L1的node是[0,M/2], right的node是[M/2+1, M]
+      std::move(inner->keys.begin() + j, inner->keys.begin() + max_degree, right_inner->keys.begin());
+      std::copy(inner->nodes.begin() + j, inner->nodes.begin() + max_degree + 1, right_inner->nodes.begin());
+      if (order_statistics) std::copy(inner->counts.begin() + j, inner->counts.begin() + max_degree + 1, right_inner->counts.begin());
+      right_inner->num_keys = max_degree - j;
+      inner->num_keys = j - 1;
+
+      right = right_inner;
+    }
+
+     // when we split the root node, create the new parent node.
+     //   The original node became the "left" node.
+
+    if (traverse_indices.size() == 0) { // no parent, means spliting root
+
+      /* parent is created as new root*/
+      // parent only have one key, is right key's first ,just is median_key
+      BPLUSTREE_STAT(root_splits);
+      parent = new_inner();
+      parent->nodes[0] = n;
+      parent->nodes[1] = right;
+      parent->keys[0] = median_key;
+      parent->num_keys = 1;
+      if (order_statistics) {
+        parent->counts[0] = subtree_size(n);
+        parent->counts[1] = subtree_size(right);
+      }
+
+      root = parent;  //update root
+
+    } else {  // the split node is not root
+
+      /* when we split the internal node, the original node keeps the half capacity as the left node.
+         Also, the median key was added to it's parent.
+       */
+
+      /* get parent by path*/
+      parent = parents[parents.size() - 1];
+      parents.pop_back();
+
+      traverse_index = traverse_indices[traverse_indices.size() - 1];
+      traverse_indices.pop_back();
+
+      array_insert(parent->keys, parent->num_keys, traverse_index, median_key);
+      array_insert(parent->nodes, parent->num_keys + 1, traverse_index + 1, right);
+      if (order_statistics) {
+        array_insert(parent->counts, parent->num_keys + 1, traverse_index + 1, subtree_size(right));
+        parent->counts[traverse_index] = subtree_size(n);
+      }
+      parent->num_keys++;
+      sequential = sequential && traverse_index + 1 == parent->num_keys;  // 新的node在parent的最后
+
+      n = parent;
+
+    }
+  }
+
+  return make_pair(it, true);
+}
+
+/* 在leaf的第i个slot放进一个新的key，返回i。key属于这个leaf、snapshot看不到leaf是调用的人保证的，
+   leaf满了以后的分裂和路径上的counts也是调用的人做 */
+template <class K, class MakeVal>
+size_t insert_in_leaf(leaf_node *leaf, size_t i, K &&key, MakeVal &make_val) {
+  // make_val()在移动任何东西之前调用，它抛异常的时候树没有变
+  array_insert(leaf->vals, leaf->num_keys, i, make_val());
+  array_insert(leaf->keys, leaf->num_keys, i, std::forward<K>(key));
+  if (lazy_erase) array_insert(leaf->dead, leaf->num_keys, i, false);
+  leaf->num_keys++;
+  num_elements++;
+  return i;
+}
+
+// node里第一个 key < keys[i] 的i，也就是应该往下走的孩子
+static size_t child_index(const node_type *n, const key_type &key) {
+  return search_type::upper_bound(n->keys.data(), n->num_keys, key);
+}
+
+// 把node的头和keys开头、中间的cache line提前读进来 (in-node search最先碰到的地方)
+static void prefetch_node(const node_type *n) {
+  __builtin_prefetch(n);
+  __builtin_prefetch(n->keys.data());
+  __builtin_prefetch(n->keys.data() + n->num_keys / 2);
+}
+
+// 顺序扫描的时候提前读下一个leaf的头、keys和vals的开头
+static void prefetch_leaf(const leaf_node *n) {
+  __builtin_prefetch(n);
+  __builtin_prefetch(n->keys.data());
+  __builtin_prefetch(n->vals.data());
+}
+
+static inner_node *as_inner(node_type *n) { return static_cast<inner_node*>(n); }
+static leaf_node *as_leaf(node_type *n) { return static_cast<leaf_node*>(n); }
+static const inner_node *as_inner(const node_type *n) { return static_cast<const inner_node*>(n); }
+static const leaf_node *as_leaf(const node_type *n) { return static_cast<const leaf_node*>(n); }
+
+/* ---------------- tombstones ----------------
+   lazy_erase的时候erase(key)只把leaf里的slot标成dead (tombstone)，不挪key，也不合并或者平分，
+   leaf里tombstone的比例到了tombstone_ratio，compact()，或者insert碰到满的leaf的时候才真的删掉 (purge)。
+   num_elements和counts只算活着的records，num_keys还包括tombstone，所以node的大小和分裂/合并都照旧。
+   dead[i]只在 [0, num_keys) 里有意义，挪keys/vals的地方都要一起挪它 (move_dead)。
+   不是lazy_erase的时候dead是空的数组，这些函数什么都不做。
+*/
+
+static bool is_dead(const leaf_node *leaf, size_t i) {
+  return lazy_erase && leaf->dead[i];
+}
+
+// leaf的 [from, to) 里不是tombstone的slot的个数
+static size_t live_keys(const leaf_node *leaf, size_t from, size_t to) {
+  if (!lazy_erase) return to - from;
+  return to - from - std::count(leaf->dead.begin() + from, leaf->dead.begin() + to, true);
+}
+
+// 把from的dead[first, last) 挪到to的dead[out, ...)，可以是同一个leaf
+static void move_dead(const leaf_node *from, size_t first, size_t last, leaf_node *to, size_t out) {
+  if (lazy_erase && first < last) std::memmove(to->dead.data() + out, from->dead.data() + first, (last - first) * sizeof(bool));
+}
+
+// 从 (node, idx) 往右跳过tombstone (和leaf的末尾)，最多到 (stop_node, stop_idx)
+static void skip_dead(leaf_node *&node, size_t &idx, const leaf_node *stop_node = nullptr, size_t stop_idx = 0) {
+  if (!lazy_erase) return;
+  while (node != nullptr && !(node == stop_node && idx == stop_idx) && (idx >= node->num_keys || node->dead[idx])) {
+    if (++idx >= node->num_keys) {
+      node = node->next_leaf;
+      idx = 0;
+    }
+  }
+}
+
+// 往左跳过tombstone，走过第一个record的时候node是nullptr
+static void skip_dead_back(leaf_node *&node, size_t &idx) {
+  if (!lazy_erase) return;
+  while (node != nullptr && node->dead[idx]) {
+    if (idx > 0) {
+      idx--;
+    } else {
+      node = node->prev_leaf;
+      idx = (node == nullptr) ? 0 : node->num_keys - 1;
+    }
+  }
+}
+
+// 第一个 >= key 的slot，tombstone也算
+iterator first_slot(const key_type &key) const {
+  node_type *n = root;
+  leaf_node *leaf;
+  iterator it;
+
+  while (!n->is_leaf) {
+    BPLUSTREE_STAT(nodes_visited);
+    n = as_inner(n)->nodes[child_index(n, key)];
+  }
+  BPLUSTREE_STAT(nodes_visited);
+
+  leaf = as_leaf(n);
+  it.tree = this;
+  it.idx = search_type::lower_bound(leaf->keys.data(), leaf->num_keys, key);
+  it.node = leaf;
+  if (it.idx == leaf->num_keys) {  // 下一个leaf的第一个key一定 >= key
+    it.node = leaf->next_leaf;
+    it.idx = 0;
+  }
+  return it;
+}
+
+// Cursor的find (exact) 和lower_bound
+iterator cursor_search(Cursor &c, const key_type &key, bool exact) const {
+  leaf_node *leaf;
+  iterator it;
+  size_t i;
+
+  if (exact) BPLUSTREE_STAT(finds);
+  else BPLUSTREE_STAT(lower_bounds);
+  leaf = seek_leaf(c, key);
+  it.tree = this;
+
+  if (exact) {
+    i = child_index(leaf, key);
+    if (i > 0 && leaf->keys[i - 1] == key && !is_dead(leaf, i - 1)) {
+      it.node = leaf;
+      it.idx = i - 1;
+      return it;
+    }
+    return end();
+  }
+
+  it.node = leaf;
+  it.idx = search_type::lower_bound(leaf->keys.data(), leaf->num_keys, key);
+  if (it.idx == leaf->num_keys) {
+    it.node = leaf->next_leaf;
+    it.idx = 0;
+  }
+  skip_dead(it.node, it.idx);
+  return it;
+}
+
+static bool in_range(const typename Cursor::Level &l, const key_type &key) {
+  return (l.lo == nullptr || !(key < *l.lo)) && (l.hi == nullptr || key < *l.hi);
+}
+
+/* 把cursor挪到key所在的leaf:
+   1. key在上一个leaf的右边，并且右边的leaf是同一个parent的孩子，就沿着next_leaf跳过去，最多跳cursor_hops个
+   2. 还不在的话往上走，直到某一层的孩子的范围包含key
+   3. 从那个孩子往下走，一路记下路径和范围
+*/
+leaf_node *seek_leaf(Cursor &c, const key_type &key) const {
+  node_type *n = root;
+  const key_type *lo = nullptr, *hi = nullptr;  // n的范围
+  size_t i, hops;
+
+  if (c.leaf == nullptr) {
+    c.path.clear();
+  } else {
+    for (hops = 0; hops < cursor_hops && !c.path.empty(); hops++) {
+      typename Cursor::Level &l = c.path.back();
+      if (l.hi == nullptr || key < *l.hi || l.idx == l.node->num_keys) break;
+      l.idx++;
+      l.lo = l.hi;
+      l.hi = (l.idx < l.node->num_keys) ? &l.node->keys[l.idx] : (c.path.size() > 1 ? c.path[c.path.size() - 2].hi : nullptr);
+      c.leaf = c.leaf->next_leaf;
+    }
+
+    while (!c.path.empty() && !in_range(c.path.back(), key)) c.path.pop_back();
+    if (!c.path.empty()) {
+      n = c.path.back().node->nodes[c.path.back().idx];
+      lo = c.path.back().lo;
+      hi = c.path.back().hi;
+    }
+  }
+
+  while (!n->is_leaf) {
+    BPLUSTREE_STAT(nodes_visited);
+    i = child_index(n, key);
+    if (i > 0) lo = &n->keys[i - 1];
+    if (i < n->num_keys) hi = &n->keys[i];
+    c.path.push_back({as_inner(n), i, lo, hi});
+    n = as_inner(n)->nodes[i];
+  }
+  BPLUSTREE_STAT(nodes_visited);
+
+  c.leaf = as_leaf(n);
+  return c.leaf;
+}
+
+// 去掉 (已经可以修改的) leaf里的tombstone，返回去掉的个数。records没有变，所以counts不用改
+size_t purge(leaf_node *leaf) {
+  size_t i, kept = 0, removed;
+
+  for (i = 0; i < leaf->num_keys; i++) {
+    if (leaf->dead[i]) continue;
+    if (kept != i) {
+      leaf->keys[kept] = std::move(leaf->keys[i]);
+      leaf->vals[kept] = std::move(leaf->vals[i]);
+      leaf->dead[kept] = false;
+    }
+    kept++;
+  }
+  removed = leaf->num_keys - kept;
+  leaf->num_keys = kept;
+  if (removed > 0) BPLUSTREE_STAT(purges);
+  return removed;
+}
+
+/* lazy_erase的erase(key): 标成tombstone，value马上换成val_type()，它占的内存 (比如string) 现在就还回去。
+   tombstone到了比例才purge，这时候leaf太小了才和兄弟合并或者平分，所以churn的时候不会反复分裂、合并同几个leaf。
+*/
+void erase_lazily(const key_type &key) {
+  vector <size_t> &traverse_indices = path_indices;
+  vector <inner_node*> &parents = path_nodes;
+  node_type *n;
+  leaf_node *leaf;
+  size_t i, dead;
+
+  BPLUSTREE_STAT(erases);
+  if (shared(root) && find(key) == end()) return;  // key不在的时候不复制路径
+
+  n = writable(root, nullptr, 0);
+  traverse_indices.clear();
+  parents.clear();
+  while (!n->is_leaf) {
+    BPLUSTREE_STAT(nodes_visited);
+    i = child_index(n, key);
+    traverse_indices.push_back(i);
+    parents.push_back(as_inner(n));
+    n = writable(as_inner(n)->nodes[i], as_inner(n), i);
+  }
+  BPLUSTREE_STAT(nodes_visited);
+
+  leaf = as_leaf(n);
+  i = child_index(leaf, key);
+  if (i == 0 || !(leaf->keys[i - 1] == key) || leaf->dead[i - 1]) return;
+
+  leaf->dead[i - 1] = true;
+  leaf->vals[i - 1] = val_type();
+  num_elements--;
+  count_path(parents, traverse_indices, -1);
+
+  dead = leaf->num_keys - subtree_size(leaf);
+  if (dead >= tombstone_ratio * leaf->num_keys) {
+    purge(leaf);
+    if (leaf->num_keys < (max_degree - 1) / 2 && leaf != root) rebalance(parents, traverse_indices, leaf);
+  }
+}
+
+// purge key所在的leaf，它太小了就rebalance，返回去掉的tombstone的个数
+size_t purge_at(const key_type &key) {
+  vector <size_t> &traverse_indices = path_indices;
+  vector <inner_node*> &parents = path_nodes;
+  node_type *n = writable(root, nullptr, 0);
+  size_t i, removed;
+
+  traverse_indices.clear();
+  parents.clear();
+  while (!n->is_leaf) {
+    i = child_index(n, key);
+    traverse_indices.push_back(i);
+    parents.push_back(as_inner(n));
+    n = writable(as_inner(n)->nodes[i], as_inner(n), i);
+  }
+  removed = purge(as_leaf(n));
+  if (n->num_keys < (max_degree - 1) / 2 && n != root) rebalance(parents, traverse_indices, n);
+  return removed;
+}
+
+// 最后一个slot (包括tombstone) < other的第一个slot。两颗树都不是空的
+bool ends_before(const Tree &other) const {
+  const leaf_node *last = last_leaf_of(root), *first = other.first_leaf_of(other.root);
+  return last->keys[last->num_keys - 1] < first->keys[0];
+}
+
+leaf_node *new_leaf() {
+  leaf_node *n = alloc.template create<leaf_node>();
+  n->birth = epoch;
+  return n;
+}
+
+inner_node *new_inner() {
+  inner_node *n = alloc.template create<inner_node>();
+  n->birth = epoch;
+  return n;
+}
 
-        } else {
+// 按node真正的类型去释放，snapshot还看得到的node先放到retired里
+void free_node(node_type *n) {
+  if (n == tail) tail = nullptr;
+  if (shared(n)) retire(n);
+  else if (n->is_leaf) alloc.destroy(as_leaf(n));
+  else alloc.destroy(as_inner(n));
+}
 
-          n->keys.push_back(parent->keys[traverse_index]);
-          parent->keys[traverse_index] = right->keys[0];
-          
-          n->nodes.push_back(right->nodes[0]);
-          right->nodes.erase(right->nodes.begin());
-        }
-         
+/* ---------------- copy on write ----------------
+   snapshot e能看到所有birth <= e的node，writer不能再改这些node。
+   所以n->birth <= live_max (最新的活着的snapshot) 的时候，writer先复制一份n，
+   把parent (已经是可写的了) 指向复制出来的node，再改它。从root往下这样做就是path copying。
+   leaf之间的链表是例外: 复制的时候直接改左右邻居的next_leaf/prev_leaf，snapshot不会读它们。
+*/
 
-        right->keys.erase(right->keys.begin());
-        
-      
-        return;
+// 有snapshot可能看得到n
+bool shared(const node_type *n) const {
+  return snapshot_state != nullptr && n->birth <= snapshot_state->live_max.load(std::memory_order_acquire);
+}
 
-      }
-    }
+// 把from里的[first, last)拿到out: merge的时候右边的node没有复制，snapshot还看得到的话只能copy，不能move
+template <class It, class Out>
+Out take(const node_type *from, It first, It last, Out out) const {
+  if (shared(from)) return std::copy(first, last, out);
+  return std::move(first, last, out);
+}
 
-    /* case:4 merge the node to left node */
-    if (left != nullptr && traverse_index != 0) {
-      
-      
-      /* reset the next and prev leaf */
-      left->next_leaf = n->next_leaf;
-      if (n->next_leaf != nullptr) n->next_leaf->prev_leaf = left;
-      
+// 返回一个可以修改的n: n是parent->nodes[i] (parent是nullptr的时候n是root)
+node_type *writable(node_type *n, inner_node *parent, size_t i) {
+  node_type *copy;
+  leaf_node *leaf;
 
-      /* when it's not leaf nodes, bring down the parent key and merge nodes as well */
-      if(!records) {
-        left->keys.push_back(parent->keys[traverse_index - 1]);
-        for (i = 0; i < n->nodes.size(); i++){
-          left->nodes.push_back(n->nodes[i]);
-        }
-      }
+  if (!shared(n)) return n;
 
-      /* merge keys */
-      for (i = 0; i < n->keys.size(); i++) {
-        left->keys.push_back(n->keys[i]);
-        if(records) left->vals.push_back(n->vals[i]);
-      }
+  copy = clone_node(n);
+  if (parent == nullptr) root = copy;
+  else parent->nodes[i] = copy;
 
+  if (copy->is_leaf) {
+    leaf = as_leaf(copy);
+    if (leaf->prev_leaf != nullptr) leaf->prev_leaf->next_leaf = leaf;
+    if (leaf->next_leaf != nullptr) leaf->next_leaf->prev_leaf = leaf;
+  }
+  retire(n);
+  return copy;
+}
 
-      // erase the parent key and node
-      parent->keys.erase(parent->keys.begin() + traverse_index - 1);
-      parent->nodes.erase(parent->nodes.begin() + traverse_index);
+// 从root到key所在的leaf都变成可以修改的，返回这个leaf
+leaf_node *writable_leaf(const key_type &key) {
+  node_type *n = writable(root, nullptr, 0);
+  size_t i;
 
-     
-      /* merge into a root node */
-      if(parent->keys.size() == 0 && parent == root) {
-      
-        delete n;
-        delete root;
-        root = left;         
-        return;
-      }
+  while (!n->is_leaf) {
+    i = child_index(n, key);
+    n = writable(as_inner(n)->nodes[i], as_inner(n), i);
+  }
+  return as_leaf(n);
+}
 
-      delete n;
-      n = parent;
-      
+// 一个新的node，内容和n一样 (leaf的链表也一样)
+node_type *clone_node(const node_type *n) {
+  const leaf_node *leaf;
+  const inner_node *inner;
+  leaf_node *new_l;
+  inner_node *new_i;
+
+  if (n->is_leaf) {
+    leaf = static_cast<const leaf_node*>(n);
+    new_l = new_leaf();
+    std::copy(leaf->keys.begin(), leaf->keys.begin() + leaf->num_keys, new_l->keys.begin());
+    std::copy(leaf->vals.begin(), leaf->vals.begin() + leaf->num_keys, new_l->vals.begin());
+    move_dead(leaf, 0, leaf->num_keys, new_l, 0);
+    new_l->num_keys = leaf->num_keys;
+    new_l->next_leaf = leaf->next_leaf;
+    new_l->prev_leaf = leaf->prev_leaf;
+    return new_l;
+  }
 
-    /* case5: merge the right node to n node */
-    } else if (right != nullptr && traverse_index != parent->nodes.size() - 1) {
+  inner = static_cast<const inner_node*>(n);
+  new_i = new_inner();
+  std::copy(inner->keys.begin(), inner->keys.begin() + inner->num_keys, new_i->keys.begin());
+  std::copy(inner->nodes.begin(), inner->nodes.begin() + inner->num_keys + 1, new_i->nodes.begin());
+  std::copy(inner->counts.begin(), inner->counts.begin() + (order_statistics ? inner->num_keys + 1 : 0), new_i->counts.begin());
+  new_i->num_keys = inner->num_keys;
+  return new_i;
+}
 
-      /* we may delete the leftmost key in the subtree */
-      if (same_value_node != nullptr) {
-        same_value_node->keys[same_value_index] = n->keys[0];
-      }
-     
-      n->next_leaf = right->next_leaf;
-      if (right->next_leaf != nullptr) right->next_leaf->prev_leaf = n;
+// 复制n这颗子树，last是已经复制好的最右边的leaf，用来连leaf的链表
+node_type *copy_subtree(const node_type *n, leaf_node *&last) {
+  node_type *copy = clone_node(n);
+  leaf_node *leaf;
+  size_t i;
+
+  if (copy->is_leaf) {
+    leaf = as_leaf(copy);
+    leaf->prev_leaf = last;
+    leaf->next_leaf = nullptr;
+    if (last != nullptr) last->next_leaf = leaf;
+    last = leaf;
+  } else {
+    for (i = 0; i <= copy->num_keys; i++) {
+      as_inner(copy)->nodes[i] = copy_subtree(as_inner(copy)->nodes[i], last);
+    }
+  }
+  return copy;
+}
 
+// 现在的snapshot都还可能看得到n，等它们都没了再释放
+void retire(node_type *n) {
+  if (n == tail) tail = nullptr;
+  snapshot_state->retired.push_back(make_pair(n, epoch));
+  if (snapshot_state->released.exchange(false, std::memory_order_acquire)) reclaim();
+}
 
-      /* when it's not leaf nodes, bring down the parent key and merge nodes as well */
-      if(!records) {
-        n->keys.push_back(parent->keys[traverse_index]);
-        for (i = 0; i < right->nodes.size(); i++){
-          n->nodes.push_back(right->nodes[i]);
+/* 释放所有snapshot都看不到的retired node。
+   node n在epoch r被retire，那么只有birth <= e < r的snapshot e看得到它。
+   返回还有没有活着的snapshot。
+*/
+bool reclaim() {
+  size_t i, kept = 0;
+  node_type *n;
+  typename std::multiset <size_t>::iterator it;
+
+  if (snapshot_state == nullptr) return false;
+
+  std::lock_guard <std::mutex> guard(snapshot_state->lock);
+  vector <pair<node_type*, size_t> > &retired = snapshot_state->retired;
+  for (i = 0; i < retired.size(); i++) {
+    n = retired[i].first;
+    it = snapshot_state->live.lower_bound(n->birth);
+    if (it != snapshot_state->live.end() && *it < retired[i].second) {
+      retired[kept++] = retired[i];
+    } else if (n->is_leaf) {
+      alloc.destroy(as_leaf(n));
+    } else {
+      alloc.destroy(as_inner(n));
+    }
+  }
+  retired.resize(kept);
+  return !snapshot_state->live.empty();
+}
+
+/* 析构和move赋值用: 释放所有node。
+   还有snapshot的话，它们看得到的node留在retired里，alloc也交给snapshot_state，由最后一个snapshot释放
+*/
+void release() {
+  destroy_tree(root);
+  if (snapshot_state != nullptr) {
+    std::lock_guard <std::mutex> guard(snapshot_state->lock);
+    snapshot_state->alloc = std::move(alloc);
+  }
+  snapshot_state = nullptr;
+}
+
+/* insert_batch/erase_batch/apply_batch的实现，get_key/is_erase/get_val从iterator里取出一个修改 */
+template <class ForwardIt, class GetKey, class IsErase, class GetVal>
+void apply_sorted(ForwardIt first, ForwardIt last, GetKey get_key, IsErase is_erase, GetVal get_val) {
+  size_t min_keys = (max_degree - 1) / 2;
+  size_t i, j, g;
+  vector <size_t> traverse_indices;
+  vector <inner_node*> parents;
+  vector <key_type> ks, seps;
+  vector <val_type> vs;
+  vector <node_type*> new_nodes;
+  vector <size_t> groups;
+  node_type *n;
+  leaf_node *leaf, *right;
+  ForwardIt it, prev;
+  const key_type *bound;
+
+  /* check the order first, so that a bad batch doesn't leave the tree half updated */
+  if (first != last) {
+    for (prev = first, it = std::next(first); it != last; prev = it, ++it) {
+      if (get_key(it) < get_key(prev)) throw std::invalid_argument("B+Tree: batch is not sorted");
+    }
+  }
+
+  while (first != last) {
+
+    /* find the leaf node, and remember the smallest separator on the path that is > key.
+       all the keys < bound go to the same leaf.
+    */
+    n = writable(root, nullptr, 0);
+    bound = nullptr;
+    parents.clear();
+    traverse_indices.clear();
+    while (!n->is_leaf) {
+      BPLUSTREE_STAT(nodes_visited);
+      i = child_index(n, get_key(first));
+      if (i < n->num_keys) bound = &n->keys[i];
+      traverse_indices.push_back(i);
+      parents.push_back(as_inner(n));
+      n = writable(as_inner(n)->nodes[i], as_inner(n), i);
+    }
+    leaf = as_leaf(n);
+
+    /* merge the records of the leaf with the ops that fall into it.
+       ks.back() is the current record of the key, if the same key shows up again
+    */
+    ks.clear();
+    vs.clear();
+    j = 0;
+    for (; first != last && (bound == nullptr || get_key(first) < *bound); ++first) {
+      const key_type &key = get_key(first);
+      while (j < leaf->num_keys && !(key < leaf->keys[j])) {
+        if (!is_dead(leaf, j)) {  // tombstones are dropped here
+          ks.push_back(std::move(leaf->keys[j]));
+          vs.push_back(std::move(leaf->vals[j]));
         }
+        j++;
       }
 
-      /* get keys and vals */
-      for(i = 0; i < right->keys.size(); i++) {
-        n->keys.push_back(right->keys[i]);
-        if(records) n->vals.push_back(right->vals[i]);
+      if (is_erase(first)) BPLUSTREE_STAT(erases);
+      else BPLUSTREE_STAT(inserts);
+      if (!ks.empty() && ks.back() == key) {
+        if (is_erase(first)) {
+          ks.pop_back();
+          vs.pop_back();
+          num_elements--;
+        } else {
+          vs.back() = get_val(first);
+        }
+      } else if (!is_erase(first)) {
+        ks.push_back(key);
+        vs.push_back(get_val(first));
+        num_elements++;
       }
+    }
+    for (; j < leaf->num_keys; j++) {
+      if (is_dead(leaf, j)) continue;
+      ks.push_back(std::move(leaf->keys[j]));
+      vs.push_back(std::move(leaf->vals[j]));
+    }
 
-      /* update parent nodes and keys */
-      parent->nodes[traverse_index + 1] = n;
-      parent->keys.erase(parent->keys.begin() + traverse_index);
-      parent->nodes.erase(parent->nodes.begin() + traverse_index);
-
-      
-      if(parent->keys.size() == 0 && parent == root) {
-        delete right;
-        delete root;
-        root = n;
-        return;
-      }
+    count_path(parents, traverse_indices, (ptrdiff_t) ks.size() - (ptrdiff_t) subtree_size(leaf));
+    if (lazy_erase) leaf->dead.fill(false);
 
-      delete right;
-      n = parent;
- 
+    /* fits into the leaf, maybe too small now */
+    if (ks.size() <= max_degree - 1) {
+      std::move(ks.begin(), ks.end(), leaf->keys.begin());
+      std::move(vs.begin(), vs.end(), leaf->vals.begin());
+      leaf->num_keys = ks.size();
+      if (leaf->num_keys < min_keys && leaf != root) rebalance(parents, traverse_indices, leaf);
+      continue;
     }
 
-    records = false;
-    same_value_node =nullptr;
+    /* split the leaf into as many leaves as needed at once */
+    groups = even_groups(ks.size(), max_degree - 1);
+    BPLUSTREE_STAT_ADD(leaf_splits, groups.size() - 1);
+    seps.clear();
+    new_nodes.clear();
+    for (g = 0, j = 0; g < groups.size(); j += groups[g], g++) {
+      if (g == 0) {
+        right = leaf;
+      } else {
+        right = new_leaf();
+        right->next_leaf = leaf->next_leaf;
+        if (leaf->next_leaf != nullptr) leaf->next_leaf->prev_leaf = right;
+        leaf->next_leaf = right;
+        right->prev_leaf = leaf;
+        seps.push_back(KeySeparator<key_type>::between(leaf->keys[leaf->num_keys - 1], ks[j]));  // ks[j - 1]已经move走了
+        new_nodes.push_back(right);
+        leaf = right;
+      }
+      std::move(ks.begin() + j, ks.begin() + j + groups[g], right->keys.begin());
+      std::move(vs.begin() + j, vs.begin() + j + groups[g], right->vals.begin());
+      right->num_keys = groups[g];
+    }
+    insert_children(parents, traverse_indices, seps, new_nodes);
   }
-
 }
 
-void erase(const reverse_iterator &rit) {
-  erase(rit.get_key());
-}
+/* 把new_nodes插到 parents.back()->nodes[traverse_indices.back()] 的右边，seps[i]是new_nodes[i]左边的separator。
+   parent放不下的话一次分裂成几个node，再把分出来的node插到上一层，一直到root (root分裂就长出一个新的root)。
+   parents/traverse_indices是从root下来的路径，seps/new_nodes都会被用掉。
+*/
+void insert_children(vector <inner_node*> &parents, vector <size_t> &traverse_indices,
+                     vector <key_type> &seps, vector <node_type*> &new_nodes) {
+  vector <key_type> ks;
+  vector <node_type*> cs;
+  vector <size_t> cn;  // order_statistics: counts of cs
+  vector <size_t> groups;
+  inner_node *parent, *inner;
+  size_t traverse_index, g, start;
+
+  while (!new_nodes.empty()) {
+    if (parents.empty()) {
+      BPLUSTREE_STAT(root_splits);
+      parent = new_inner();
+      parent->nodes[0] = root;
+      if (order_statistics) parent->counts[0] = subtree_size(root);
+      root = parent;
+      parents.push_back(parent);
+      traverse_indices.push_back(0);
+    }
+    parent = parents.back();
+    parents.pop_back();
+    traverse_index = traverse_indices.back();
+    traverse_indices.pop_back();
 
-void erase(const iterator &it) {
-  erase(it.get_key());
+    ks.assign(std::make_move_iterator(parent->keys.begin()), std::make_move_iterator(parent->keys.begin() + parent->num_keys));
+    cs.assign(parent->nodes.begin(), parent->nodes.begin() + parent->num_keys + 1);
+    if (order_statistics) {
+      /* the child at traverse_index lost the records that moved to new_nodes */
+      cn.assign(parent->counts.begin(), parent->counts.begin() + parent->num_keys + 1);
+      cn[traverse_index] = subtree_size(cs[traverse_index]);
+      for (g = 0; g < new_nodes.size(); g++) cn.insert(cn.begin() + traverse_index + 1 + g, subtree_size(new_nodes[g]));
+    }
+    ks.insert(ks.begin() + traverse_index, std::make_move_iterator(seps.begin()), std::make_move_iterator(seps.end()));
+    cs.insert(cs.begin() + traverse_index + 1, new_nodes.begin(), new_nodes.end());
+    seps.clear();
+    new_nodes.clear();
+
+    /* the key between two groups goes up to the next level */
+    groups = even_groups(cs.size(), max_degree);
+    BPLUSTREE_STAT_ADD(inner_splits, groups.size() - 1);
+    for (g = 0, start = 0; g < groups.size(); start += groups[g], g++) {
+      inner = (g == 0) ? parent : new_inner();
+      std::move(ks.begin() + start, ks.begin() + start + groups[g] - 1, inner->keys.begin());
+      std::copy(cs.begin() + start, cs.begin() + start + groups[g], inner->nodes.begin());
+      if (order_statistics) std::copy(cn.begin() + start, cn.begin() + start + groups[g], inner->counts.begin());
+      inner->num_keys = groups[g] - 1;
+      if (g > 0) {
+        seps.push_back(std::move(ks[start - 1]));
+        new_nodes.push_back(inner);
+      }
+    }
+  }
 }
 
-bool contains(const key_type &k) {
-  return (find(k) != end());
+/* ---------------- range erase ----------------
+   1.从root往下，完全在 [lo, hi) 里的孩子整个摘下来，只有左右两边的孩子往下递归；变空了的node也摘下来
+   2.接好两边剩下来的leaf之间的链表
+   3.释放摘下来的node
+   4.沿着lo左边和hi右边的两条路径，从上往下把太小的node和兄弟合并或者平分
+   hi是nullptr的时候表示没有上界。
+*/
+size_t erase_between(const key_type &lo, const key_type *hi) {
+  iterator first = first_slot(lo), last = (hi == nullptr) ? end() : first_slot(*hi);  // tombstones too
+  vector <node_type*> dropped, emptied;
+  key_type before = key_type(), after = key_type();  // 删掉的范围两边的key
+  bool has_before = false, has_after = (last != end());
+  leaf_node *left, *right;
+  size_t i, removed;
+
+  if (first == last) return 0;  // 没有要删的，有snapshot的时候也不复制路径
+  if (first.idx > 0) {
+    before = first.node->keys[first.idx - 1];
+    has_before = true;
+  } else if (first.node->prev_leaf != nullptr) {
+    before = first.node->prev_leaf->keys[first.node->prev_leaf->num_keys - 1];
+    has_before = true;
+  }
+  if (has_after) after = last.node->keys[last.idx];
+
+  removed = erase_range_in(writable(root, nullptr, 0), lo, hi, dropped, emptied);
+  if (!emptied.empty() && emptied.back() == root) root = new_leaf();
+
+  /* the leaves on both sides may still point to the removed ones */
+  left = has_before ? leaf_of(before) : nullptr;
+  right = has_after ? leaf_of(after) : nullptr;
+  if (left != right) {  // 两边的key在同一个leaf里的时候链表没有变
+    if (left != nullptr) left->next_leaf = right;
+    if (right != nullptr) right->prev_leaf = left;
+  }
+
+  for (i = 0; i < dropped.size(); i++) removed += free_subtree(dropped[i]);
+  for (i = 0; i < emptied.size(); i++) free_node(emptied[i]);
+  num_elements -= removed;
+  BPLUSTREE_STAT_ADD(erases, removed);
+
+  repair_path(lo, true);
+  if (hi != nullptr) repair_path(*hi, false);
+  return removed;
 }
 
+/* 删掉n (已经可以修改) 这颗子树里 [lo, hi) 的records，返回删掉的个数 (不算dropped里的)。
+   完全在范围里的孩子放进dropped，删空了的node放进emptied，最后再释放，
+   因为在那之前复制兄弟leaf的时候还会写它们的链表指针。n自己删空的时候也放进emptied。
+*/
+size_t erase_range_in(node_type *n, const key_type &lo, const key_type *hi,
+                      vector <node_type*> &dropped, vector <node_type*> &emptied) {
+  inner_node *inner;
+  leaf_node *leaf;
+  node_type *child;
+  size_t first, last, i, kept, removed = 0;
+  bool first_gone, last_gone = false;  // 删空了
+
+  if (n->is_leaf) {
+    leaf = as_leaf(n);
+    first = search_type::lower_bound(leaf->keys.data(), leaf->num_keys, lo);
+    last = (hi == nullptr) ? leaf->num_keys : search_type::lower_bound(leaf->keys.data(), leaf->num_keys, *hi);
+    if (first < last) {
+      removed = live_keys(leaf, first, last);
+      std::move(leaf->keys.begin() + last, leaf->keys.begin() + leaf->num_keys, leaf->keys.begin() + first);
+      std::move(leaf->vals.begin() + last, leaf->vals.begin() + leaf->num_keys, leaf->vals.begin() + first);
+      move_dead(leaf, last, leaf->num_keys, leaf, first);
+      leaf->num_keys -= last - first;
+    }
+    if (leaf->num_keys == 0) emptied.push_back(leaf);
+    return removed;
+  }
 
-size_t size() const { return num_elements; };
-bool empty() const { return (num_elements == 0); };
+  /* children[first, last] overlap [lo, hi), the ones strictly between are covered completely */
+  inner = as_inner(n);
+  first = child_index(inner, lo);
+  last = (hi == nullptr) ? inner->num_keys : search_type::lower_bound(inner->keys.data(), inner->num_keys, *hi);
+
+  for (i = first + 1; i < last; i++) dropped.push_back(inner->nodes[i]);
+  child = writable(inner->nodes[first], inner, first);
+  removed += erase_range_in(child, lo, hi, dropped, emptied);
+  first_gone = (!emptied.empty() && emptied.back() == child);
+  if (last != first) {
+    child = writable(inner->nodes[last], inner, last);
+    removed += erase_range_in(child, lo, hi, dropped, emptied);
+    last_gone = (!emptied.empty() && emptied.back() == child);
+  }
 
-// 删除了所有的node
-void clear() {
-  // 我猜这里就是递归删除子节点，然后删除自己
-  recursive_clear_tree(root);
-  root = new Node<key_type, val_type>; 
-  num_elements = 0;
+  /* keep the children that are left. keys[i - 1] still separates nodes[i] from everything on its left */
+  for (i = 0, kept = 0; i <= inner->num_keys; i++) {
+    if (first < i && i < last) continue;
+    if ((i == first && first_gone) || (i == last && last_gone)) continue;
+    if (kept > 0 && kept != i) inner->keys[kept - 1] = std::move(inner->keys[i - 1]);  // kept == i 的时候是自己move给自己，string会变成空的
+    inner->nodes[kept] = inner->nodes[i];
+    if (order_statistics) inner->counts[kept] = subtree_size(inner->nodes[i]);
+    kept++;
+  }
+  if (kept == 0) {
+    emptied.push_back(inner);
+  } else {
+    inner->num_keys = kept - 1;
+  }
+  return removed;
 }
 
-iterator upper_bound(const key_type &key) const {
+// 释放n这颗子树，返回里面record的个数 (不算tombstone)
+size_t free_subtree(node_type *n) {
+  size_t i, count = 0;
 
-  iterator it = lower_bound(key);
-  if (it == end()) return it;
-  if (it.get_key() == key) it++;
-  return it;
+  if (n->is_leaf) {
+    count = subtree_size(n);
+  } else {
+    for (i = 0; i <= n->num_keys; i++) count += free_subtree(as_inner(n)->nodes[i]);
+  }
+  free_node(n);
+  return count;
+}
 
+// key所在的leaf
+leaf_node *leaf_of(const key_type &key) const {
+  node_type *n = root;
+  while (!n->is_leaf) n = as_inner(n)->nodes[child_index(n, key)];
+  return as_leaf(n);
 }
 
-iterator lower_bound(const key_type &key) const {
-  Node<key_type,val_type> *n = root; 
-  iterator it;
+/* erase_between之后，只有被部分删掉的node会太小，它们都在这条路径上:
+   before是true的时候每层走到有 < key 的孩子 (范围左边)，否则走到有 >= key 的孩子 (范围右边)。
+   从上往下找第一个太小的node，它的parent是够大的 (或者是root)，和兄弟合并或者平分，然后重新从root开始。
+*/
+void repair_path(const key_type &key, bool before) {
+  size_t min_keys = (max_degree - 1) / 2;
+  node_type *n, *old_root;
+  inner_node *parent;
   size_t i;
+  bool fixed = true;
+
+  while (fixed) {
+    /* the root lost its last key */
+    while (!root->is_leaf && root->num_keys == 0) {
+      BPLUSTREE_STAT(root_collapses);
+      old_root = root;
+      root = as_inner(root)->nodes[0];
+      free_node(old_root);
+    }
 
-  /* find the leaf node */
-  while (n->nodes.size() != 0) {
-    for (i = 0; i < n->keys.size(); i++) {
-      if (key < n->keys[i]) break;
+    n = writable(root, nullptr, 0);
+    fixed = false;
+    while (!fixed && !n->is_leaf) {  // n is gone after it was merged into its left sibling
+      parent = as_inner(n);
+      i = before ? search_type::lower_bound(parent->keys.data(), parent->num_keys, key) : child_index(parent, key);
+      n = writable(parent->nodes[i], parent, i);
+      if (n->num_keys < min_keys) {
+        merge_or_share(parent, i > 0 ? i - 1 : i);
+        fixed = true;
+      }
     }
+  }
+}
+
+/* ---------------- split / join ----------------
+   split_at沿着key的路径把每层的node分成 < key 和 >= key 两半，join把矮的树接到高的树边上。
+   两种做法都只会在切口或者接口的那条路径上留下太小的node (也可能只剩一个孩子)，
+   这条路径上左边的separator都 < key，右边的都 > key，所以repair_path(key, true/false)正好沿着它走。
+*/
 
-    if (n->nodes.size() != 0) n = n->nodes[i];
+/* 把n (已经可以修改) 这颗子树分成 < key 的left和 >= key 的right，都是和n一样高的子树，空的是nullptr。
+   n自己变成left (left是空的时候变成right)，另一半是新的node。
+*/
+void cut(node_type *n, const key_type &key, node_type *&left, node_type *&right) {
+  inner_node *inner, *r;
+  leaf_node *leaf, *rl;
+  node_type *cl, *cr, *child;
+  size_t i, j, k;
+
+  if (n->is_leaf) {
+    leaf = as_leaf(n);
+    i = search_type::lower_bound(leaf->keys.data(), leaf->num_keys, key);
+    left = (i > 0) ? leaf : nullptr;
+    right = (i < leaf->num_keys) ? leaf : nullptr;
+    if (left == nullptr || right == nullptr) return;
+
+    rl = new_leaf();
+    std::move(leaf->keys.begin() + i, leaf->keys.begin() + leaf->num_keys, rl->keys.begin());
+    std::move(leaf->vals.begin() + i, leaf->vals.begin() + leaf->num_keys, rl->vals.begin());
+    move_dead(leaf, i, leaf->num_keys, rl, 0);
+    rl->num_keys = leaf->num_keys - i;
+    leaf->num_keys = i;
+    rl->next_leaf = leaf->next_leaf;
+    if (rl->next_leaf != nullptr) rl->next_leaf->prev_leaf = rl;
+    rl->prev_leaf = leaf;
+    leaf->next_leaf = rl;
+    right = rl;
+    return;
   }
 
-  /* find the node whose key is >= the given key */
-  while (n != nullptr) {
-    for (i = 0; i < n->keys.size(); i++) {
-      if (key <= n->keys[i]) {
-        it.idx = i;
-        it.node = n;
-        return it;
-      }
-    }
-    n = n->next_leaf;
+  /* nodes[0, i) are < key, nodes(i, num_keys] are >= key, nodes[i] is cut again */
+  inner = as_inner(n);
+  i = child_index(inner, key);
+  child = writable(inner->nodes[i], inner, i);
+  cut(child, key, cl, cr);
+
+  /* right: cr, nodes(i, num_keys]. keys[i] separates cr from nodes[i + 1] */
+  r = new_inner();
+  k = 0;
+  if (cr != nullptr) {
+    r->nodes[0] = cr;
+    if (order_statistics) r->counts[0] = subtree_size(cr);
+    k = 1;
+  }
+  for (j = i + 1; j <= inner->num_keys; j++, k++) {
+    if (k > 0) r->keys[k - 1] = std::move(inner->keys[j - 1]);
+    r->nodes[k] = inner->nodes[j];
+    if (order_statistics) r->counts[k] = inner->counts[j];
+  }
+  if (k == 0) {
+    free_node(r);
+    right = nullptr;
+  } else {
+    r->num_keys = k - 1;
+    right = r;
   }
-    
 
-  return end();
+  /* left: nodes[0, i), cl. keys[i - 1] separates nodes[i - 1] from cl */
+  k = i;
+  if (cl != nullptr) {
+    inner->nodes[i] = cl;
+    if (order_statistics) inner->counts[i] = subtree_size(cl);
+    k++;
+  }
+  if (k == 0) {
+    free_node(inner);
+    left = nullptr;
+  } else {
+    inner->num_keys = k - 1;
+    left = inner;
+  }
 }
 
+// n这颗子树最右边的leaf
+leaf_node *last_leaf_of(node_type *n) const {
+  while (!n->is_leaf) n = as_inner(n)->nodes[n->num_keys];
+  return as_leaf(n);
+}
 
-vector <key_type> get_keys() const {
-  Node<key_type, val_type> *n = root;
-  vector <key_type> rv;
-  size_t i;
+// n这颗子树最左边的leaf
+leaf_node *first_leaf_of(node_type *n) const {
+  while (!n->is_leaf) n = as_inner(n)->nodes[0];
+  return as_leaf(n);
+}
 
-  // go to the leftmost node.
-  while (n->nodes.size() != 0) {
-    n = n->nodes[0];
+/* split_at没有counts的时候: last往左、first往右同时数leaf里的records，先数完的那边就是小的那边，
+   返回first往右一共有多少records
+*/
+size_t count_after(const leaf_node *last, const leaf_node *first) const {
+  size_t before = 0, after = 0;
+
+  while (last != nullptr && first != nullptr) {
+    before += subtree_size(last);
+    after += subtree_size(first);
+    last = last->prev_leaf;
+    first = first->next_leaf;
   }
+  return (first == nullptr) ? after : num_elements - before;
+}
 
-  do {
-    for (i = 0; i < n->keys.size(); i++) {
-      rv.push_back(n->keys[i]);
-    }
-    n = n->next_leaf;
-  } while (n != nullptr);
+// n这颗子树的高度，leaf是0
+static size_t height_of(const node_type *n) {
+  size_t h = 0;
+  for (; !n->is_leaf; h++) n = as_inner(n)->nodes[0];
+  return h;
+}
 
-  return rv;
-} 
+/* join: left的key都 < sep <= right的key，left_size/right_size是records的个数。
+   矮的那颗 (一样高的时候是right) 接到高的那颗的右边 (或者左边) 同样高度的node旁边，
+   用insert_children插进parent，parent放不下就分裂，一直到root。
+*/
+void stitch(node_type *left, size_t left_size, node_type *right, size_t right_size, const key_type &sep) {
+  vector <inner_node*> parents;
+  vector <size_t> traverse_indices;
+  vector <key_type> seps(1, sep);
+  vector <node_type*> new_nodes;
+  size_t lh = height_of(left), rh = height_of(right), h, i;
+  bool append = (lh >= rh);  // right接到left的右边
+  node_type *n;
+
+  root = append ? left : right;
+  h = append ? lh : rh;
+  n = root;
+  for (; h > (append ? rh : lh); h--) {
+    n = parents.empty() ? writable(n, nullptr, 0) : writable(n, parents.back(), traverse_indices.back());
+    i = append ? n->num_keys : 0;
+    parents.push_back(as_inner(n));
+    traverse_indices.push_back(i);
+    n = as_inner(n)->nodes[i];
+  }
+  count_path(parents, traverse_indices, append ? right_size : left_size);
+
+  if (append) {
+    new_nodes.push_back(right);
+  } else {
+    /* left takes the place of the leftmost node, which moves to its right */
+    parents.back()->nodes[0] = left;
+    new_nodes.push_back(n);
+  }
+  insert_children(parents, traverse_indices, seps, new_nodes);
+}
 
-vector <val_type> get_vals() const {
-  Node<key_type, val_type> *n = root;
-  vector <val_type> rv;
-  size_t i;
+/* n (路径最下面的node) 的key太少了，和一个兄弟合并或者平分，合并会让parent少一个key，所以可能一直合并到root */
+void rebalance(vector <inner_node*> &parents, vector <size_t> &traverse_indices, node_type *n) {
+  size_t min_keys = (max_degree - 1) / 2;
+  size_t traverse_index;
+  inner_node *parent;
+
+  while (n != root && n->num_keys < min_keys) {
+    parent = parents.back();
+    parents.pop_back();
+    traverse_index = traverse_indices.back();
+    traverse_indices.pop_back();
 
-  // go to the leftmost node.
-  while (n->nodes.size() != 0) {
-    n = n->nodes[0];
+    if (!merge_or_share(parent, traverse_index > 0 ? traverse_index - 1 : traverse_index)) return;
+    n = parent;
   }
 
-  do {
-    for (i = 0; i < n->vals.size(); i++) {
-      rv.push_back(n->vals[i]);
+  /* the root lost its last key */
+  if (!root->is_leaf && root->num_keys == 0) {
+    BPLUSTREE_STAT(root_collapses);
+    n = root;
+    root = as_inner(root)->nodes[0];
+    free_node(n);
+  }
+}
+
+/* parent->nodes[i] 和 parent->nodes[i + 1] 放得进一个node就合并(返回true)，否则两个node平分 */
+bool merge_or_share(inner_node *parent, size_t i) {
+  node_type *left = writable(parent->nodes[i], parent, i), *right = parent->nodes[i + 1];  // right is only modified when sharing
+  leaf_node *left_leaf, *right_leaf;
+  inner_node *left_inner, *right_inner;
+  vector <key_type> ks;
+  vector <node_type*> cs;
+  vector <size_t> cn;
+  size_t total, half, moved;
+
+  if (left->is_leaf) {
+    left_leaf = as_leaf(left);
+    right_leaf = as_leaf(right);
+    total = left_leaf->num_keys + right_leaf->num_keys;
+
+    if (total > max_degree - 1) {
+      BPLUSTREE_STAT(leaf_borrows);
+      right_leaf = as_leaf(writable(right, parent, i + 1));
+      half = total / 2;
+      if (left_leaf->num_keys > half) {  // left -> right
+        moved = left_leaf->num_keys - half;
+        std::move_backward(right_leaf->keys.begin(), right_leaf->keys.begin() + right_leaf->num_keys, right_leaf->keys.begin() + right_leaf->num_keys + moved);
+        std::move_backward(right_leaf->vals.begin(), right_leaf->vals.begin() + right_leaf->num_keys, right_leaf->vals.begin() + right_leaf->num_keys + moved);
+        std::move(left_leaf->keys.begin() + half, left_leaf->keys.begin() + left_leaf->num_keys, right_leaf->keys.begin());
+        std::move(left_leaf->vals.begin() + half, left_leaf->vals.begin() + left_leaf->num_keys, right_leaf->vals.begin());
+        move_dead(right_leaf, 0, right_leaf->num_keys, right_leaf, moved);
+        move_dead(left_leaf, half, left_leaf->num_keys, right_leaf, 0);
+      } else {                           // right -> left
+        moved = half - left_leaf->num_keys;
+        std::move(right_leaf->keys.begin(), right_leaf->keys.begin() + moved, left_leaf->keys.begin() + left_leaf->num_keys);
+        std::move(right_leaf->vals.begin(), right_leaf->vals.begin() + moved, left_leaf->vals.begin() + left_leaf->num_keys);
+        std::move(right_leaf->keys.begin() + moved, right_leaf->keys.begin() + right_leaf->num_keys, right_leaf->keys.begin());
+        std::move(right_leaf->vals.begin() + moved, right_leaf->vals.begin() + right_leaf->num_keys, right_leaf->vals.begin());
+        move_dead(right_leaf, 0, moved, left_leaf, left_leaf->num_keys);
+        move_dead(right_leaf, moved, right_leaf->num_keys, right_leaf, 0);
+      }
+      left_leaf->num_keys = half;
+      right_leaf->num_keys = total - half;
+      parent->keys[i] = KeySeparator<key_type>::between(left_leaf->keys[half - 1], right_leaf->keys[0]);
+      if (order_statistics) {
+        parent->counts[i] = subtree_size(left_leaf);
+        parent->counts[i + 1] = subtree_size(right_leaf);
+      }
+      return false;
+    }
+
+    BPLUSTREE_STAT(leaf_merges);
+    take(right, right_leaf->keys.begin(), right_leaf->keys.begin() + right_leaf->num_keys, left_leaf->keys.begin() + left_leaf->num_keys);
+    take(right, right_leaf->vals.begin(), right_leaf->vals.begin() + right_leaf->num_keys, left_leaf->vals.begin() + left_leaf->num_keys);
+    move_dead(right_leaf, 0, right_leaf->num_keys, left_leaf, left_leaf->num_keys);
+    left_leaf->num_keys = total;
+    left_leaf->next_leaf = right_leaf->next_leaf;
+    if (right_leaf->next_leaf != nullptr) right_leaf->next_leaf->prev_leaf = left_leaf;
+
+  } else {
+    left_inner = as_inner(left);
+    right_inner = as_inner(right);
+    total = left_inner->num_keys + 1 + right_inner->num_keys; // 加上parent里的separator
+
+    if (total > max_degree - 1) {
+      BPLUSTREE_STAT(inner_borrows);
+      right_inner = as_inner(writable(right, parent, i + 1));
+      ks.assign(std::make_move_iterator(left_inner->keys.begin()), std::make_move_iterator(left_inner->keys.begin() + left_inner->num_keys));
+      ks.push_back(std::move(parent->keys[i]));
+      ks.insert(ks.end(), std::make_move_iterator(right_inner->keys.begin()), std::make_move_iterator(right_inner->keys.begin() + right_inner->num_keys));
+      cs.assign(left_inner->nodes.begin(), left_inner->nodes.begin() + left_inner->num_keys + 1);
+      cs.insert(cs.end(), right_inner->nodes.begin(), right_inner->nodes.begin() + right_inner->num_keys + 1);
+      if (order_statistics) {
+        cn.assign(left_inner->counts.begin(), left_inner->counts.begin() + left_inner->num_keys + 1);
+        cn.insert(cn.end(), right_inner->counts.begin(), right_inner->counts.begin() + right_inner->num_keys + 1);
+      }
+
+      half = total / 2;
+      std::move(ks.begin(), ks.begin() + half, left_inner->keys.begin());
+      std::copy(cs.begin(), cs.begin() + half + 1, left_inner->nodes.begin());
+      left_inner->num_keys = half;
+      parent->keys[i] = std::move(ks[half]);
+      std::move(ks.begin() + half + 1, ks.end(), right_inner->keys.begin());
+      std::copy(cs.begin() + half + 1, cs.end(), right_inner->nodes.begin());
+      right_inner->num_keys = total - half - 1;
+      if (order_statistics) {
+        std::copy(cn.begin(), cn.begin() + half + 1, left_inner->counts.begin());
+        std::copy(cn.begin() + half + 1, cn.end(), right_inner->counts.begin());
+        parent->counts[i] = subtree_size(left_inner);
+        parent->counts[i + 1] = subtree_size(right_inner);
+      }
+      return false;
     }
-    n = n->next_leaf;
-  } while (n != nullptr);
 
-  return rv;
-}
+    BPLUSTREE_STAT(inner_merges);
+    left_inner->keys[left_inner->num_keys] = parent->keys[i];
+    take(right, right_inner->keys.begin(), right_inner->keys.begin() + right_inner->num_keys, left_inner->keys.begin() + left_inner->num_keys + 1);
+    std::copy(right_inner->nodes.begin(), right_inner->nodes.begin() + right_inner->num_keys + 1, left_inner->nodes.begin() + left_inner->num_keys + 1);
+    if (order_statistics) std::copy(right_inner->counts.begin(), right_inner->counts.begin() + right_inner->num_keys + 1, left_inner->counts.begin() + left_inner->num_keys + 1);
+    left_inner->num_keys = total;
+  }
 
-val_type at(const key_type &key) const {
-  iterator it = find(key);
-  return it.get_val();
+  /* the right node was merged into the left one */
+  array_erase(parent->keys, parent->num_keys, i);
+  array_erase(parent->nodes, parent->num_keys + 1, i + 1);
+  if (order_statistics) {
+    array_erase(parent->counts, parent->num_keys + 1, i + 1);
+    parent->counts[i] = subtree_size(left);
+  }
+  parent->num_keys--;
+  free_node(right);
+  return true;
 }
-val_type & operator[] (const key_type &key) {
 
-  static val_type dummy;
-  if (find(key) == end()) insert(key, dummy);
+/* ---------------- order statistics ----------------
+   order_statistics的时候inner->counts[i]是nodes[i]下面record的个数 (tombstone不算)，所有修改nodes的地方都要同时维护counts。
+   insert/erase/batch先沿着路径把counts加上record个数的变化，分裂、合并、借key的时候再重算受影响的孩子。
+   不是order_statistics的时候counts是空的数组，这些函数都不会被调用。
+*/
+
+// n这颗子树里record的个数
+static size_t subtree_size(const node_type *n) {
+  const inner_node *inner;
+  size_t i, total = 0;
 
+  if (n->is_leaf) return live_keys(as_leaf(n), 0, n->num_keys);
+  inner = as_inner(n);
+  for (i = 0; i <= n->num_keys; i++) total += inner->counts[i];
+  return total;
+}
 
-  Node<key_type,val_type> *n = root; 
+// 从root下来的路径上，每个parent走的那个孩子多了delta个record
+void count_path(vector <inner_node*> &parents, vector <size_t> &traverse_indices, ptrdiff_t delta) {
   size_t i;
+  if (!order_statistics) return;
+  for (i = 0; i < parents.size(); i++) parents[i]->counts[traverse_indices[i]] += delta;
+}
 
-  /* find the leaf node first */
-  while (n->nodes.size() != 0) {
-    for (i = 0; i < n->keys.size(); i++) {
-      if (key < n->keys[i]) break;
-    }
+// 按孩子重新算一遍n的counts
+static void recount(inner_node *n) {
+  size_t i;
+  for (i = 0; i <= n->num_keys; i++) n->counts[i] = subtree_size(n->nodes[i]);
+}
 
-    if (n->nodes.size() != 0) n = n->nodes[i];
-  }
+// 第k个record (从0开始)，k >= size()的时候返回end()
+iterator nth_record(size_t k) const {
+  node_type *n = root;
+  iterator it;
+  size_t i;
 
-  /* check to see if we find the key */
-  for (i = 0; i < n->keys.size(); i++) {
-    if (key == n->keys[i]) {
-      break;
+  if (k >= num_elements) return end();
+  while (!n->is_leaf) {
+    for (i = 0; i < n->num_keys && k >= as_inner(n)->counts[i]; i++) k -= as_inner(n)->counts[i];
+    n = as_inner(n)->nodes[i];
+  }
+  it.node = as_leaf(n);
+  it.idx = k;
+  if (lazy_erase) {  // the k-th slot that is not a tombstone
+    for (it.idx = 0; is_dead(it.node, it.idx) || k > 0; it.idx++) {
+      if (!is_dead(it.node, it.idx)) k--;
     }
   }
-  
-  if (n->keys.size() == i) throw std::runtime_error("B+tree [] internal error");
-  return n->vals[i];
+  it.tree = this;
+  return it;
 }
 
-reverse_iterator rbegin() const {
-  reverse_iterator rit;
-  Node<key_type, val_type> *n = root;
+// 比key小的record的个数
+size_t rank_of(const key_type &key) const {
+  node_type *n = root;
+  size_t i, j, r = 0;
 
-  if(num_elements == 0) {
-    rit.node = nullptr;
-    rit.idx = 0;
-    return rit;
+  while (!n->is_leaf) {
+    i = child_index(n, key);
+    for (j = 0; j < i; j++) r += as_inner(n)->counts[j];
+    n = as_inner(n)->nodes[i];
   }
+  return r + live_keys(as_leaf(n), 0, search_type::lower_bound(n->keys.data(), n->num_keys, key));
+}
 
-  /* find the rightmost node */
-  while (n->nodes.size() != 0) {
-    n = n->nodes[n->nodes.size() - 1];
-  }
+// iterator的位置 (end()是size())
+size_t position(const leaf_node *leaf, size_t idx) const {
+  if (leaf == nullptr) return num_elements;
+  return rank_of(leaf->keys[idx]);
+}
 
-  rit.node = n;
-  rit.idx = n->vals.size() - 1; 
-  
+// 把n个东西平均分成若干组，每组不超过capacity
+static vector <size_t> even_groups(size_t n, size_t capacity) {
+  vector <size_t> groups;
+  size_t count = (n + capacity - 1) / capacity;
+  size_t i;
 
-  return rit;
+  for (i = 0; i < count; i++) groups.push_back(n / count + (i < n % count ? 1 : 0));
+  return groups;
 }
 
-reverse_iterator rend() const {
-  reverse_iterator rit;
-  rit.node = nullptr;
-  rit.idx = 0;
-  return rit; 
+// bulk_load里每个node的目标大小: fill_factor * capacity，但不能小于lo
+static size_t fill_target(double fill_factor, size_t capacity, size_t lo) {
+  size_t n = (size_t)(fill_factor * capacity + 0.5);
+  if (n < lo) n = lo;
+  if (n > capacity) n = capacity;
+  return n;
 }
 
-iterator begin() const {
-
-  iterator it;
-  Node<key_type, val_type> *n = root;
+/* 把n个孩子分成若干组，每组target个。最后一组少于lo个的时候，
+   和前一组合起来不超过hi就合并，否则两组平分(每组 >= hi / 2 >= lo)
+*/
+static vector <size_t> group_sizes(size_t n, size_t target, size_t lo, size_t hi) {
+  vector <size_t> groups;
+  size_t total;
 
-  if(num_elements == 0) {
-    it.node = nullptr;
-    it.idx = 0;
-    return it;
+  while (n > 0) {
+    groups.push_back(n < target ? n : target);
+    n -= groups.back();
   }
+  if (groups.size() > 1 && groups.back() < lo) {
+    total = groups[groups.size() - 2] + groups.back();
+    groups.pop_back();
+    if (total <= hi) {
+      groups.back() = total;
+    } else {
+      groups.back() = total - total / 2;
+      groups.push_back(total / 2);
+    }
+  }
+  return groups;
+}
 
-  /* find the leftmost node */
-  while (n->nodes.size() != 0) {
-    n = n->nodes[0];
+/* split_range的实现，lo/hi是nullptr表示没有边界。
+   从root开始一层一层往下展开和 [lo, hi) 有交集的子树，直到子树个数 >= parts 或者到了leaf，
+   第i段就是从第i颗子树最左边的record到第i+1颗子树最左边的record (第一段和最后一段按lo/hi截断)。
+*/
+vector <pair<iterator, iterator> > split(const key_type *lo, const key_type *hi, size_t parts) const {
+  vector <pair<iterator, iterator> > rv;
+  vector <node_type*> level(1, root), next;
+  iterator first, last, stop;
+  node_type *n;
+  size_t i, j, from, to;
+
+  while (level.size() < parts && !level[0]->is_leaf) {
+    next.clear();
+    for (i = 0; i < level.size(); i++) {
+      from = (i == 0 && lo != nullptr) ? child_index(level[i], *lo) : 0;
+      to = (i + 1 == level.size() && hi != nullptr) ? child_index(level[i], *hi) : level[i]->num_keys;
+      for (j = from; j <= to; j++) next.push_back(as_inner(level[i])->nodes[j]);
+    }
+    level.swap(next);
   }
 
-  it.node = n;
-  it.idx = 0; 
-  
-  return it;
+  first = (lo != nullptr) ? lower_bound(*lo) : begin();
+  stop = (hi != nullptr) ? lower_bound(*hi) : end();
+  for (i = 0; i < level.size(); i++) {
+    if (i + 1 < level.size()) {
+      for (n = level[i + 1]; !n->is_leaf; n = as_inner(n)->nodes[0]);
+      last.node = as_leaf(n);
+      last.idx = 0;
+      last.tree = this;
+      skip_dead(last.node, last.idx, stop.node, stop.idx);
+    } else {
+      last = stop;
+    }
+    if (first != last) rv.push_back(make_pair(first, last));
+    first = last;
+  }
+  return rv;
 }
 
-iterator end() const {
-  iterator it;
-  it.node = nullptr;
-  it.idx = 0;
-  return it; 
+// 对 [first, last) 里的每个record调用f(key, val)，直接按leaf访问，不用iterator一个一个加
+template <class Func>
+static void scan(const iterator &first, const iterator &last, Func &f) {
+  const leaf_node *leaf = first.node;
+  size_t i = first.idx, stop;
+
+  while (leaf != nullptr) {
+    if (leaf != last.node && leaf->next_leaf != nullptr) prefetch_leaf(leaf->next_leaf);
+    stop = (leaf == last.node) ? last.idx : leaf->num_keys;
+    for (; i < stop; i++) {
+      if (!is_dead(leaf, i)) f(leaf->keys[i], leaf->vals[i]);
+    }
+    if (leaf == last.node) return;
+    leaf = leaf->next_leaf;
+    i = 0;
+  }
 }
 
+/* get_keys/get_vals: get(leaf, i)取出要的东西。
+   并行的时候先分段数每段有多少个record，prefix sum算出每段在rv里的起点，再各自填自己那一段。
+   vector<bool>的元素不是独立的内存，不能并行写。
+*/
+template <class T, class Get>
+void export_all(vector <T> &rv, size_t num_threads, Get get) const {
+  vector <pair<iterator, iterator> > parts;
+  vector <size_t> offsets;
+  const leaf_node *n;
+  size_t i;
 
+  if (num_threads <= 1 || num_elements < parallel_export_min || std::is_same<T, bool>::value) {
+    rv.reserve(num_elements);
+    for (n = leftmost_leaf(); n != nullptr; n = n->next_leaf) {
+      for (i = 0; i < n->num_keys; i++) {
+        if (!is_dead(n, i)) rv.push_back(get(n, i));
+      }
+    }
+    return;
+  }
 
-private:
-  size_t num_elements;  // 这颗树中存的key-value的数量
-  Node<key_type, val_type>*root;  // Tree Root
-  size_t max_degree;  // M
+  parts = split(nullptr, nullptr, num_threads * scan_parts_per_thread);
+  offsets.assign(parts.size() + 1, 0);
+  parallel_for(parts.size(), num_threads, [&](size_t p) {
+    const leaf_node *leaf = parts[p].first.node;
+    size_t count = 0;
+
+    /* only the num_keys (and the tombstones) of every leaf is read */
+    for (; leaf != parts[p].second.node; leaf = leaf->next_leaf) count += subtree_size(leaf);
+    if (leaf != nullptr) count += live_keys(leaf, 0, parts[p].second.idx);
+    offsets[p + 1] = count - live_keys(parts[p].first.node, 0, parts[p].first.idx);
+  });
+  for (i = 0; i < parts.size(); i++) offsets[i + 1] += offsets[i];
+
+  rv.resize(num_elements);
+  parallel_for(parts.size(), num_threads, [&](size_t p) {
+    const leaf_node *leaf = parts[p].first.node;
+    size_t j = parts[p].first.idx, stop, pos = offsets[p];
+
+    while (leaf != nullptr) {
+      stop = (leaf == parts[p].second.node) ? parts[p].second.idx : leaf->num_keys;
+      for (; j < stop; j++) {
+        if (!is_dead(leaf, j)) rv[pos++] = get(leaf, j);
+      }
+      if (leaf == parts[p].second.node) break;
+      leaf = leaf->next_leaf;
+      j = 0;
+    }
+  });
+}
 
-// 这个函数所做的就是递归删除这个node的所有子节点
-void recursive_clear_tree(const Node<key_type, val_type> *n) {
-  size_t i;
-  for (i = 0; i < n->nodes.size(); i++) { // node是指向下一层的node，即孩子节点
-    recursive_clear_tree(n->nodes[i]);  // 递归
+// go to the leftmost leaf
+leaf_node *leftmost_leaf() const {
+  node_type *n = root;
+  while (!n->is_leaf) {
+    n = as_inner(n)->nodes[0];
   }
-  delete n; // 删除自己
+  return as_leaf(n);
 }
 
+/* 删除n这颗子树的所有node (n必须是root，因为allocator会被整个清空)
+   如果allocator可以整块释放，那么只需要调用析构函数，key和val都是trivially destructible的时候连析构函数都不用调，
+   直接把所有chunk还回去。否则一个一个node释放。
+   还有snapshot活着的时候不能整块释放，只能一个一个free_node (snapshot看得到的node会被retire)。
+   用一个栈代替递归，所以树多高都没关系。
+*/
+void destroy_tree(node_type *n) {
+  vector <node_type*> stack;
+  bool bulk = allocator_type::bulk_release && !reclaim();
+  size_t i;
+
+  tail = nullptr;
 
+  if (bulk && std::is_trivially_destructible<key_type>::value
+      && std::is_trivially_destructible<val_type>::value) {
+    alloc.release_all();
+    return;
+  }
 
-}; // end of Tree class
+  stack.push_back(n);
+  while (!stack.empty()) {
+    n = stack.back();
+    stack.pop_back();
+
+    if (!n->is_leaf) {
+      for (i = 0; i <= n->num_keys; i++) stack.push_back(as_inner(n)->nodes[i]); // 孩子节点
+      if (bulk) as_inner(n)->~inner_node();
+      else free_node(n);
+    } else {
+      if (bulk) as_leaf(n)->~leaf_node();
+      else free_node(n);
+    }
+  }
+
+  if (bulk) alloc.release_all();
+}
 
-}; // end of namespace 
 
 
+}; // end of Tree class
+
+}; // end of namespace
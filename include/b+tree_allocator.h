@@ -0,0 +1,209 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <new>
+#include <memory>
+#include <utility>
+
+
+/**
+
+      B+Tree node allocator synopsis
+
+  Tree<key_type, val_type, max_children, allocator_type> creates and frees every node
+  through allocator_type, which has to provide
+
+    template <class T> T *create();       // allocate and construct a node
+    template <class T> void destroy(T *); // destruct and free a node
+    void release_all();                   // free every node at once (destructors are not called)
+    void share(allocator_type &a);        // from now on nodes of either one may be destroyed by the other
+    static const bool bulk_release;       // true if release_all() really frees the memory
+
+  NodeSlabAllocator<chunk_size>  (default)
+    Nodes are carved out of chunk_size byte chunks, one pool per node size.
+    Freed nodes go to a free list and are handed out again first,
+    release_all() gives back whole chunks, so clear() doesn't free nodes one by one.
+    Nodes created one after another (e.g. the two halves of a split) sit next to each other.
+    After share() (Tree::split_at/join move nodes between trees) the two allocators own
+    each other's chunks too, a chunk goes back to the system when the last owner releases it.
+
+  NodeHeapAllocator
+    One new/delete per node.
+
+  Neither allocator is thread safe, they belong to one Tree. Allocators that shared
+  their chunks can still be used from different threads.
+
+*/
+
+namespace BPlusTree {
+
+// cache line size, used to align the nodes and the arrays stored inline in them
+const size_t cache_line_size = 64;
+
+class NodeHeapAllocator
+{
+public:
+  static const bool bulk_release = false;
+
+  template <class T>
+  T *create() { return new T; }
+
+  template <class T>
+  void destroy(T *p) { delete p; }
+
+  void release_all() {}
+
+  void share(NodeHeapAllocator &) {}
+};
+
+
+template <size_t chunk_size = (1 << 20)>
+class NodeSlabAllocator
+{
+public:
+  static const bool bulk_release = true;
+
+  NodeSlabAllocator() {}
+  NodeSlabAllocator(const NodeSlabAllocator &) {}  // a copy starts with its own empty pools
+  NodeSlabAllocator &operator=(const NodeSlabAllocator &) { return *this; }
+  NodeSlabAllocator(NodeSlabAllocator &&a)
+    : pools(std::move(a.pools)), arena(std::move(a.arena)), borrowed(std::move(a.borrowed)) { a.release_all(); }
+  NodeSlabAllocator &operator=(NodeSlabAllocator &&a) {
+    if (this != &a) {
+      release_all();
+      pools = std::move(a.pools);
+      arena = std::move(a.arena);
+      borrowed = std::move(a.borrowed);
+      a.release_all();
+    }
+    return *this;
+  }
+
+  ~NodeSlabAllocator() { release_all(); }
+
+  template <class T>
+  T *create() {
+    if (arena == nullptr) arena = std::make_shared<Arena>();
+    void *p = pool_for(sizeof(T)).allocate(arena->chunks);
+    return ::new (p) T;
+  }
+
+  template <class T>
+  void destroy(T *p) {
+    p->~T();
+    pool_for(sizeof(T)).free(p);
+  }
+
+  // 整块整块地还给系统，share()过的chunk等最后一个拥有它的allocator释放
+  void release_all() {
+    pools.clear();
+    arena = nullptr;
+    borrowed.clear();
+  }
+
+  /* a的node以后可能由这个allocator destroy (反过来也一样)，free list会把它们再分出去，
+     所以两边都拥有对方拥有的所有chunk */
+  void share(NodeSlabAllocator &a) {
+    std::vector <std::shared_ptr<Arena> > all;
+    size_t i;
+
+    if (this == &a) return;
+    if (arena == nullptr) arena = std::make_shared<Arena>();
+    if (a.arena == nullptr) a.arena = std::make_shared<Arena>();
+    all = borrowed;
+    all.insert(all.end(), a.borrowed.begin(), a.borrowed.end());
+    all.push_back(arena);
+    all.push_back(a.arena);
+    std::sort(all.begin(), all.end());
+    all.erase(std::unique(all.begin(), all.end()), all.end());
+
+    borrowed.clear();
+    a.borrowed.clear();
+    for (i = 0; i < all.size(); i++) {
+      if (all[i] != arena) borrowed.push_back(all[i]);
+      if (all[i] != a.arena) a.borrowed.push_back(all[i]);
+    }
+  }
+
+private:
+
+  // 一个allocator分出来的所有chunk
+  struct Arena {
+    std::vector <char*> chunks;
+    ~Arena() {
+      size_t i;
+      for (i = 0; i < chunks.size(); i++) std::free(chunks[i]);
+    }
+  };
+
+  struct FreeSlot {
+    FreeSlot *next;
+  };
+
+  struct Pool {
+    size_t slot_size;
+    char *next;       // 当前chunk里下一个没用过的slot
+    char *limit;      // 当前chunk的结尾
+    FreeSlot *free_list;
+
+    void *allocate(std::vector <char*> &chunks) {
+      FreeSlot *slot;
+      char *chunk;
+      size_t slots;
+
+      /* reuse a node freed by a merge first */
+      if (free_list != nullptr) {
+        slot = free_list;
+        free_list = slot->next;
+        return slot;
+      }
+
+      if (next == limit) {
+        slots = chunk_size / slot_size;
+        if (slots == 0) slots = 1;
+        void *p;
+        if (posix_memalign(&p, cache_line_size, slots * slot_size) != 0) throw std::bad_alloc();
+        chunk = static_cast<char*>(p);
+        chunks.push_back(chunk);
+        next = chunk;
+        limit = chunk + slots * slot_size;
+      }
+
+      chunk = next;
+      next += slot_size;
+      return chunk;
+    }
+
+    void free(void *p) {
+      FreeSlot *slot = static_cast<FreeSlot*>(p);
+      slot->next = free_list;
+      free_list = slot;
+    }
+  };
+
+  // inner node和leaf node大小不一样，各用一个pool
+  Pool &pool_for(size_t size) {
+    size_t i;
+    Pool p;
+
+    size = (size + cache_line_size - 1) / cache_line_size * cache_line_size;
+    for (i = 0; i < pools.size(); i++) {
+      if (pools[i].slot_size == size) return pools[i];
+    }
+
+    p.slot_size = size;
+    p.next = nullptr;
+    p.limit = nullptr;
+    p.free_list = nullptr;
+    pools.push_back(p);
+    return pools.back();
+  }
+
+  std::vector <Pool> pools;
+  std::shared_ptr <Arena> arena;                   // 新的chunk放在这里
+  std::vector <std::shared_ptr<Arena> > borrowed;  // share()拿到的别的allocator的chunk
+};
+
+}; // end of namespace
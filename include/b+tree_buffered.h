@@ -0,0 +1,762 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include "b+tree.h"
+
+
+/**
+
+      Write-buffered B+Tree (B-epsilon tree) synopsis
+
+namespace BPlusTree
+{
+
+template <class key_type, class val_type, size_t max_children = 64, size_t buffer_size = 8 * max_children,
+          class allocator_type = NodeSlabAllocator<> >
+class BufferedTree
+{
+public:
+  class iterator;   // get_key, get_val, ++, ==, != (forward only, valid until the next write)
+
+  BufferedTree();
+  ~BufferedTree();
+
+  void insert(const key_type &key, const val_type &val);  // an upsert message into the root's buffer
+  void erase(const key_type &key);                        // an erase message into the root's buffer
+  bool find(const key_type &key, val_type &val) const;    // copy the val out, false if the key doesn't exist
+  bool contains(const key_type &key) const;
+  iterator lower_bound(const key_type &key) const;
+  iterator begin() const;
+  iterator end() const;
+
+  void flush();              // push every pending message into the leaves, linear time
+  size_t size();             // flush(), then the number of records
+  bool empty();
+  size_t pending() const;    // messages waiting in the buffers
+  void clear();
+};
+
+};
+
+  Inner nodes have, besides the separators and the children, a buffer of up to buffer_size messages
+  (key, val, erase) sorted by key. A buffer has at most one message per key: a new message replaces the older one,
+  and a message in an upper buffer is always newer than the ones below it on the same path.
+
+  insert/erase: the message goes into the root's buffer (a root leaf is changed right away). When the buffer is full,
+  it is emptied from right to left, one child at a time, all the messages of that child moving down in one batch:
+    inner child: merged into its buffer. If there is no room, that child's buffer is emptied first.
+    leaf:        merged into the records like Tree::apply_batch. The leaf is split into as many leaves as needed,
+                 or merged with / shares keys with a neighbour when it gets too small.
+  So every leaf visit applies a batch of messages instead of one, and the leaves (the cache misses of a random
+  insert) are touched about buffer_size / max_children times less often. Splits go up along the path, a split
+  above the node being emptied starts the flush over from the root. Inner nodes are never merged (like ConcurrentTree).
+  flush() rebuilds the tree with full nodes.
+
+  find: walk from the root to the leaf and binary-search every buffer on the way. The first message for the key decides.
+  Iterators merge as they go: an iterator keeps a position in its leaf and in the part of every buffer on its path
+  that falls into the leaf's key range, and the smallest key among them is the current record (on a tie the upper
+  buffer wins, an erase message hides the key). Nothing is copied. At the end of the leaf's range the next leaf is
+  found from the root again with the upper bound of the leaf. Reads never change the tree.
+
+  size() is not known while messages are pending (an upsert may overwrite, an erase may miss), so it flushes first.
+
+*/
+
+namespace BPlusTree {
+
+template <class key_type, class val_type, size_t max_children>
+class BufferedNode
+{
+public:
+  BufferedNode(bool leaf) : num_keys(0), is_leaf(leaf) {}
+
+  // 和Node一样按cache line对齐分配 (NodeHeapAllocator用的是new)
+  static void *operator new(size_t size) {
+    void *p;
+    if (posix_memalign(&p, cache_line_size, size) != 0) throw std::bad_alloc();
+    return p;
+  }
+  static void operator delete(void *p) { free(p); }
+
+  size_t num_keys;
+  bool is_leaf;
+  alignas(cache_line_size) std::array <key_type, max_children> keys;
+};
+
+template <class key_type, class val_type, size_t max_children, size_t buffer_size>
+class BufferedInner : public BufferedNode<key_type, val_type, max_children>
+{
+public:
+  BufferedInner() : BufferedNode<key_type, val_type, max_children>(false), num_msgs(0) {}
+  std::array <BufferedNode<key_type, val_type, max_children>*, max_children + 1> nodes;
+  size_t num_msgs;
+  alignas(cache_line_size) std::array <key_type, buffer_size> msg_keys;  // sorted, the buffer is searched like keys
+  std::array <val_type, buffer_size> msg_vals;
+  std::array <bool, buffer_size> msg_erase;
+};
+
+template <class key_type, class val_type, size_t max_children>
+class BufferedLeaf : public BufferedNode<key_type, val_type, max_children>
+{
+public:
+  BufferedLeaf() : BufferedNode<key_type, val_type, max_children>(true) {}
+  alignas(cache_line_size) std::array <val_type, max_children> vals;
+};
+
+
+template <class key_type, class val_type, size_t max_children = 64, size_t buffer_size = 8 * max_children,
+          class allocator_type = NodeSlabAllocator<> >
+class BufferedTree
+{
+
+  static_assert(max_children >= 3, "B+Tree - max_children must be >= 3");
+  static_assert(buffer_size >= max_children, "B+Tree - buffer_size must be >= max_children");
+
+  typedef BufferedNode<key_type, val_type, max_children> node_type;
+  typedef BufferedInner<key_type, val_type, max_children, buffer_size> inner_node;
+  typedef BufferedLeaf<key_type, val_type, max_children> leaf_node;
+  typedef BatchOp<key_type, val_type> message;
+
+  // iterator路径上的一个inner node，[b, e) 是它的buffer里落在当前leaf范围里的message
+  struct level {
+    const inner_node *node;
+    size_t b, e;
+  };
+
+public:
+
+  class iterator
+  {
+  public:
+
+    key_type get_key() const {
+      if (leaf == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
+      return current_key();
+    }
+
+    val_type get_val() const {
+      if (leaf == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
+      return (src == path.size()) ? leaf->vals[idx] : path[src].node->msg_vals[path[src].b];
+    }
+
+    iterator operator++(int) {
+      iterator it = *this;
+      ++(*this);
+      return it;
+    }
+
+    const iterator& operator++() {
+      if (leaf == nullptr) throw std::out_of_range("B+Tree: iterator is out of range");
+      skip();
+      settle();
+      return *this;
+    }
+
+    bool operator!=(const iterator &it) const {
+      return !(*this == it);
+    }
+
+    bool operator==(const iterator &it) const {
+      if (leaf == nullptr || it.leaf == nullptr) return leaf == it.leaf;
+      return current_key() == it.current_key();
+    }
+
+  private:
+    friend class BufferedTree;
+    const BufferedTree *tree;
+    const leaf_node *leaf = nullptr;  // nullptr是end()
+    size_t idx;                       // leaf里下一个record
+    vector <level> path;              // root到leaf的inner nodes，和它们buffer里还没走到的message
+    size_t src;                       // 现在的record在哪: path[src]的buffer，path.size()是leaf
+    bool has_hi;                      // 不是最右边的leaf
+    key_type hi;                      // leaf的范围的上界，下一个leaf从这里开始
+
+    const key_type &current_key() const {
+      return (src == path.size()) ? leaf->keys[idx] : path[src].node->msg_keys[path[src].b];
+    }
+
+    // 所有key等于现在这个key的都跳过去 (leaf里的record和下面buffer里旧的message)
+    void skip() {
+      const key_type &key = current_key();  // 指向node里的数组，下标往前走它不会变
+      if (idx < leaf->num_keys && leaf->keys[idx] == key) idx++;
+      for (level &l : path) {
+        if (l.b < l.e && l.node->msg_keys[l.b] == key) l.b++;
+      }
+    }
+
+    /* leaf和path上的buffer里最小的key就是下一个record，同一个key的时候上面的buffer新。
+       是erase的message就跳过这个key；这个leaf的范围走完了就从root下去找下一个leaf
+    */
+    void settle() {
+      const key_type *key;
+      key_type next;
+      size_t j;
+
+      while (true) {
+        key = nullptr;
+        if (idx < leaf->num_keys) {
+          key = &leaf->keys[idx];
+          src = path.size();
+        }
+        for (j = path.size(); j-- > 0;) {
+          const level &l = path[j];
+          if (l.b < l.e && (key == nullptr || !(*key < l.node->msg_keys[l.b]))) {
+            key = &l.node->msg_keys[l.b];
+            src = j;
+          }
+        }
+
+        if (key == nullptr) {
+          if (!has_hi) {
+            leaf = nullptr;
+            return;
+          }
+          next = hi;
+          tree->load_leaf(&next, *this);
+        } else if (src < path.size() && path[src].node->msg_erase[path[src].b]) {
+          skip();
+        } else {
+          return;
+        }
+      }
+    }
+
+  }; // end of iterator
+
+
+BufferedTree() {
+  root = new_leaf();
+  num_elements = 0;
+  num_pending = 0;
+}
+
+~BufferedTree() {
+  destroy_tree();
+}
+
+BufferedTree(const BufferedTree &) = delete;
+BufferedTree &operator=(const BufferedTree &) = delete;
+
+void insert(const key_type &key, const val_type &val) {
+  put(key, &val);
+}
+
+void erase(const key_type &key) {
+  put(key, nullptr);
+}
+
+bool find(const key_type &key, val_type &val) const {
+  const val_type *v;
+
+  if (!lookup(key, v)) return false;
+  val = *v;
+  return true;
+}
+
+bool contains(const key_type &key) const {
+  const val_type *v;
+  return lookup(key, v);
+}
+
+iterator lower_bound(const key_type &key) const {
+  iterator it;
+
+  load_leaf(&key, it);
+  it.settle();
+  return it;
+}
+
+iterator begin() const {
+  iterator it;
+
+  load_leaf(nullptr, it);
+  it.settle();
+  return it;
+}
+
+iterator end() const {
+  iterator it;
+  it.tree = this;
+  return it;
+}
+
+/* 把所有的message都放到leaf里: 按顺序读出合并以后的records，再自底向上重新建树 (和Tree::bulk_load一样每个node都是满的) */
+void flush() {
+  vector <pair<key_type, val_type> > all;
+  iterator it;
+
+  if (num_pending == 0) return;
+  for (it = begin(); it != end(); ++it) all.push_back(make_pair(it.get_key(), it.get_val()));
+  destroy_tree();
+  build(all);
+}
+
+size_t size() {
+  flush();
+  return num_elements;
+}
+
+bool empty() { return size() == 0; }
+
+size_t pending() const { return num_pending; }
+
+void clear() {
+  destroy_tree();
+  root = new_leaf();
+  num_elements = 0;
+  num_pending = 0;
+}
+
+
+private:
+  node_type *root;
+  size_t num_elements;   // leaf里的records，还在buffer里的message不算
+  size_t num_pending;    // 所有buffer里的message
+  allocator_type alloc;
+  vector <inner_node*> parents;   // flush的时候从root下来的路径
+  vector <size_t> indices;        // parents[i]走的是第几个孩子
+  vector <message> ops;           // 放进一个leaf的message
+  vector <key_type> ks, seps;     // 合并、分裂用的临时数组
+  vector <val_type> vs;
+  vector <node_type*> cs, new_nodes;
+
+static inner_node *as_inner(node_type *n) { return static_cast<inner_node*>(n); }
+static leaf_node *as_leaf(node_type *n) { return static_cast<leaf_node*>(n); }
+static const inner_node *as_inner(const node_type *n) { return static_cast<const inner_node*>(n); }
+static const leaf_node *as_leaf(const node_type *n) { return static_cast<const leaf_node*>(n); }
+
+static size_t child_index(const node_type *n, const key_type &key) {
+  return NodeSearch<key_type>::upper_bound(n->keys.data(), n->num_keys, key);
+}
+
+// buffer里第一个 >= key 的message
+static size_t msg_index(const inner_node *n, const key_type &key) {
+  return NodeSearch<key_type>::lower_bound(n->msg_keys.data(), n->num_msgs, key);
+}
+
+leaf_node *new_leaf() { return alloc.template create<leaf_node>(); }
+inner_node *new_inner() { return alloc.template create<inner_node>(); }
+
+void free_node(node_type *n) {
+  if (n->is_leaf) alloc.destroy(as_leaf(n));
+  else alloc.destroy(as_inner(n));
+}
+
+// key最新的版本，找到的时候val指向它 (在message或者leaf里)
+bool lookup(const key_type &key, const val_type *&val) const {
+  const node_type *n = root;
+  const inner_node *inner;
+  size_t i;
+
+  while (!n->is_leaf) {
+    inner = as_inner(n);
+    i = msg_index(inner, key);
+    if (i < inner->num_msgs && inner->msg_keys[i] == key) {
+      if (inner->msg_erase[i]) return false;
+      val = &inner->msg_vals[i];
+      return true;
+    }
+    n = inner->nodes[child_index(n, key)];
+  }
+  i = child_index(n, key);
+  if (i > 0 && n->keys[i - 1] == key) {
+    val = &as_leaf(n)->vals[i - 1];
+    return true;
+  }
+  return false;
+}
+
+/* iterator进入key所在的leaf (key是nullptr的时候是最左边的leaf)，从 >= key 的地方开始:
+   leaf里的位置，和路径上每个buffer里 [key, hi) 这一段message，hi是这个leaf的范围的上界
+*/
+void load_leaf(const key_type *key, iterator &it) const {
+  const node_type *n = root;
+  const key_type *hi = nullptr;
+  size_t i;
+
+  it.path.clear();
+  it.path.reserve(16);
+  while (!n->is_leaf) {
+    i = (key == nullptr) ? 0 : child_index(n, *key);
+    if (i < n->num_keys) hi = &n->keys[i];
+    it.path.push_back(level{as_inner(n), 0, 0});
+    n = as_inner(n)->nodes[i];
+  }
+
+  for (level &l : it.path) {
+    l.b = (key == nullptr) ? 0 : msg_index(l.node, *key);
+    for (l.e = l.b; l.e < l.node->num_msgs && (hi == nullptr || l.node->msg_keys[l.e] < *hi); l.e++);  // 一个leaf的范围里message一般很少
+  }
+  it.tree = this;
+  it.leaf = as_leaf(n);
+  it.idx = (key == nullptr) ? 0 : NodeSearch<key_type>::lower_bound(n->keys.data(), n->num_keys, *key);
+  it.has_hi = (hi != nullptr);
+  if (hi != nullptr) it.hi = *hi;
+}
+
+/* insert/erase: val是nullptr的时候是erase。message放进root的buffer，同一个key旧的message被替换掉；
+   buffer满了就往下flush，直到root的buffer又有空位
+*/
+void put(const key_type &key, const val_type *val) {
+  inner_node *r;
+  size_t i;
+
+  if (root->is_leaf) {
+    ops.clear();
+    ops.push_back(message{key, (val == nullptr) ? val_type() : *val, val == nullptr});
+    parents.clear();
+    indices.clear();
+    apply_to_leaf(as_leaf(root));
+    return;
+  }
+
+  r = as_inner(root);
+  i = msg_index(r, key);
+  if (i < r->num_msgs && r->msg_keys[i] == key) {
+    r->msg_vals[i] = (val == nullptr) ? val_type() : *val;
+    r->msg_erase[i] = (val == nullptr);
+  } else {
+    array_insert(r->msg_keys, r->num_msgs, i, key);
+    array_insert(r->msg_vals, r->num_msgs, i, (val == nullptr) ? val_type() : *val);
+    array_insert(r->msg_erase, r->num_msgs, i, val == nullptr);
+    r->num_msgs++;
+    num_pending++;
+  }
+
+  while (!root->is_leaf && as_inner(root)->num_msgs == buffer_size) {
+    parents.assign(1, as_inner(root));
+    indices.clear();
+    flush_node();
+  }
+
+  /* the root has one child left and nothing buffered */
+  while (!root->is_leaf && root->num_keys == 0 && as_inner(root)->num_msgs == 0) {
+    r = as_inner(root);
+    root = r->nodes[0];
+    free_node(r);
+  }
+}
+
+/* 把parents.back()的buffer清空: 从右往左，每次把最后一段 (同一个孩子的message) 放到这个孩子里，
+   然后buffer的末尾直接截掉，不用移动。孩子是inner node但是放不下的时候，先把这个孩子清空 (递归)。
+   返回false: leaf的分裂一直插到了上面，parents不能再用了，调用的地方从root重新开始 (message都还在buffer里)
+*/
+bool flush_node() {
+  inner_node *n = parents.back(), *child;
+  size_t i, b, e, j;
+
+  while (n->num_msgs > 0) {
+    e = n->num_msgs;
+    i = child_index(n, n->msg_keys[e - 1]);
+    b = (i == 0) ? 0 : msg_index(n, n->keys[i - 1]);
+
+    if (!n->nodes[i]->is_leaf) {
+      child = as_inner(n->nodes[i]);
+      if (child->num_msgs + (e - b) > buffer_size) {
+        parents.push_back(child);
+        indices.push_back(i);
+        if (!flush_node()) return false;
+        parents.pop_back();
+        indices.pop_back();
+      }
+      merge_buffer(n, b, e, child);
+      n->num_msgs = b;
+      continue;
+    }
+
+    ops.clear();
+    for (j = b; j < e; j++) ops.push_back(message{std::move(n->msg_keys[j]), std::move(n->msg_vals[j]), n->msg_erase[j]});
+    n->num_msgs = b;
+    num_pending -= ops.size();
+    indices.push_back(i);
+    if (!apply_to_leaf(as_leaf(n->nodes[i]))) return false;
+  }
+  return true;
+}
+
+/* from的message [b, e) 合并进to的buffer (调用的地方保证放得下)，同一个key的时候from的更新。
+   从后往前合并，不用临时数组；重复的key丢掉的是to的message，留下的空位最后再移过去
+*/
+void merge_buffer(inner_node *from, size_t b, size_t e, inner_node *to) {
+  size_t i = to->num_msgs, j = e, w = to->num_msgs + (e - b), top = w;
+
+  while (j > b) {
+    if (i > 0 && from->msg_keys[j - 1] < to->msg_keys[i - 1]) {
+      i--;
+      w--;
+      to->msg_keys[w] = std::move(to->msg_keys[i]);
+      to->msg_vals[w] = std::move(to->msg_vals[i]);
+      to->msg_erase[w] = to->msg_erase[i];
+    } else {
+      if (i > 0 && to->msg_keys[i - 1] == from->msg_keys[j - 1]) {  // the older message is dropped
+        i--;
+        num_pending--;
+      }
+      j--;
+      w--;
+      to->msg_keys[w] = std::move(from->msg_keys[j]);
+      to->msg_vals[w] = std::move(from->msg_vals[j]);
+      to->msg_erase[w] = from->msg_erase[j];
+    }
+  }
+
+  if (w > i) {
+    std::move(to->msg_keys.begin() + w, to->msg_keys.begin() + top, to->msg_keys.begin() + i);
+    std::move(to->msg_vals.begin() + w, to->msg_vals.begin() + top, to->msg_vals.begin() + i);
+    std::move(to->msg_erase.begin() + w, to->msg_erase.begin() + top, to->msg_erase.begin() + i);
+  }
+  to->num_msgs = top - (w - i);
+}
+
+/* ops (排好序，key不重复) 合并进leaf，parents.back()->nodes[indices.back()]是这个leaf (parents是空的时候leaf是root)。
+   放不下就一次分成几个leaf插到parent里，太小了就和兄弟合并或者平分。
+   返回true: parent没有分裂，parents还能用 (indices.back()已经去掉了)
+*/
+bool apply_to_leaf(leaf_node *leaf) {
+  size_t min_keys = (max_children - 1) / 2;
+  vector <size_t> groups;
+  inner_node *parent = parents.empty() ? nullptr : parents.back();
+  leaf_node *right;
+  size_t i, j = 0, g;
+
+  ks.clear();
+  vs.clear();
+  for (i = 0; i < ops.size(); i++) {
+    while (j < leaf->num_keys && leaf->keys[j] < ops[i].key) {
+      ks.push_back(std::move(leaf->keys[j]));
+      vs.push_back(std::move(leaf->vals[j]));
+      j++;
+    }
+    if (j < leaf->num_keys && leaf->keys[j] == ops[i].key) {  // the message replaces the record
+      j++;
+      num_elements--;
+    }
+    if (!ops[i].erase) {
+      ks.push_back(std::move(ops[i].key));
+      vs.push_back(std::move(ops[i].val));
+      num_elements++;
+    }
+  }
+  for (; j < leaf->num_keys; j++) {
+    ks.push_back(std::move(leaf->keys[j]));
+    vs.push_back(std::move(leaf->vals[j]));
+  }
+
+  if (ks.size() <= max_children - 1) {
+    std::move(ks.begin(), ks.end(), leaf->keys.begin());
+    std::move(vs.begin(), vs.end(), leaf->vals.begin());
+    leaf->num_keys = ks.size();
+    if (parent == nullptr) return false;
+    if (leaf->num_keys < min_keys && parent->num_keys > 0) merge_or_share(parent, indices.back() > 0 ? indices.back() - 1 : 0);
+    indices.pop_back();
+    return true;
+  }
+
+  /* split the leaf into as many leaves as needed at once */
+  groups = even_groups(ks.size(), max_children - 1);
+  seps.clear();
+  new_nodes.clear();
+  for (g = 0, j = 0; g < groups.size(); j += groups[g], g++) {
+    if (g == 0) {
+      right = leaf;
+    } else {
+      right = new_leaf();
+      seps.push_back(KeySeparator<key_type>::between(leaf->keys[leaf->num_keys - 1], ks[j]));  // ks[j - 1]已经move走了
+      new_nodes.push_back(right);
+      leaf = right;
+    }
+    std::move(ks.begin() + j, ks.begin() + j + groups[g], right->keys.begin());
+    std::move(vs.begin() + j, vs.begin() + j + groups[g], right->vals.begin());
+    right->num_keys = groups[g];
+  }
+  if (parent != nullptr && parent->num_keys + new_nodes.size() <= max_children - 1) {
+    insert_children();  // only into the parent
+    parents.push_back(parent);
+    return true;
+  }
+  insert_children();
+  return false;
+}
+
+/* 把new_nodes插到 parents.back()->nodes[indices.back()] 的右边，seps[i]是new_nodes[i]左边的separator。
+   parent放不下就一次分成几个node，buffer里的message按同样的separator分给它们，再把分出来的node插到上一层
+*/
+void insert_children() {
+  vector <size_t> groups;
+  inner_node *parent, *inner;
+  size_t index, g, start, m, stop, kept = 0;
+
+  while (!new_nodes.empty()) {
+    if (parents.empty()) {
+      parent = new_inner();
+      parent->nodes[0] = root;
+      root = parent;
+      parents.push_back(parent);
+      indices.push_back(0);
+    }
+    parent = parents.back();
+    parents.pop_back();
+    index = indices.back();
+    indices.pop_back();
+
+    ks.assign(std::make_move_iterator(parent->keys.begin()), std::make_move_iterator(parent->keys.begin() + parent->num_keys));
+    cs.assign(parent->nodes.begin(), parent->nodes.begin() + parent->num_keys + 1);
+    ks.insert(ks.begin() + index, std::make_move_iterator(seps.begin()), std::make_move_iterator(seps.end()));
+    cs.insert(cs.begin() + index + 1, new_nodes.begin(), new_nodes.end());
+    seps.clear();
+    new_nodes.clear();
+
+    groups = even_groups(cs.size(), max_children);
+    for (g = 0, start = 0, m = 0; g < groups.size(); start += groups[g], g++) {
+      inner = (g == 0) ? parent : new_inner();
+
+      /* the messages below the separator after this group go with it, the first group keeps its own */
+      stop = (g + 1 == groups.size()) ? parent->num_msgs
+             : m + NodeSearch<key_type>::lower_bound(parent->msg_keys.data() + m, parent->num_msgs - m, ks[start + groups[g] - 1]);
+      if (g > 0) {
+        std::move(parent->msg_keys.begin() + m, parent->msg_keys.begin() + stop, inner->msg_keys.begin());
+        std::move(parent->msg_vals.begin() + m, parent->msg_vals.begin() + stop, inner->msg_vals.begin());
+        std::copy(parent->msg_erase.begin() + m, parent->msg_erase.begin() + stop, inner->msg_erase.begin());
+        inner->num_msgs = stop - m;
+      }
+      if (g == 0 && groups.size() > 1) kept = stop;
+      m = stop;
+
+      std::move(ks.begin() + start, ks.begin() + start + groups[g] - 1, inner->keys.begin());
+      std::copy(cs.begin() + start, cs.begin() + start + groups[g], inner->nodes.begin());
+      inner->num_keys = groups[g] - 1;
+      if (g > 0) {
+        seps.push_back(std::move(ks[start - 1]));
+        new_nodes.push_back(inner);
+      }
+    }
+    if (groups.size() > 1) parent->num_msgs = kept;
+  }
+}
+
+/* p的两个相邻的leaf孩子i和i+1: 放得下就合并到左边，否则两边平分 */
+void merge_or_share(inner_node *p, size_t i) {
+  leaf_node *left = as_leaf(p->nodes[i]), *right = as_leaf(p->nodes[i + 1]);
+  size_t total = left->num_keys + right->num_keys, half = total / 2, n;
+
+  if (total <= max_children - 1) {
+    std::move(right->keys.begin(), right->keys.begin() + right->num_keys, left->keys.begin() + left->num_keys);
+    std::move(right->vals.begin(), right->vals.begin() + right->num_keys, left->vals.begin() + left->num_keys);
+    left->num_keys = total;
+    array_erase(p->keys, p->num_keys, i);
+    array_erase(p->nodes, p->num_keys + 1, i + 1);
+    p->num_keys--;
+    free_node(right);
+    return;
+  }
+
+  if (left->num_keys < half) {
+    n = half - left->num_keys;
+    std::move(right->keys.begin(), right->keys.begin() + n, left->keys.begin() + left->num_keys);
+    std::move(right->vals.begin(), right->vals.begin() + n, left->vals.begin() + left->num_keys);
+    std::move(right->keys.begin() + n, right->keys.begin() + right->num_keys, right->keys.begin());
+    std::move(right->vals.begin() + n, right->vals.begin() + right->num_keys, right->vals.begin());
+  } else {
+    n = left->num_keys - half;
+    std::move_backward(right->keys.begin(), right->keys.begin() + right->num_keys, right->keys.begin() + right->num_keys + n);
+    std::move_backward(right->vals.begin(), right->vals.begin() + right->num_keys, right->vals.begin() + right->num_keys + n);
+    std::move(left->keys.begin() + half, left->keys.begin() + left->num_keys, right->keys.begin());
+    std::move(left->vals.begin() + half, left->vals.begin() + left->num_keys, right->vals.begin());
+  }
+  right->num_keys = total - half;
+  left->num_keys = half;
+  p->keys[i] = KeySeparator<key_type>::between(left->keys[half - 1], right->keys[0]);
+}
+
+/* records (排好序，key不重复) 自底向上建树，每个node都是满的 (最后几个node平分) */
+void build(vector <pair<key_type, val_type> > &records) {
+  vector <size_t> groups;
+  leaf_node *leaf;
+  inner_node *inner;
+  size_t g, i, j;
+
+  num_elements = records.size();
+  num_pending = 0;
+  if (records.empty()) {
+    root = new_leaf();
+    return;
+  }
+
+  cs.clear();
+  seps.clear();
+  groups = even_groups(records.size(), max_children - 1);
+  for (g = 0, j = 0; g < groups.size(); j += groups[g], g++) {
+    leaf = new_leaf();
+    for (i = 0; i < groups[g]; i++) {
+      leaf->keys[i] = std::move(records[j + i].first);
+      leaf->vals[i] = std::move(records[j + i].second);
+    }
+    leaf->num_keys = groups[g];
+    if (g > 0) seps.push_back(KeySeparator<key_type>::between(as_leaf(cs.back())->keys[as_leaf(cs.back())->num_keys - 1], leaf->keys[0]));
+    cs.push_back(leaf);
+  }
+
+  /* seps[i] is the separator between cs[i] and cs[i + 1] */
+  while (cs.size() > 1) {
+    groups = even_groups(cs.size(), max_children);
+    new_nodes.clear();
+    ks.clear();
+    for (g = 0, j = 0; g < groups.size(); j += groups[g], g++) {
+      inner = new_inner();
+      std::copy(cs.begin() + j, cs.begin() + j + groups[g], inner->nodes.begin());
+      std::move(seps.begin() + j, seps.begin() + j + groups[g] - 1, inner->keys.begin());
+      inner->num_keys = groups[g] - 1;
+      if (g > 0) ks.push_back(std::move(seps[j - 1]));
+      new_nodes.push_back(inner);
+    }
+    cs.swap(new_nodes);
+    seps.swap(ks);
+  }
+  root = cs[0];
+}
+
+/* 删除所有的node。allocator可以整块释放的时候只调析构函数 (key和val都是trivially destructible的时候连析构函数都不用调) */
+void destroy_tree() {
+  vector <node_type*> stack;
+  node_type *n;
+  size_t i;
+
+  if (allocator_type::bulk_release && std::is_trivially_destructible<key_type>::value
+      && std::is_trivially_destructible<val_type>::value) {
+    alloc.release_all();
+    return;
+  }
+
+  stack.push_back(root);
+  while (!stack.empty()) {
+    n = stack.back();
+    stack.pop_back();
+    if (!n->is_leaf) {
+      for (i = 0; i <= n->num_keys; i++) stack.push_back(as_inner(n)->nodes[i]);
+      if (allocator_type::bulk_release) as_inner(n)->~inner_node();
+      else free_node(n);
+    } else {
+      if (allocator_type::bulk_release) as_leaf(n)->~leaf_node();
+      else free_node(n);
+    }
+  }
+  if (allocator_type::bulk_release) alloc.release_all();
+}
+
+// 把n个东西平均分成若干组，每组不超过capacity (和Tree::even_groups一样)
+static vector <size_t> even_groups(size_t n, size_t capacity) {
+  vector <size_t> groups;
+  size_t count = (n + capacity - 1) / capacity;
+  size_t i;
+
+  for (i = 0; i < count; i++) groups.push_back(n / count + (i < n % count ? 1 : 0));
+  return groups;
+}
+
+}; // end of BufferedTree class
+
+}; // end of namespace
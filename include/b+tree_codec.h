@@ -0,0 +1,85 @@
+#pragma once
+#include <string>
+#include <array>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+
+
+/**
+
+      B+Tree binary encoding synopsis
+
+  Codec<T>::put(string &out, const T &v)                  - append the bytes of v to out
+  Codec<T>::get(const char *&p, const char *end, T &v)    - read v from [p, end) and move p past it, false if there are not enough bytes
+
+  Trivially copyable types are copied as they are (native byte order).
+  std::string is a 32 bit length followed by the bytes.
+  Other types can specialize Codec.
+
+  uint32_t crc32(const void *data, size_t n, uint32_t crc = 0)  - CRC-32 (IEEE), crc continues an earlier call
+
+*/
+
+namespace BPlusTree {
+
+template <class T, class Enable = void>
+struct Codec
+{
+  static_assert(std::is_trivially_copyable<T>::value, "B+Tree - Codec needs a trivially copyable type or a specialization");
+
+  static void put(std::string &out, const T &v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(T));
+  }
+
+  static bool get(const char *&p, const char *end, T &v) {
+    if ((size_t) (end - p) < sizeof(T)) return false;
+    memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+  }
+};
+
+template <>
+struct Codec<std::string>
+{
+  static void put(std::string &out, const std::string &v) {
+    uint32_t n = v.size();
+    out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+    out.append(v);
+  }
+
+  static bool get(const char *&p, const char *end, std::string &v) {
+    uint32_t n;
+    if ((size_t) (end - p) < sizeof(n)) return false;
+    memcpy(&n, p, sizeof(n));
+    if ((size_t) (end - p) - sizeof(n) < n) return false;
+    v.assign(p + sizeof(n), n);
+    p += sizeof(n) + n;
+    return true;
+  }
+};
+
+
+// 查表的CRC-32，表在第一次用的时候生成
+inline uint32_t crc32(const void *data, size_t n, uint32_t crc = 0) {
+  static const std::array <uint32_t, 256> table = []() {
+    std::array <uint32_t, 256> t;
+    uint32_t c, i, k;
+    for (i = 0; i < 256; i++) {
+      c = i;
+      for (k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : (c >> 1);
+      t[i] = c;
+    }
+    return t;
+  }();
+  const unsigned char *p = static_cast<const unsigned char*>(data);
+  size_t i;
+
+  crc = ~crc;
+  for (i = 0; i < n; i++) crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+}; // end of namespace
@@ -0,0 +1,459 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <algorithm>
+#include "b+tree_search.h"
+#include "b+tree_allocator.h"
+
+
+/**
+
+      Concurrent B-link Tree synopsis (Lehman & Yao, see 参考资料/STANFOR Blink.pdf)
+
+namespace BPlusTree
+{
+
+template <class key_type, class val_type, size_t max_children = 64>
+class ConcurrentTree
+{
+public:
+  ConcurrentTree();
+  ~ConcurrentTree();
+
+  bool insert(const key_type &key, const val_type &val);  // true if the key is new, otherwise the val is overwritten
+  bool find(const key_type &key, val_type &val) const;     // copy the val out, false if the key doesn't exist
+  bool contains(const key_type &key) const;
+  bool erase(const key_type &key);                         // false if the key doesn't exist
+  size_t size() const;
+  bool empty() const;
+};
+
+};
+
+  Every node has a latch, a high key (the upper bound of the keys in its subtree, none for the
+  rightmost node of a level) and a right link to the next node on the same level.
+
+  find: walk down from the root holding one shared latch at a time (no latch coupling).
+        If the key is >= the node's high key, the node was split after we read its parent,
+        so follow the right link.
+  insert: walk down the same way and remember the path, latch the leaf exclusively (moving right if needed).
+        A full node is split into node + new right sibling, both are linked before the latch is released,
+        so the right half is reachable through the right link before the parent knows about it.
+        Then the parent is latched (moving right if needed), the separator is added, and the child is released.
+        At most the child, the parent and the parent's right neighbour are latched at the same time.
+  erase: latch the leaf and remove the key. Nodes are never merged (as in the paper), so a node is never freed
+        while the tree is alive, which is what makes the unlatched moves right safe.
+
+  All functions are thread safe. There are no iterators, values are copied out under the leaf's latch.
+
+*/
+
+namespace BPlusTree {
+
+/* reader-writer spin latch. 最高位是writer，其余是reader的个数 */
+class RWLatch
+{
+public:
+  RWLatch() : state(0) {}
+
+  void lock_shared() {
+    unsigned spins = 0;
+    uint32_t s;
+    while (1) {
+      s = state.load(std::memory_order_relaxed);
+      if (!(s & writer) && state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) return;
+      backoff(spins);
+    }
+  }
+
+  void unlock_shared() { state.fetch_sub(1, std::memory_order_release); }
+
+  void lock() {
+    unsigned spins = 0;
+    uint32_t s;
+    while (1) {
+      s = 0;
+      if (state.compare_exchange_weak(s, writer, std::memory_order_acquire)) return;
+      backoff(spins);
+    }
+  }
+
+  void unlock() { state.store(0, std::memory_order_release); }
+
+private:
+  static const uint32_t writer = 1u << 31;
+  std::atomic <uint32_t> state;
+
+  // 先空转一会，还拿不到就让出CPU
+  static void backoff(unsigned &spins) {
+    if (++spins < 64) {
+#if defined(__SSE2__)
+      _mm_pause();
+#endif
+    } else {
+      std::this_thread::yield();
+    }
+  }
+};
+
+
+template <class key_type, class val_type, size_t max_children>
+class BLinkNode
+{
+public:
+  BLinkNode(bool leaf, size_t l) {
+    num_keys = 0;
+    is_leaf = leaf;
+    level = l;
+    has_high_key = false;
+    right = nullptr;
+  }
+
+  static void *operator new(size_t size) {
+    void *p;
+    if (posix_memalign(&p, cache_line_size, size) != 0) throw std::bad_alloc();
+    return p;
+  }
+  static void operator delete(void *p) { free(p); }
+
+  RWLatch latch;
+  size_t num_keys;
+  bool is_leaf;
+  size_t level;        // leaf是0
+  bool has_high_key;   // 每一层最右边的node没有high key
+  key_type high_key;   // 这颗子树里所有的key都 < high_key
+  BLinkNode *right;    // 同一层右边的node
+
+  alignas(cache_line_size) std::array <key_type, max_children> keys;
+
+  // key >= high_key 说明node已经分裂了，要往右走
+  bool beyond(const key_type &key) const { return has_high_key && !(key < high_key); }
+};
+
+template <class key_type, class val_type, size_t max_children>
+class BLinkInner : public BLinkNode<key_type, val_type, max_children>
+{
+public:
+  BLinkInner(size_t level) : BLinkNode<key_type, val_type, max_children>(false, level) {}
+  alignas(cache_line_size) std::array <BLinkNode<key_type, val_type, max_children>*, max_children + 1> nodes;
+};
+
+template <class key_type, class val_type, size_t max_children>
+class BLinkLeaf : public BLinkNode<key_type, val_type, max_children>
+{
+public:
+  BLinkLeaf() : BLinkNode<key_type, val_type, max_children>(true, 0) {}
+  alignas(cache_line_size) std::array <val_type, max_children> vals;
+};
+
+
+template <class key_type, class val_type, size_t max_children = 64>
+class ConcurrentTree
+{
+
+  static_assert(max_children >= 3, "B+Tree - max_children must be >= 3");
+
+  typedef BLinkNode<key_type, val_type, max_children> node_type;
+  typedef BLinkInner<key_type, val_type, max_children> inner_node;
+  typedef BLinkLeaf<key_type, val_type, max_children> leaf_node;
+
+public:
+
+ConcurrentTree() {
+  root.store(new leaf_node);
+  num_elements.store(0);
+}
+
+~ConcurrentTree() {
+  node_type *level_start = root.load(), *n, *next;
+
+  /* every level is a linked list, free them from the top */
+  while (level_start != nullptr) {
+    n = level_start;
+    level_start = n->is_leaf ? nullptr : as_inner(n)->nodes[0];
+    while (n != nullptr) {
+      next = n->right;
+      free_node(n);
+      n = next;
+    }
+  }
+}
+
+ConcurrentTree(const ConcurrentTree &) = delete;
+ConcurrentTree &operator=(const ConcurrentTree &) = delete;
+
+bool insert(const key_type &key, const val_type &val) {
+  std::vector <node_type*> path;   // 从root下来经过的inner node
+  node_type *n, *right;
+  leaf_node *leaf;
+  key_type separator;
+  size_t i;
+
+  n = descend(key, 0, &path);
+  n->latch.lock();
+  n = move_right_locked(n, key);
+  leaf = as_leaf(n);
+
+  i = child_index(leaf, key);
+  if (i > 0 && leaf->keys[i - 1] == key) {
+    leaf->vals[i - 1] = val;
+    leaf->latch.unlock();
+    return false;
+  }
+  num_elements.fetch_add(1, std::memory_order_relaxed);
+
+  if (leaf->num_keys < max_children - 1) {
+    insert_at(leaf->keys, leaf->num_keys, i, key);
+    insert_at(leaf->vals, leaf->num_keys, i, val);
+    leaf->num_keys++;
+    leaf->latch.unlock();
+    return true;
+  }
+
+  /* the leaf is full: split it, then add the separator to the parent level by level */
+  right = split_leaf(leaf, i, key, val, separator);
+  while (1) {
+    n = insert_into_parent(n, separator, right, path);
+    if (n == nullptr) return true;
+    /* the parent is full too, n is now the latched parent with its key and child already inserted */
+    right = split_inner(as_inner(n), separator);
+  }
+}
+
+bool find(const key_type &key, val_type &val) const {
+  node_type *n = descend(key, 0, nullptr);
+  leaf_node *leaf;
+  size_t i;
+
+  n->latch.lock_shared();
+  n = move_right_shared(n, key);
+  leaf = as_leaf(n);
+  i = child_index(leaf, key);
+  if (i > 0 && leaf->keys[i - 1] == key) {
+    val = leaf->vals[i - 1];
+    leaf->latch.unlock_shared();
+    return true;
+  }
+  leaf->latch.unlock_shared();
+  return false;
+}
+
+bool contains(const key_type &key) const {
+  node_type *n = descend(key, 0, nullptr);
+  size_t i;
+  bool found;
+
+  n->latch.lock_shared();
+  n = move_right_shared(n, key);
+  i = child_index(n, key);
+  found = (i > 0 && n->keys[i - 1] == key);
+  n->latch.unlock_shared();
+  return found;
+}
+
+bool erase(const key_type &key) {
+  node_type *n = descend(key, 0, nullptr);
+  leaf_node *leaf;
+  size_t i;
+
+  n->latch.lock();
+  n = move_right_locked(n, key);
+  leaf = as_leaf(n);
+  i = child_index(leaf, key);
+  if (i == 0 || !(leaf->keys[i - 1] == key)) {
+    leaf->latch.unlock();
+    return false;
+  }
+  erase_at(leaf->keys, leaf->num_keys, i - 1);
+  erase_at(leaf->vals, leaf->num_keys, i - 1);
+  leaf->num_keys--;
+  leaf->latch.unlock();
+  num_elements.fetch_sub(1, std::memory_order_relaxed);
+  return true;
+}
+
+size_t size() const { return num_elements.load(std::memory_order_relaxed); }
+bool empty() const { return size() == 0; }
+
+
+private:
+  std::atomic <node_type*> root;
+  std::atomic <size_t> num_elements;
+  std::mutex root_mutex;  // 只在root分裂的时候用
+
+static inner_node *as_inner(node_type *n) { return static_cast<inner_node*>(n); }
+static leaf_node *as_leaf(node_type *n) { return static_cast<leaf_node*>(n); }
+
+static void free_node(node_type *n) {
+  if (n->is_leaf) delete as_leaf(n);
+  else delete as_inner(n);
+}
+
+static size_t child_index(const node_type *n, const key_type &key) {
+  return NodeSearch<key_type>::upper_bound(n->keys.data(), n->num_keys, key);
+}
+
+template <class T, size_t N>
+static void insert_at(std::array <T, N> &a, size_t n, size_t pos, const T &v) {
+  std::move_backward(a.begin() + pos, a.begin() + n, a.begin() + n + 1);
+  a[pos] = v;
+}
+
+template <class T, size_t N>
+static void erase_at(std::array <T, N> &a, size_t n, size_t pos) {
+  std::move(a.begin() + pos + 1, a.begin() + n, a.begin() + pos);
+}
+
+/* 从root走到level这一层应该放key的node (返回的时候没有latch)。
+   每次只拿一个node的shared latch，读出下一步要去的node就放掉。path不是nullptr的时候记录经过的inner node
+*/
+node_type *descend(const key_type &key, size_t level, std::vector <node_type*> *path) const {
+  node_type *n = root.load(std::memory_order_acquire);
+  node_type *next;
+
+  while (1) {
+    n->latch.lock_shared();
+    if (n->beyond(key)) {
+      next = n->right;
+    } else if (n->level == level) {
+      n->latch.unlock_shared();
+      return n;
+    } else {
+      if (path != nullptr) path->push_back(n);
+      next = as_inner(n)->nodes[child_index(n, key)];
+    }
+    n->latch.unlock_shared();
+    n = next;
+  }
+}
+
+// n已经有shared latch了，一直往右走到key应该在的node，返回的node有shared latch
+static node_type *move_right_shared(node_type *n, const key_type &key) {
+  node_type *next;
+  while (n->beyond(key)) {
+    next = n->right;
+    n->latch.unlock_shared();
+    next->latch.lock_shared();
+    n = next;
+  }
+  return n;
+}
+
+// 同上，用的是exclusive latch
+static node_type *move_right_locked(node_type *n, const key_type &key) {
+  node_type *next;
+  while (n->beyond(key)) {
+    next = n->right;
+    n->latch.unlock();
+    next->latch.lock();
+    n = next;
+  }
+  return n;
+}
+
+/* leaf满了: 把 (key, val) 放在i的位置，然后一半移到新的right leaf。
+   right先连到leaf的右边，high key也设好，这样还没插到parent之前就能通过right link找到。
+   返回的时候leaf还有latch
+*/
+node_type *split_leaf(leaf_node *leaf, size_t i, const key_type &key, const val_type &val, key_type &separator) {
+  leaf_node *right = new leaf_node;
+  std::array <key_type, max_children> ks;
+  std::array <val_type, max_children> vs;
+  size_t total = leaf->num_keys + 1, half = total / 2;
+
+  std::move(leaf->keys.begin(), leaf->keys.begin() + leaf->num_keys, ks.begin());
+  std::move(leaf->vals.begin(), leaf->vals.begin() + leaf->num_keys, vs.begin());
+  insert_at(ks, leaf->num_keys, i, key);
+  insert_at(vs, leaf->num_keys, i, val);
+
+  std::move(ks.begin(), ks.begin() + half, leaf->keys.begin());
+  std::move(vs.begin(), vs.begin() + half, leaf->vals.begin());
+  std::move(ks.begin() + half, ks.begin() + total, right->keys.begin());
+  std::move(vs.begin() + half, vs.begin() + total, right->vals.begin());
+  leaf->num_keys = half;
+  right->num_keys = total - half;
+
+  separator = right->keys[0];
+  right->has_high_key = leaf->has_high_key;
+  right->high_key = leaf->high_key;
+  right->right = leaf->right;
+  leaf->has_high_key = true;
+  leaf->high_key = separator;
+  leaf->right = right;
+  return right;
+}
+
+/* inner node满了(已经放了max_children个key): 中间的key移到上一层，右半边移到新的right node。
+   返回的时候n还有latch
+*/
+node_type *split_inner(inner_node *n, key_type &separator) {
+  inner_node *right = new inner_node(n->level);
+  size_t half = n->num_keys / 2;
+
+  separator = n->keys[half];
+  std::move(n->keys.begin() + half + 1, n->keys.begin() + n->num_keys, right->keys.begin());
+  std::copy(n->nodes.begin() + half + 1, n->nodes.begin() + n->num_keys + 1, right->nodes.begin());
+  right->num_keys = n->num_keys - half - 1;
+  n->num_keys = half;
+
+  right->has_high_key = n->has_high_key;
+  right->high_key = n->high_key;
+  right->right = n->right;
+  n->has_high_key = true;
+  n->high_key = separator;
+  n->right = right;
+  return right;
+}
+
+/* child刚分裂成child和right (child还有latch)，把 (separator, right) 插到parent里。
+   parent放得下的话放掉所有latch，返回nullptr。
+   parent放不下的时候先多放一个(keys的容量是max_children)，返回还有latch的parent，由调用的人去分裂它。
+*/
+node_type *insert_into_parent(node_type *child, const key_type &separator, node_type *right, std::vector <node_type*> &path) {
+  node_type *parent;
+  inner_node *new_root;
+  size_t i;
+
+  if (path.empty()) {
+    std::lock_guard <std::mutex> guard(root_mutex);
+    /* child is still the root: grow the tree */
+    if (root.load() == child) {
+      new_root = new inner_node(child->level + 1);
+      new_root->keys[0] = separator;
+      new_root->nodes[0] = child;
+      new_root->nodes[1] = right;
+      new_root->num_keys = 1;
+      root.store(new_root, std::memory_order_release);
+      child->latch.unlock();
+      return nullptr;
+    }
+    /* somebody else grew the tree: find the parent from the new root */
+    parent = descend(separator, child->level + 1, nullptr);
+  } else {
+    parent = path.back();
+    path.pop_back();
+  }
+
+  parent->latch.lock();
+  parent = move_right_locked(parent, separator);
+  child->latch.unlock();
+
+  i = child_index(parent, separator);
+  insert_at(parent->keys, parent->num_keys, i, separator);
+  insert_at(as_inner(parent)->nodes, parent->num_keys + 1, i + 1, right);
+  parent->num_keys++;
+
+  if (parent->num_keys < max_children) {
+    parent->latch.unlock();
+    return nullptr;
+  }
+  return parent;
+}
+
+}; // end of ConcurrentTree class
+
+}; // end of namespace
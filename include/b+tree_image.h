@@ -0,0 +1,484 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "b+tree_search.h"
+#include "b+tree_codec.h"
+
+
+/**
+
+      B+Tree image synopsis
+
+  An image is a sorted, read-only copy of a tree in one file, made by Tree::save:
+
+    header page (4KB)    magic, version, key/val sizes, count, offsets, crc32 of the header and of the rest
+    leaf blocks          block b holds the records [b * B, (b + 1) * B): B keys, then B vals (about 4KB per block)
+    index levels         level 0 is the first key of every block, level l + 1 is every F-th key of level l,
+                         up to a level with at most F keys (F keys are about 4KB)
+
+  Keys and values are stored as they are, so both must be trivially copyable.
+
+  template <class key_type, class val_type>
+  class ImageWriter
+  {
+  public:
+    ImageWriter(const string &path);          // writes path.tmp, finish() renames it to path
+    void add(const key_type &key, const val_type &val);   // keys must be increasing
+    void finish();
+  };
+
+  template <class key_type, class val_type>
+  class MappedTree                            // returned by Tree::open_readonly
+  {
+  public:
+    class iterator;                           // get_key, get_val, advance, ++, --, ==, != (a position in the image)
+    class record_iterator;                    // input iterator over pair<key, val>, for Tree::bulk_load
+
+    MappedTree(const string &path, bool verify = false);   // mmap the image. verify: check the crc32 of the whole file
+    iterator find(const key_type &key) const;
+    iterator lower_bound(const key_type &key) const;
+    iterator upper_bound(const key_type &key) const;
+    bool contains(const key_type &key) const;
+    iterator begin() const;
+    iterator end() const;
+    size_t size() const;
+    bool empty() const;
+    bool verify() const;                      // crc32 of everything after the header
+    record_iterator records_begin() const;
+    record_iterator records_end() const;
+  };
+
+*/
+
+namespace BPlusTree {
+
+static const size_t image_page = 4096;
+static const uint32_t image_max_levels = 16;
+
+struct ImageHeader
+{
+  uint64_t magic;
+  uint32_t version;
+  uint32_t header_crc;     // crc32 of the header with header_crc = 0
+  uint32_t key_size;
+  uint32_t val_size;
+  uint32_t block_records;  // B
+  uint32_t index_fanout;   // F
+  uint64_t count;
+  uint64_t num_blocks;
+  uint64_t file_size;
+  uint32_t data_crc;       // crc32 of the file after the header page
+  uint32_t num_levels;
+  uint64_t level_offset[image_max_levels];
+  uint64_t level_size[image_max_levels];
+};
+
+template <class key_type, class val_type>
+struct ImageLayout
+{
+  static_assert(std::is_trivially_copyable<key_type>::value && std::is_trivially_copyable<val_type>::value,
+                "B+Tree - images store keys and values as they are, they must be trivially copyable");
+
+  static const uint64_t magic = 0x6567616d49545042ULL;  // "BPTImage"
+  static const uint32_t version = 1;
+
+  // 16的倍数，这样block里vals的开头也是对齐的
+  static const size_t block_records = (image_page / (sizeof(key_type) + sizeof(val_type)) / 16 > 0)
+                                      ? image_page / (sizeof(key_type) + sizeof(val_type)) / 16 * 16 : 16;
+  static const size_t block_bytes = block_records * (sizeof(key_type) + sizeof(val_type));
+  static const size_t index_fanout = (image_page / sizeof(key_type) / 16 > 0) ? image_page / sizeof(key_type) / 16 * 16 : 16;
+};
+
+
+template <class key_type, class val_type>
+class ImageWriter
+{
+  typedef ImageLayout<key_type, val_type> layout;
+
+public:
+
+ImageWriter(const std::string &path) : path(path), tmp(path + ".tmp"), count(0), offset(image_page), data_crc(0) {
+  fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw std::runtime_error("B+Tree: cannot open " + tmp + ": " + strerror(errno));
+  block.assign(layout::block_bytes, 0);
+}
+
+~ImageWriter() {
+  if (fd >= 0) {  // finish() was not called (an exception)
+    ::close(fd);
+    unlink(tmp.c_str());
+  }
+}
+
+ImageWriter(const ImageWriter &) = delete;
+ImageWriter &operator=(const ImageWriter &) = delete;
+
+void add(const key_type &key, const val_type &val) {
+  size_t i = count % layout::block_records;
+
+  if (i == 0) fences.push_back(key);
+  memcpy(&block[i * sizeof(key_type)], &key, sizeof(key_type));
+  memcpy(&block[layout::block_records * sizeof(key_type) + i * sizeof(val_type)], &val, sizeof(val_type));
+  count++;
+  if (count % layout::block_records == 0) flush_block();
+}
+
+void finish() {
+  std::vector <std::vector <key_type> > levels;
+  ImageHeader h;
+  size_t l, i;
+
+  if (count % layout::block_records != 0) flush_block();  // the last block is padded with zeros
+
+  memset(&h, 0, sizeof(h));
+  h.magic = layout::magic;
+  h.version = layout::version;
+  h.key_size = sizeof(key_type);
+  h.val_size = sizeof(val_type);
+  h.block_records = layout::block_records;
+  h.index_fanout = layout::index_fanout;
+  h.count = count;
+  h.num_blocks = fences.size();
+
+  /* the index: level 0 are the fences of the blocks, every level above keeps every F-th key */
+  if (!fences.empty()) levels.push_back(fences);
+  while (!levels.empty() && levels.back().size() > layout::index_fanout) {
+    std::vector <key_type> up;
+    for (i = 0; i < levels.back().size(); i += layout::index_fanout) up.push_back(levels.back()[i]);
+    levels.push_back(up);
+  }
+  if (levels.size() > image_max_levels) throw std::runtime_error("B+Tree: too many records for an image");
+
+  h.num_levels = levels.size();
+  for (l = 0; l < levels.size(); l++) {
+    pad(64);
+    h.level_offset[l] = offset;
+    h.level_size[l] = levels[l].size();
+    write_data(levels[l].data(), levels[l].size() * sizeof(key_type));
+  }
+  pad(image_page);
+  h.file_size = offset;
+  h.data_crc = data_crc;
+  h.header_crc = crc32(&h, sizeof(h));
+
+  std::vector <char> page(image_page, 0);
+  memcpy(page.data(), &h, sizeof(h));
+  if (pwrite(fd, page.data(), image_page, 0) != (ssize_t) image_page || fsync(fd) != 0) {
+    throw std::runtime_error("B+Tree: cannot write " + tmp + ": " + strerror(errno));
+  }
+  ::close(fd);
+  fd = -1;
+  if (rename(tmp.c_str(), path.c_str()) != 0) throw std::runtime_error("B+Tree: cannot rename " + tmp + ": " + strerror(errno));
+}
+
+private:
+  std::string path, tmp;
+  int fd;
+  uint64_t count;
+  uint64_t offset;      // 下一个写的位置
+  uint32_t data_crc;
+  std::vector <char> block;
+  std::vector <key_type> fences;  // 每个block的第一个key
+
+void write_data(const void *p, size_t n) {
+  if (n == 0) return;
+  if (pwrite(fd, p, n, offset) != (ssize_t) n) throw std::runtime_error("B+Tree: cannot write " + tmp + ": " + strerror(errno));
+  data_crc = crc32(p, n, data_crc);
+  offset += n;
+}
+
+void pad(size_t align) {
+  std::vector <char> zeros((align - offset % align) % align, 0);
+  write_data(zeros.data(), zeros.size());
+}
+
+void flush_block() {
+  write_data(block.data(), block.size());
+  std::fill(block.begin(), block.end(), 0);
+}
+
+};
+
+
+template <class key_type, class val_type>
+class MappedTree
+{
+  typedef ImageLayout<key_type, val_type> layout;
+
+public:
+
+  class iterator
+  {
+  public:
+
+    key_type get_key() const {
+      if (pos >= tree->num_elements) throw std::out_of_range("B+Tree: iterator is out of range");
+      return tree->key_at(pos);
+    }
+
+    val_type get_val() const {
+      if (pos >= tree->num_elements) throw std::out_of_range("B+Tree: iterator is out of range");
+      return tree->val_at(pos);
+    }
+
+    // 记录是连续编号的，所以advance是O(1)
+    void advance(int distance) {
+      if ((distance < 0 && (size_t) -distance > pos) || (distance > 0 && pos + distance > tree->num_elements)) {
+        throw std::out_of_range("B+Tree: iterator is out of range");
+      }
+      pos += distance;
+    }
+
+    iterator operator--(int) {
+      iterator it = *this;
+      --(*this);
+      return it;
+    }
+
+    const iterator& operator--() {
+      if (pos == 0) throw std::out_of_range("B+Tree: iterator is out of range");
+      pos--;
+      return *this;
+    }
+
+    iterator operator++(int) {
+      iterator it = *this;
+      ++(*this);
+      return it;
+    }
+
+    const iterator& operator++() {
+      if (pos >= tree->num_elements) throw std::out_of_range("B+Tree: iterator is out of range");
+      pos++;
+      return *this;
+    }
+
+    bool operator!=(const iterator &it) const {
+      return !(*this == it);
+    }
+
+    bool operator==(const iterator &it) const {
+      return pos == it.pos;
+    }
+
+  private:
+    friend class MappedTree;
+    const MappedTree *tree;
+    size_t pos;  // num_elements是end()
+  };
+
+  /* Tree::bulk_load要的 (it->first, it->second) */
+  class record_iterator
+  {
+  public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef std::pair <key_type, val_type> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const value_type *pointer;
+    typedef const value_type &reference;
+
+    reference operator*() { load(); return cur; }
+    pointer operator->() { load(); return &cur; }
+    record_iterator &operator++() { pos++; return *this; }
+    bool operator==(const record_iterator &it) const { return pos == it.pos; }
+    bool operator!=(const record_iterator &it) const { return pos != it.pos; }
+
+  private:
+    friend class MappedTree;
+    const MappedTree *tree;
+    size_t pos;
+    value_type cur;
+
+    void load() {
+      cur.first = tree->key_at(pos);
+      cur.second = tree->val_at(pos);
+    }
+  };
+
+
+MappedTree(const std::string &path, bool verify_all = false) : path(path), base(nullptr), length(0) {
+  struct stat st;
+  ImageHeader h;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  uint32_t crc;
+  size_t l;
+
+  if (fd < 0) throw std::runtime_error("B+Tree: cannot open " + path + ": " + strerror(errno));
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < image_page) {
+    ::close(fd);
+    throw std::runtime_error("B+Tree: " + path + " is not a B+Tree image");
+  }
+  length = st.st_size;
+  base = (const char *) mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    base = nullptr;
+    throw std::runtime_error("B+Tree: cannot mmap " + path + ": " + strerror(errno));
+  }
+
+  memcpy(&h, base, sizeof(h));
+  crc = h.header_crc;
+  h.header_crc = 0;
+  if (h.magic != layout::magic || h.version != layout::version || crc32(&h, sizeof(h)) != crc) {
+    unmap();
+    throw std::runtime_error("B+Tree: " + path + " is not a B+Tree image");
+  }
+  if (h.key_size != sizeof(key_type) || h.val_size != sizeof(val_type) || h.block_records != layout::block_records
+      || h.index_fanout != layout::index_fanout || h.file_size != length || h.num_levels > image_max_levels) {
+    unmap();
+    throw std::runtime_error("B+Tree: " + path + " was saved with different key/val types or is truncated");
+  }
+
+  header = h;
+  num_elements = h.count;
+  blocks = base + image_page;
+  for (l = 0; l < h.num_levels; l++) levels[l] = reinterpret_cast<const key_type*>(base + h.level_offset[l]);
+
+  if (verify_all && !verify()) {
+    unmap();
+    throw std::runtime_error("B+Tree: " + path + " has a bad checksum");
+  }
+}
+
+~MappedTree() {
+  unmap();
+}
+
+MappedTree(MappedTree &&t) : path(std::move(t.path)), base(t.base), length(t.length), header(t.header),
+                             num_elements(t.num_elements), blocks(t.blocks) {
+  std::copy(t.levels, t.levels + image_max_levels, levels);
+  t.base = nullptr;
+}
+
+MappedTree(const MappedTree &) = delete;
+MappedTree &operator=(const MappedTree &) = delete;
+
+iterator find(const key_type &key) const {
+  size_t p = position(key, false);
+  if (p > 0 && key_at(p - 1) == key) return make_iterator(p - 1);
+  return end();
+}
+
+bool contains(const key_type &key) const {
+  return find(key) != end();
+}
+
+iterator lower_bound(const key_type &key) const {
+  return make_iterator(position(key, true));
+}
+
+iterator upper_bound(const key_type &key) const {
+  return make_iterator(position(key, false));
+}
+
+iterator begin() const {
+  return make_iterator(0);
+}
+
+iterator end() const {
+  return make_iterator(num_elements);
+}
+
+size_t size() const {
+  return num_elements;
+}
+
+bool empty() const {
+  return num_elements == 0;
+}
+
+bool verify() const {
+  return crc32(base + image_page, length - image_page) == header.data_crc;
+}
+
+record_iterator records_begin() const {
+  record_iterator it;
+  it.tree = this;
+  it.pos = 0;
+  return it;
+}
+
+record_iterator records_end() const {
+  record_iterator it;
+  it.tree = this;
+  it.pos = num_elements;
+  return it;
+}
+
+
+
+private:
+  std::string path;
+  const char *base;       // mmap的开头
+  size_t length;
+  ImageHeader header;
+  size_t num_elements;
+  const char *blocks;
+  const key_type *levels[image_max_levels];
+
+void unmap() {
+  if (base != nullptr) munmap((void *) base, length);
+  base = nullptr;
+}
+
+const key_type *block_keys(size_t b) const {
+  return reinterpret_cast<const key_type*>(blocks + b * layout::block_bytes);
+}
+
+const val_type *block_vals(size_t b) const {
+  return reinterpret_cast<const val_type*>(blocks + b * layout::block_bytes + layout::block_records * sizeof(key_type));
+}
+
+key_type key_at(size_t pos) const {
+  return block_keys(pos / layout::block_records)[pos % layout::block_records];
+}
+
+val_type val_at(size_t pos) const {
+  return block_vals(pos / layout::block_records)[pos % layout::block_records];
+}
+
+iterator make_iterator(size_t pos) const {
+  iterator it;
+  it.tree = this;
+  it.pos = pos;
+  return it;
+}
+
+/* strict: 第一个 >= key 的位置，否则第一个 > key 的位置。
+   从最上面一层往下，每层在上一层选中的那F个key里找最后一个 (strict时 <，否则 <=) key的fence */
+size_t position(const key_type &key, bool strict) const {
+  size_t l, pos = 0, start, len, i, b, n;
+
+  if (num_elements == 0) return 0;
+  for (l = header.num_levels; l-- > 0; ) {
+    start = pos * layout::index_fanout;
+    len = (l + 1 == header.num_levels) ? header.level_size[l] : std::min((size_t) layout::index_fanout, (size_t) header.level_size[l] - start);
+    if (l + 1 == header.num_levels) start = 0;
+    i = strict ? NodeSearch<key_type>::lower_bound(levels[l] + start, len, key)
+               : NodeSearch<key_type>::upper_bound(levels[l] + start, len, key);
+    pos = start + (i == 0 ? 0 : i - 1);
+  }
+
+  b = pos;
+  n = std::min((size_t) layout::block_records, num_elements - b * layout::block_records);
+  i = strict ? NodeSearch<key_type>::lower_bound(block_keys(b), n, key)
+             : NodeSearch<key_type>::upper_bound(block_keys(b), n, key);
+  return b * layout::block_records + i;
+}
+
+};
+
+}; // end of namespace
@@ -0,0 +1,873 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "b+tree_search.h"
+
+
+/**
+
+      Paged B+Tree synopsis
+
+  typedef uint32_t page_id;     // page 0 is the file header, so 0 also means "no page"
+
+  struct BufferPoolStats { hits, misses, reads, writes, evictions };
+
+  class BufferPool
+  {
+  public:
+    BufferPool(const string &path, size_t page_size, size_t num_frames);  // open or create the file
+    ~BufferPool();                          // write back the dirty pages (errors are ignored here, call flush())
+    char *pin(page_id pid);                 // read the page in if needed, it is not evicted until unpin
+    void unpin(page_id pid, bool dirty);
+    char *allocate(page_id &pid);           // a zeroed, pinned page from the free list or the end of the file
+    void release(page_id pid);              // put a page on the free list
+    void flush();                           // write back every dirty page, then fdatasync
+    void reset();                           // drop every page and truncate the file
+    size_t file_pages() const;              // pages in the file when it was opened
+    const BufferPoolStats &stats() const;
+  };
+
+  class PageGuard;                          // pins a page in its constructor and unpins it in its destructor
+
+  template <class key_type, class val_type, size_t page_size = 4096>
+  class PagedTree
+  {
+  public:
+    static const size_t max_degree;         // as many children as fit in one page
+    class iterator;                         // get_key, get_val, set_val, ++, --, ==, != (pins the page on every access)
+
+    PagedTree(const string &path, size_t pool_pages = 1024);   // open the tree in path, or create an empty one
+    ~PagedTree();                                                // flush()
+
+    void insert(const key_type &key, const val_type &val);
+    void erase(const key_type &key);
+    iterator find(const key_type &key);
+    bool contains(const key_type &key);
+    iterator lower_bound(const key_type &key);
+    iterator upper_bound(const key_type &key);
+    iterator begin();
+    iterator end();
+    size_t size() const;
+    bool empty() const;
+    void clear();
+    void flush();                           // write back the dirty pages and the file header
+    const BufferPoolStats &pool_stats() const;
+  };
+
+  key_type and val_type are stored in the pages as they are, so they must be trivially copyable.
+  A file can only be opened again with the same key/val sizes and page_size.
+
+*/
+
+namespace BPlusTree {
+
+typedef uint32_t page_id;
+
+struct BufferPoolStats
+{
+  size_t hits;       // pin() found the page in memory
+  size_t misses;
+  size_t reads;      // pages read from the file
+  size_t writes;     // pages written to the file
+  size_t evictions;
+};
+
+
+/* 固定大小的page，file里第pid个page在offset pid * page_size。
+   num_frames个frame用clock算法替换: 被pin住的frame不会被换出，
+   最近用过的frame (ref) 会多留一圈，dirty的frame换出去之前先写回文件。
+*/
+class BufferPool
+{
+public:
+
+  static const size_t min_frames = 8;  // insert/erase最多同时pin住4个page，留一些余量
+
+  BufferPool(const std::string &path, size_t page_size, size_t num_frames)
+    : page_size(page_size), frames(num_frames), hand(0), num_pages(1), free_head(0), mem(nullptr) {
+    struct stat st;
+
+    if (num_frames < min_frames) throw std::invalid_argument("B+Tree: the buffer pool needs at least 8 pages");
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) throw std::runtime_error("B+Tree: cannot open " + path + ": " + strerror(errno));
+    if (fstat(fd, &st) != 0 || posix_memalign(&mem, 4096, page_size * num_frames) != 0) {
+      ::close(fd);
+      throw std::runtime_error("B+Tree: cannot set up the buffer pool for " + path);
+    }
+    opened_pages = st.st_size / page_size;
+    table.reserve(num_frames * 2);
+    memset(&counters, 0, sizeof(counters));
+  }
+
+  ~BufferPool() {
+    size_t i;
+    for (i = 0; i < frames.size(); i++) {
+      if (frames[i].used && frames[i].dirty) {
+        if (pwrite(fd, data(i), page_size, (off_t) frames[i].pid * page_size) != (ssize_t) page_size) break;
+      }
+    }
+    free(mem);
+    ::close(fd);
+  }
+
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  char *pin(page_id pid) {
+    return data(frame_of(pid, false));
+  }
+
+  void unpin(page_id pid, bool dirty) {
+    Frame &f = frames[table.find(pid)->second];
+    f.pins--;
+    f.dirty = f.dirty || dirty;
+  }
+
+  char *allocate(page_id &pid) {
+    char *p;
+    size_t i;
+
+    if (free_head != 0) {
+      pid = free_head;
+      p = pin(pid);
+      memcpy(&free_head, p, sizeof(page_id));
+      memset(p, 0, page_size);
+      i = table.find(pid)->second;
+    } else {
+      pid = num_pages++;
+      i = frame_of(pid, true);
+      p = data(i);
+    }
+    frames[i].dirty = true;
+    return p;
+  }
+
+  // 空闲的page串成一个链表，page开头存下一个空闲page
+  void release(page_id pid) {
+    char *p = pin(pid);
+    memset(p, 0, page_size);
+    memcpy(p, &free_head, sizeof(page_id));
+    unpin(pid, true);
+    free_head = pid;
+  }
+
+  void flush() {
+    size_t i;
+    for (i = 0; i < frames.size(); i++) {
+      if (frames[i].used && frames[i].dirty) write_back(i);
+    }
+    if (fdatasync(fd) != 0) throw std::runtime_error(std::string("B+Tree: fdatasync failed: ") + strerror(errno));
+  }
+
+  void reset() {
+    size_t i;
+    for (i = 0; i < frames.size(); i++) {
+      if (frames[i].pins != 0) throw std::logic_error("B+Tree: reset() with pinned pages");
+      frames[i] = Frame();
+    }
+    table.clear();
+    num_pages = 1;
+    free_head = 0;
+    if (ftruncate(fd, 0) != 0) throw std::runtime_error(std::string("B+Tree: ftruncate failed: ") + strerror(errno));
+  }
+
+  // tree把这两个值存在file header里，open的时候再还给pool
+  page_id pages() const { return num_pages; }
+  page_id free_list() const { return free_head; }
+  void restore(page_id pages, page_id free_list) {
+    num_pages = pages;
+    free_head = free_list;
+  }
+
+  size_t file_pages() const { return opened_pages; }
+  const BufferPoolStats &stats() const { return counters; }
+
+private:
+
+  struct Frame
+  {
+    page_id pid = 0;
+    uint32_t pins = 0;
+    bool used = false;
+    bool dirty = false;
+    bool ref = false;
+  };
+
+  size_t page_size;
+  std::vector <Frame> frames;
+  std::unordered_map <page_id, size_t> table;  // pid -> frame
+  size_t hand;                                  // clock hand
+  page_id num_pages;                            // 下一个新page，file的末尾
+  page_id free_head;                            // 空闲page链表，0是空
+  size_t opened_pages;
+  int fd;
+  void *mem;                                    // num_frames个page，4096对齐
+  BufferPoolStats counters;
+
+  char *data(size_t i) const { return (char *) mem + i * page_size; }
+
+  // fresh: 新分配的page，不用读文件
+  size_t frame_of(page_id pid, bool fresh) {
+    std::unordered_map <page_id, size_t>::iterator it = table.find(pid);
+    size_t i;
+    ssize_t n;
+
+    if (it != table.end()) {
+      counters.hits++;
+      frames[it->second].pins++;
+      frames[it->second].ref = true;
+      return it->second;
+    }
+
+    counters.misses++;
+    i = victim();
+    if (frames[i].used) {
+      if (frames[i].dirty) write_back(i);
+      table.erase(frames[i].pid);
+      counters.evictions++;
+    }
+
+    if (fresh) {
+      memset(data(i), 0, page_size);
+    } else {
+      n = pread(fd, data(i), page_size, (off_t) pid * page_size);
+      if (n < 0) throw std::runtime_error(std::string("B+Tree: read failed: ") + strerror(errno));
+      if ((size_t) n < page_size) memset(data(i) + n, 0, page_size - n);  // past the end of the file
+      counters.reads++;
+    }
+
+    frames[i].pid = pid;
+    frames[i].pins = 1;
+    frames[i].used = true;
+    frames[i].dirty = false;
+    frames[i].ref = true;
+    table[pid] = i;
+    return i;
+  }
+
+  // clock: 跳过被pin住的frame，ref的frame清掉ref再给一次机会。转两圈还找不到就是全被pin住了
+  size_t victim() {
+    size_t n, i;
+    for (n = 0; n < 2 * frames.size(); n++) {
+      i = hand;
+      hand = (hand + 1) % frames.size();
+      if (!frames[i].used) return i;
+      if (frames[i].pins != 0) continue;
+      if (frames[i].ref) {
+        frames[i].ref = false;
+        continue;
+      }
+      return i;
+    }
+    throw std::runtime_error("B+Tree: every page in the buffer pool is pinned");
+  }
+
+  void write_back(size_t i) {
+    if (pwrite(fd, data(i), page_size, (off_t) frames[i].pid * page_size) != (ssize_t) page_size) {
+      throw std::runtime_error(std::string("B+Tree: write failed: ") + strerror(errno));
+    }
+    frames[i].dirty = false;
+    counters.writes++;
+  }
+};
+
+
+/* pin一个page，出了作用域自动unpin。改了page要调用touch() */
+class PageGuard
+{
+public:
+  PageGuard(BufferPool &pool, page_id pid) : pool(&pool), pid(pid), page(pool.pin(pid)), dirty(false) {}
+
+  // 新page (pool.allocate)，已经是dirty的
+  PageGuard(BufferPool &pool) : pool(&pool), dirty(true) {
+    page = pool.allocate(pid);
+  }
+
+  PageGuard(PageGuard &&g) : pool(g.pool), pid(g.pid), page(g.page), dirty(g.dirty) {
+    g.pool = nullptr;
+  }
+
+  ~PageGuard() {
+    if (pool != nullptr) pool->unpin(pid, dirty);
+  }
+
+  PageGuard(const PageGuard &) = delete;
+  PageGuard &operator=(const PageGuard &) = delete;
+
+  page_id id() const { return pid; }
+  template <class T> T *as() const { return reinterpret_cast<T*>(page); }
+  void touch() { dirty = true; }
+
+private:
+  BufferPool *pool;
+  page_id pid;
+  char *page;
+  bool dirty;
+};
+
+
+/* page里的node。leaf和inner共用header，next_leaf/prev_leaf只有leaf用 */
+template <class key_type, size_t max_children>
+struct PagedNode
+{
+  uint32_t num_keys;
+  uint32_t is_leaf;
+  page_id next_leaf;
+  page_id prev_leaf;
+  key_type keys[max_children];
+};
+
+template <class key_type, size_t max_children>
+struct PagedInnerNode : public PagedNode<key_type, max_children>
+{
+  page_id children[max_children + 1];
+};
+
+template <class key_type, class val_type, size_t max_children>
+struct PagedLeafNode : public PagedNode<key_type, max_children>
+{
+  val_type vals[max_children];
+};
+
+// page 0
+struct PagedHeader
+{
+  uint64_t magic;
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t key_size;
+  uint32_t val_size;
+  uint32_t max_degree;
+  page_id root;
+  page_id num_pages;
+  page_id free_head;
+  uint64_t num_elements;
+};
+
+
+template <class key_type, class val_type, size_t page_size = 4096>
+class PagedTree
+{
+
+  static_assert(std::is_trivially_copyable<key_type>::value && std::is_trivially_copyable<val_type>::value,
+                "B+Tree - PagedTree stores keys and values in file pages, they must be trivially copyable");
+
+  static const size_t node_header = 4 * sizeof(uint32_t);
+  static const size_t inner_fit = (page_size - node_header - sizeof(page_id) - alignof(key_type)) / (sizeof(key_type) + sizeof(page_id));
+  static const size_t leaf_fit = (page_size - node_header - alignof(key_type) - alignof(val_type)) / (sizeof(key_type) + sizeof(val_type));
+
+public:
+
+  static const size_t max_degree = (inner_fit < leaf_fit) ? inner_fit : leaf_fit;  // M, 一个page放得下的最大孩子数
+
+private:
+
+  static_assert(max_degree >= 3, "B+Tree - page_size is too small for key_type and val_type");
+
+  typedef PagedNode<key_type, max_degree> node_type;
+  typedef PagedInnerNode<key_type, max_degree> inner_node;
+  typedef PagedLeafNode<key_type, val_type, max_degree> leaf_node;
+
+  static_assert(sizeof(inner_node) <= page_size && sizeof(leaf_node) <= page_size, "B+Tree - node does not fit in a page");
+
+  static const uint64_t file_magic = 0x6565727450705042ULL;  // "BPpTree"
+  static const uint32_t file_version = 1;
+
+public:
+
+  class iterator
+  {
+
+  public:
+
+    key_type get_key() const {
+      if (page == 0) throw std::out_of_range("B+Tree: iterator is out of range");
+      PageGuard g(tree->pool, page);
+      return g.as<leaf_node>()->keys[idx];
+    }
+
+    val_type get_val() const {
+      if (page == 0) throw std::out_of_range("B+Tree: iterator is out of range");
+      PageGuard g(tree->pool, page);
+      return g.as<leaf_node>()->vals[idx];
+    }
+
+    void set_val(val_type v) {
+      if (page == 0) throw std::out_of_range("B+Tree: iterator is out of range");
+      PageGuard g(tree->pool, page);
+      g.as<leaf_node>()->vals[idx] = v;
+      g.touch();
+    }
+
+    iterator operator--(int) {
+      iterator it = *this;
+      --(*this);
+      return it;
+    }
+
+    const iterator& operator--() {
+      if (page == 0) throw std::out_of_range("B+Tree: iterator is out of range");
+      if (idx > 0) {
+        idx--;
+        return *this;
+      }
+
+      page_id prev;
+      {
+        PageGuard g(tree->pool, page);
+        prev = g.as<leaf_node>()->prev_leaf;
+      }
+      if (prev == 0) throw std::out_of_range("B+Tree: iterator is out of range");
+      PageGuard g(tree->pool, prev);
+      page = prev;
+      idx = g.as<leaf_node>()->num_keys - 1;
+      return *this;
+    }
+
+    iterator operator++(int) {
+      iterator it = *this;
+      ++(*this);
+      return it;
+    }
+
+    const iterator& operator++() {
+      if (page == 0) throw std::out_of_range("B+Tree: iterator is out of range");
+      PageGuard g(tree->pool, page);
+      if (idx + 1 < g.as<leaf_node>()->num_keys) {
+        idx++;
+      } else {
+        idx = 0;
+        page = g.as<leaf_node>()->next_leaf;
+      }
+      return *this;
+    }
+
+    bool operator!=(const iterator &it) const {
+      return !(*this == it);
+    }
+
+    bool operator==(const iterator &it) const {
+      return page == it.page && idx == it.idx;
+    }
+
+  private:
+    friend class PagedTree;
+    PagedTree *tree;
+    page_id page;  // 0是end()
+    size_t idx;
+  };
+
+
+PagedTree(const std::string &path, size_t pool_pages = 1024) : pool(path, page_size, pool_pages), path(path) {
+  if (pool.file_pages() == 0) {
+    clear();
+    return;
+  }
+
+  PageGuard g(pool, 0);
+  const PagedHeader *h = g.as<PagedHeader>();
+  if (h->magic != file_magic || h->version != file_version || h->page_size != page_size || h->key_size != sizeof(key_type)
+      || h->val_size != sizeof(val_type) || h->max_degree != max_degree) {
+    throw std::runtime_error("B+Tree: " + path + " is not a paged B+Tree with this key/val layout");
+  }
+  root = h->root;
+  num_elements = h->num_elements;
+  pool.restore(h->num_pages, h->free_head);
+}
+
+~PagedTree() {
+  try {
+    flush();
+  } catch (...) {
+  }
+}
+
+PagedTree(const PagedTree &) = delete;
+PagedTree &operator=(const PagedTree &) = delete;
+
+
+void insert(const key_type &key, const val_type &val) {
+  std::vector <page_id> pids;
+  std::vector <size_t> idxs;
+  key_type sep;
+  page_id left, right;
+  size_t i, j;
+
+  {
+    PageGuard g = descend(key, &pids, &idxs);
+    leaf_node *leaf = g.as<leaf_node>();
+
+    i = NodeSearch<key_type>::upper_bound(leaf->keys, leaf->num_keys, key);
+    g.touch();
+    if (i > 0 && leaf->keys[i - 1] == key) {  // key存在了就只改value
+      leaf->vals[i - 1] = val;
+      return;
+    }
+
+    num_elements++;
+    std::copy_backward(leaf->keys + i, leaf->keys + leaf->num_keys, leaf->keys + leaf->num_keys + 1);
+    std::copy_backward(leaf->vals + i, leaf->vals + leaf->num_keys, leaf->vals + leaf->num_keys + 1);
+    leaf->keys[i] = key;
+    leaf->vals[i] = val;
+    leaf->num_keys++;
+    if (leaf->num_keys < max_degree) return;
+
+    /* split the leaf, the right half goes to a new page */
+    PageGuard r(pool);
+    leaf_node *right_leaf = r.as<leaf_node>();
+    j = max_degree / 2;
+    sep = KeySeparator<key_type>::between(leaf->keys[j - 1], leaf->keys[j]);
+    std::copy(leaf->keys + j, leaf->keys + max_degree, right_leaf->keys);
+    std::copy(leaf->vals + j, leaf->vals + max_degree, right_leaf->vals);
+    right_leaf->is_leaf = 1;
+    right_leaf->num_keys = max_degree - j;
+    leaf->num_keys = j;
+
+    // pre: leaf <-> b    now: leaf <-> right <-> b
+    right_leaf->next_leaf = leaf->next_leaf;
+    right_leaf->prev_leaf = g.id();
+    if (leaf->next_leaf != 0) {
+      PageGuard next(pool, leaf->next_leaf);
+      next.as<leaf_node>()->prev_leaf = r.id();
+      next.touch();
+    }
+    leaf->next_leaf = r.id();
+    left = g.id();
+    right = r.id();
+  }
+
+  /* put (sep, right) into the parents, split them while they are full */
+  while (true) {
+    if (pids.empty()) {
+      PageGuard r(pool);
+      inner_node *n = r.as<inner_node>();
+      n->num_keys = 1;
+      n->keys[0] = sep;
+      n->children[0] = left;
+      n->children[1] = right;
+      root = r.id();
+      return;
+    }
+
+    PageGuard g(pool, pids.back());
+    inner_node *n = g.as<inner_node>();
+    i = idxs.back();
+    pids.pop_back();
+    idxs.pop_back();
+
+    std::copy_backward(n->keys + i, n->keys + n->num_keys, n->keys + n->num_keys + 1);
+    std::copy_backward(n->children + i + 1, n->children + n->num_keys + 1, n->children + n->num_keys + 2);
+    n->keys[i] = sep;
+    n->children[i + 1] = right;
+    n->num_keys++;
+    g.touch();
+    if (n->num_keys < max_degree) return;
+
+    // 中间节点的median移到上一层
+    PageGuard r(pool);
+    inner_node *right_inner = r.as<inner_node>();
+    j = max_degree / 2 + 1;
+    sep = n->keys[max_degree / 2];
+    std::copy(n->keys + j, n->keys + max_degree, right_inner->keys);
+    std::copy(n->children + j, n->children + max_degree + 1, right_inner->children);
+    right_inner->num_keys = max_degree - j;
+    n->num_keys = max_degree / 2;
+    left = g.id();
+    right = r.id();
+  }
+}
+
+
+void erase(const key_type &key) {
+  std::vector <page_id> pids;
+  std::vector <size_t> idxs;
+  page_id pid;
+  size_t i;
+
+  {
+    PageGuard g = descend(key, &pids, &idxs);
+    leaf_node *leaf = g.as<leaf_node>();
+
+    i = NodeSearch<key_type>::upper_bound(leaf->keys, leaf->num_keys, key);
+    if (i == 0 || !(leaf->keys[i - 1] == key)) return;  // key is not found
+
+    num_elements--;
+    std::copy(leaf->keys + i, leaf->keys + leaf->num_keys, leaf->keys + i - 1);
+    std::copy(leaf->vals + i, leaf->vals + leaf->num_keys, leaf->vals + i - 1);
+    leaf->num_keys--;
+    g.touch();
+    if (leaf->num_keys >= min_keys) return;
+    pid = g.id();
+  }
+
+  rebalance(pids, idxs, pid);
+}
+
+
+iterator find(const key_type &key) {
+  PageGuard g = descend(key, nullptr, nullptr);
+  const leaf_node *leaf = g.as<leaf_node>();
+  size_t i = NodeSearch<key_type>::upper_bound(leaf->keys, leaf->num_keys, key);
+
+  if (i > 0 && leaf->keys[i - 1] == key) return make_iterator(g.id(), i - 1);
+  return end();
+}
+
+bool contains(const key_type &key) {
+  return find(key) != end();
+}
+
+iterator lower_bound(const key_type &key) {
+  PageGuard g = descend(key, nullptr, nullptr);
+  const leaf_node *leaf = g.as<leaf_node>();
+  size_t i = NodeSearch<key_type>::lower_bound(leaf->keys, leaf->num_keys, key);
+
+  if (i < leaf->num_keys) return make_iterator(g.id(), i);
+  return make_iterator(leaf->next_leaf, 0);  // leaf里都 < key，就是下一个leaf的第一个
+}
+
+iterator upper_bound(const key_type &key) {
+  PageGuard g = descend(key, nullptr, nullptr);
+  const leaf_node *leaf = g.as<leaf_node>();
+  size_t i = NodeSearch<key_type>::upper_bound(leaf->keys, leaf->num_keys, key);
+
+  if (i < leaf->num_keys) return make_iterator(g.id(), i);
+  return make_iterator(leaf->next_leaf, 0);
+}
+
+iterator begin() {
+  page_id pid = root;
+
+  while (true) {
+    PageGuard g(pool, pid);
+    const node_type *n = g.as<node_type>();
+    if (n->is_leaf) return make_iterator(n->num_keys == 0 ? 0 : pid, 0);
+    pid = g.as<inner_node>()->children[0];
+  }
+}
+
+iterator end() {
+  return make_iterator(0, 0);
+}
+
+size_t size() const {
+  return num_elements;
+}
+
+bool empty() const {
+  return num_elements == 0;
+}
+
+// 扔掉所有page，file里只剩header和一个空的root leaf
+void clear() {
+  pool.reset();
+  PageGuard r(pool);
+  r.as<leaf_node>()->is_leaf = 1;
+  root = r.id();
+  num_elements = 0;
+}
+
+void flush() {
+  {
+    PageGuard g(pool, 0);
+    PagedHeader *h = g.as<PagedHeader>();
+    h->magic = file_magic;
+    h->version = file_version;
+    h->page_size = page_size;
+    h->key_size = sizeof(key_type);
+    h->val_size = sizeof(val_type);
+    h->max_degree = max_degree;
+    h->root = root;
+    h->num_pages = pool.pages();
+    h->free_head = pool.free_list();
+    h->num_elements = num_elements;
+    g.touch();
+  }
+  pool.flush();
+}
+
+const BufferPoolStats &pool_stats() const {
+  return pool.stats();
+}
+
+
+
+private:
+  static const size_t min_keys = (max_degree - 1) / 2;
+  BufferPool pool;
+  std::string path;
+  page_id root;
+  size_t num_elements;
+
+iterator make_iterator(page_id page, size_t idx) {
+  iterator it;
+  it.tree = this;
+  it.page = page;
+  it.idx = idx;
+  return it;
+}
+
+// 从root走到key所在的leaf，返回pin住的leaf。pids/idxs记下路过的inner node和走的孩子
+PageGuard descend(const key_type &key, std::vector <page_id> *pids, std::vector <size_t> *idxs) {
+  page_id pid = root;
+  size_t i;
+
+  while (true) {
+    PageGuard g(pool, pid);
+    const node_type *n = g.as<node_type>();
+    if (n->is_leaf) return g;
+
+    i = NodeSearch<key_type>::upper_bound(n->keys, n->num_keys, key);
+    if (pids != nullptr) {
+      pids->push_back(pid);
+      idxs->push_back(i);
+    }
+    pid = g.as<inner_node>()->children[i];
+  }
+}
+
+/* pid太小了: 先向左边的兄弟借，没有左兄弟就向右边借，借不到就合并，然后看parent */
+void rebalance(std::vector <page_id> &pids, std::vector <size_t> &idxs, page_id pid) {
+  page_id parent_pid, left_pid, right_pid;
+  size_t ci, li;
+  bool collapse;
+
+  while (pid != root) {
+    parent_pid = pids.back();
+    ci = idxs.back();
+    pids.pop_back();
+    idxs.pop_back();
+
+    {
+      PageGuard ng(pool, pid);
+      PageGuard pg(pool, parent_pid);
+      inner_node *parent = pg.as<inner_node>();
+
+      if (ng.as<node_type>()->num_keys >= min_keys) return;
+      ng.touch();
+      pg.touch();
+
+      if (ci > 0) {
+        PageGuard lg(pool, parent->children[ci - 1]);
+        if (lg.as<node_type>()->num_keys > min_keys) {
+          lg.touch();
+          borrow_from_left(lg.as<node_type>(), ng.as<node_type>(), parent, ci - 1);
+          return;
+        }
+        left_pid = lg.id();
+        right_pid = pid;
+        li = ci - 1;
+      } else {
+        PageGuard rg(pool, parent->children[ci + 1]);
+        if (rg.as<node_type>()->num_keys > min_keys) {
+          rg.touch();
+          borrow_from_right(ng.as<node_type>(), rg.as<node_type>(), parent, ci);
+          return;
+        }
+        left_pid = pid;
+        right_pid = rg.id();
+        li = ci;
+      }
+
+      /* merge the right node into the left one */
+      PageGuard lg(pool, left_pid);
+      PageGuard rg(pool, right_pid);
+      merge(lg, rg, parent, li);
+      collapse = (parent->num_keys == 0 && parent_pid == root);
+    }
+
+    pool.release(right_pid);
+    if (collapse) {  // root只剩一个孩子了，孩子变成root
+      root = left_pid;
+      pool.release(parent_pid);
+      return;
+    }
+    pid = parent_pid;
+  }
+}
+
+// left的最后一个给n。parent->keys[si]是它们中间的separator
+void borrow_from_left(node_type *left, node_type *n, inner_node *parent, size_t si) {
+  size_t last = left->num_keys - 1;
+
+  std::copy_backward(n->keys, n->keys + n->num_keys, n->keys + n->num_keys + 1);
+  if (n->is_leaf) {
+    leaf_node *leaf = static_cast<leaf_node*>(n), *left_leaf = static_cast<leaf_node*>(left);
+    std::copy_backward(leaf->vals, leaf->vals + leaf->num_keys, leaf->vals + leaf->num_keys + 1);
+    leaf->keys[0] = left_leaf->keys[last];
+    leaf->vals[0] = left_leaf->vals[last];
+    parent->keys[si] = KeySeparator<key_type>::between(left_leaf->keys[last - 1], leaf->keys[0]);
+  } else {
+    inner_node *inner = static_cast<inner_node*>(n), *left_inner = static_cast<inner_node*>(left);
+    std::copy_backward(inner->children, inner->children + inner->num_keys + 1, inner->children + inner->num_keys + 2);
+    inner->keys[0] = parent->keys[si];
+    inner->children[0] = left_inner->children[last + 1];
+    parent->keys[si] = left_inner->keys[last];
+  }
+  left->num_keys--;
+  n->num_keys++;
+}
+
+// right的第一个给n。parent->keys[si]是它们中间的separator
+void borrow_from_right(node_type *n, node_type *right, inner_node *parent, size_t si) {
+  if (n->is_leaf) {
+    leaf_node *leaf = static_cast<leaf_node*>(n), *right_leaf = static_cast<leaf_node*>(right);
+    leaf->keys[leaf->num_keys] = right_leaf->keys[0];
+    leaf->vals[leaf->num_keys] = right_leaf->vals[0];
+    std::copy(right_leaf->vals + 1, right_leaf->vals + right_leaf->num_keys, right_leaf->vals);
+    parent->keys[si] = KeySeparator<key_type>::between(right_leaf->keys[0], right_leaf->keys[1]);
+  } else {
+    inner_node *inner = static_cast<inner_node*>(n), *right_inner = static_cast<inner_node*>(right);
+    inner->keys[inner->num_keys] = parent->keys[si];
+    inner->children[inner->num_keys + 1] = right_inner->children[0];
+    parent->keys[si] = right_inner->keys[0];
+    std::copy(right_inner->children + 1, right_inner->children + right_inner->num_keys + 1, right_inner->children);
+  }
+  std::copy(right->keys + 1, right->keys + right->num_keys, right->keys);
+  right->num_keys--;
+  n->num_keys++;
+}
+
+// 把rg合并到lg，删掉parent里的keys[si]和children[si + 1]。rg的page之后由调用者释放
+void merge(PageGuard &lg, PageGuard &rg, inner_node *parent, size_t si) {
+  node_type *left = lg.as<node_type>();
+
+  lg.touch();
+  if (left->is_leaf) {
+    leaf_node *left_leaf = lg.as<leaf_node>(), *right_leaf = rg.as<leaf_node>();
+    std::copy(right_leaf->keys, right_leaf->keys + right_leaf->num_keys, left_leaf->keys + left_leaf->num_keys);
+    std::copy(right_leaf->vals, right_leaf->vals + right_leaf->num_keys, left_leaf->vals + left_leaf->num_keys);
+    left_leaf->num_keys += right_leaf->num_keys;
+    left_leaf->next_leaf = right_leaf->next_leaf;
+    if (right_leaf->next_leaf != 0) {
+      PageGuard next(pool, right_leaf->next_leaf);
+      next.as<leaf_node>()->prev_leaf = lg.id();
+      next.touch();
+    }
+  } else {
+    inner_node *left_inner = lg.as<inner_node>(), *right_inner = rg.as<inner_node>();
+    left_inner->keys[left_inner->num_keys] = parent->keys[si];
+    std::copy(right_inner->keys, right_inner->keys + right_inner->num_keys, left_inner->keys + left_inner->num_keys + 1);
+    std::copy(right_inner->children, right_inner->children + right_inner->num_keys + 1, left_inner->children + left_inner->num_keys + 1);
+    left_inner->num_keys += right_inner->num_keys + 1;
+  }
+
+  std::copy(parent->keys + si + 1, parent->keys + parent->num_keys, parent->keys + si);
+  std::copy(parent->children + si + 2, parent->children + parent->num_keys + 1, parent->children + si + 1);
+  parent->num_keys--;
+}
+
+};
+
+}; // end of namespace
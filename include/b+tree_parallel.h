@@ -0,0 +1,94 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <iterator>
+
+
+/**
+
+      B+Tree parallel helpers synopsis
+
+  size_t default_threads();
+      std::thread::hardware_concurrency(), at least 1
+
+  void parallel_for(size_t n, size_t num_threads, Func f);
+      run f(0) ... f(n - 1), spread over num_threads threads (the calling thread is one of them)
+
+  void parallel_stable_sort(vector<T> &v, Compare less, size_t num_threads);
+      stable_sort the chunks in parallel, then merge neighbouring runs in parallel rounds.
+      Equal elements keep their input order.
+
+*/
+
+namespace BPlusTree {
+
+inline size_t default_threads() {
+  size_t n = std::thread::hardware_concurrency();
+  return (n == 0) ? 1 : n;
+}
+
+template <class Func>
+void parallel_for(size_t n, size_t num_threads, Func f) {
+  std::vector <std::thread> threads;
+  size_t t;
+
+  if (num_threads > n) num_threads = n;
+  if (num_threads <= 1) {
+    for (t = 0; t < n; t++) f(t);
+    return;
+  }
+
+  /* thread t runs the tasks t, t + num_threads, t + 2 * num_threads ... */
+  for (t = 1; t < num_threads; t++) {
+    threads.push_back(std::thread([=]() {
+      size_t i;
+      for (i = t; i < n; i += num_threads) f(i);
+    }));
+  }
+  for (t = 0; t < n; t += num_threads) f(t);
+  for (t = 0; t < threads.size(); t++) threads[t].join();
+}
+
+template <class T, class Compare>
+void parallel_stable_sort(std::vector <T> &v, Compare less, size_t num_threads) {
+  std::vector <size_t> bounds; // run i is [bounds[i], bounds[i + 1])
+  std::vector <size_t> next_bounds;
+  std::vector <T> buffer;
+  size_t runs, i;
+
+  if (num_threads <= 1 || v.size() < 2 * num_threads) {
+    std::stable_sort(v.begin(), v.end(), less);
+    return;
+  }
+
+  runs = num_threads;
+  for (i = 0; i <= runs; i++) bounds.push_back(v.size() * i / runs);
+
+  /* sort every run on its own thread */
+  parallel_for(runs, num_threads, [&](size_t r) {
+    std::stable_sort(v.begin() + bounds[r], v.begin() + bounds[r + 1], less);
+  });
+
+  /* merge neighbouring runs until only one is left, one round at a time */
+  buffer.resize(v.size());
+  while (bounds.size() > 2) {
+    runs = bounds.size() - 1;
+    parallel_for((runs + 1) / 2, num_threads, [&](size_t p) {
+      size_t lo = bounds[2 * p];
+      size_t mid = bounds[std::min(2 * p + 1, runs)];
+      size_t hi = bounds[std::min(2 * p + 2, runs)];
+      std::merge(std::make_move_iterator(v.begin() + lo), std::make_move_iterator(v.begin() + mid),
+                 std::make_move_iterator(v.begin() + mid), std::make_move_iterator(v.begin() + hi),
+                 buffer.begin() + lo, less);
+    });
+
+    next_bounds.clear();
+    for (i = 0; i < bounds.size(); i += 2) next_bounds.push_back(bounds[i]);
+    if (next_bounds.back() != v.size()) next_bounds.push_back(v.size());
+    bounds.swap(next_bounds);
+    v.swap(buffer);
+  }
+}
+
+}; // end of namespace
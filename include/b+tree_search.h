@@ -0,0 +1,414 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+/**
+
+      B+Tree in-node search synopsis
+
+  NodeSearch<key_type>::upper_bound(keys, n, key)  - number of keys <= key, i.e. the child to descend into
+  NodeSearch<key_type>::lower_bound(keys, n, key)  - number of keys <  key, i.e. the first slot whose key >= key
+
+  keys[0, n) must be sorted and unique.
+
+  For 32/64 bit signed integers, float and double the search is branchless:
+  a node is first narrowed down with a branchless binary search until at most
+  simd_window keys are left, and the rest is counted with AVX2/SSE compares
+  (compare the whole window with the key and popcount the movemask).
+  std::string keys use a binary search that skips the prefix the key is already
+  known to share with the keys left in the search range.
+  Other key types use the plain linear scan.
+
+  InterpolationSearch<key_type>                    - the same interface, Tree's search_type parameter
+
+  For arithmetic keys it predicts the slot from the first and the last key of the node
+  (a line through the two ends, so there is nothing to keep up to date on insert or split),
+  counts the cache line of keys that contains the prediction, and falls back to NodeSearch on the
+  part of the node left or right of it when the answer may be outside that line.
+  Dense IDs are found with one cache line whatever the node size; keys that are skewed inside a node
+  pay the prediction and then the whole NodeSearch. Nodes of less than four cache lines of keys
+  and other key types use NodeSearch. bin/search_bench compares the two.
+
+  KeySeparator<key_type>::between(left, right)     - a separator s with left < s <= right for the parent node
+
+  requires left < right. By default it is right itself. For std::string it is the
+  shortest prefix of right that is still > left (suffix truncation), so the inner
+  nodes only keep the bytes that are needed to tell two leaves apart.
+  Nodes are not prefix compressed: they still hold whole keys at the same fanout,
+  only the separators are shorter.
+
+*/
+
+namespace BPlusTree {
+
+/* scalar version, used by all key types that are not arithmetic */
+template <class key_type, class Enable = void>
+struct NodeSearch
+{
+  static size_t upper_bound(const key_type *keys, size_t n, const key_type &key) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+      if (key < keys[i]) break;
+    }
+    return i;
+  }
+
+  static size_t lower_bound(const key_type *keys, size_t n, const key_type &key) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+      if (key <= keys[i]) break;
+    }
+    return i;
+  }
+};
+
+
+/* 用SIMD数一个窗口里有多少个key满足 keys[i] <= key (strict时是 keys[i] < key)
+   因为keys是有序的，这个数量就是要找的下标，所以不需要任何分支 */
+template <class T>
+struct SimdCount
+{
+  static size_t count(const T *keys, size_t n, T key, bool strict) {
+    size_t i, c = 0;
+    if (strict) {
+      for (i = 0; i < n; i++) c += (keys[i] < key);
+    } else {
+      for (i = 0; i < n; i++) c += (keys[i] <= key);
+    }
+    return c;
+  }
+};
+
+#if defined(__AVX2__)
+
+template <>
+struct SimdCount<int32_t>
+{
+  static size_t count(const int32_t *keys, size_t n, int32_t key, bool strict) {
+    size_t i = 0, c = 0;
+    __m256i k = _mm256_set1_epi32(key);
+    for (; i + 8 <= n; i += 8) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(keys + i));
+      // strict: keys[i] < key  <=>  key > keys[i];   otherwise keys[i] <= key  <=>  !(keys[i] > key)
+      __m256i m = strict ? _mm256_cmpgt_epi32(k, v) : _mm256_cmpgt_epi32(v, k);
+      int bits = __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+      c += strict ? bits : 8 - bits;
+    }
+    for (; i < n; i++) c += strict ? (keys[i] < key) : (keys[i] <= key);
+    return c;
+  }
+};
+
+template <>
+struct SimdCount<int64_t>
+{
+  static size_t count(const int64_t *keys, size_t n, int64_t key, bool strict) {
+    size_t i = 0, c = 0;
+    __m256i k = _mm256_set1_epi64x(key);
+    for (; i + 4 <= n; i += 4) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(keys + i));
+      __m256i m = strict ? _mm256_cmpgt_epi64(k, v) : _mm256_cmpgt_epi64(v, k);
+      int bits = __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(m)));
+      c += strict ? bits : 4 - bits;
+    }
+    for (; i < n; i++) c += strict ? (keys[i] < key) : (keys[i] <= key);
+    return c;
+  }
+};
+
+template <>
+struct SimdCount<float>
+{
+  static size_t count(const float *keys, size_t n, float key, bool strict) {
+    size_t i = 0, c = 0;
+    __m256 k = _mm256_set1_ps(key);
+    for (; i + 8 <= n; i += 8) {
+      __m256 v = _mm256_loadu_ps(keys + i);
+      __m256 m = strict ? _mm256_cmp_ps(v, k, _CMP_LT_OQ) : _mm256_cmp_ps(v, k, _CMP_LE_OQ);
+      c += __builtin_popcount(_mm256_movemask_ps(m));
+    }
+    for (; i < n; i++) c += strict ? (keys[i] < key) : (keys[i] <= key);
+    return c;
+  }
+};
+
+template <>
+struct SimdCount<double>
+{
+  static size_t count(const double *keys, size_t n, double key, bool strict) {
+    size_t i = 0, c = 0;
+    __m256d k = _mm256_set1_pd(key);
+    for (; i + 4 <= n; i += 4) {
+      __m256d v = _mm256_loadu_pd(keys + i);
+      __m256d m = strict ? _mm256_cmp_pd(v, k, _CMP_LT_OQ) : _mm256_cmp_pd(v, k, _CMP_LE_OQ);
+      c += __builtin_popcount(_mm256_movemask_pd(m));
+    }
+    for (; i < n; i++) c += strict ? (keys[i] < key) : (keys[i] <= key);
+    return c;
+  }
+};
+
+#elif defined(__SSE2__)
+
+template <>
+struct SimdCount<int32_t>
+{
+  static size_t count(const int32_t *keys, size_t n, int32_t key, bool strict) {
+    size_t i = 0, c = 0;
+    __m128i k = _mm_set1_epi32(key);
+    for (; i + 4 <= n; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(keys + i));
+      __m128i m = strict ? _mm_cmpgt_epi32(k, v) : _mm_cmpgt_epi32(v, k);
+      int bits = __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)));
+      c += strict ? bits : 4 - bits;
+    }
+    for (; i < n; i++) c += strict ? (keys[i] < key) : (keys[i] <= key);
+    return c;
+  }
+};
+
+#if defined(__SSE4_2__)
+template <>
+struct SimdCount<int64_t>
+{
+  static size_t count(const int64_t *keys, size_t n, int64_t key, bool strict) {
+    size_t i = 0, c = 0;
+    __m128i k = _mm_set1_epi64x(key);
+    for (; i + 2 <= n; i += 2) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(keys + i));
+      __m128i m = strict ? _mm_cmpgt_epi64(k, v) : _mm_cmpgt_epi64(v, k);
+      int bits = __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(m)));
+      c += strict ? bits : 2 - bits;
+    }
+    for (; i < n; i++) c += strict ? (keys[i] < key) : (keys[i] <= key);
+    return c;
+  }
+};
+#endif
+
+template <>
+struct SimdCount<float>
+{
+  static size_t count(const float *keys, size_t n, float key, bool strict) {
+    size_t i = 0, c = 0;
+    __m128 k = _mm_set1_ps(key);
+    for (; i + 4 <= n; i += 4) {
+      __m128 v = _mm_loadu_ps(keys + i);
+      __m128 m = strict ? _mm_cmplt_ps(v, k) : _mm_cmple_ps(v, k);
+      c += __builtin_popcount(_mm_movemask_ps(m));
+    }
+    for (; i < n; i++) c += strict ? (keys[i] < key) : (keys[i] <= key);
+    return c;
+  }
+};
+
+template <>
+struct SimdCount<double>
+{
+  static size_t count(const double *keys, size_t n, double key, bool strict) {
+    size_t i = 0, c = 0;
+    __m128d k = _mm_set1_pd(key);
+    for (; i + 2 <= n; i += 2) {
+      __m128d v = _mm_loadu_pd(keys + i);
+      __m128d m = strict ? _mm_cmplt_pd(v, k) : _mm_cmple_pd(v, k);
+      c += __builtin_popcount(_mm_movemask_pd(m));
+    }
+    for (; i < n; i++) c += strict ? (keys[i] < key) : (keys[i] <= key);
+    return c;
+  }
+};
+
+#endif
+
+
+/* int/long/long long 都按位宽映射到 int32_t/int64_t 上 */
+template <class key_type>
+struct SimdKey
+{
+  typedef typename std::conditional<std::is_floating_point<key_type>::value, key_type,
+          typename std::conditional<sizeof(key_type) == 4, int32_t, int64_t>::type>::type type;
+};
+
+template <class key_type>
+struct is_simd_key
+{
+  static const bool value = std::is_floating_point<key_type>::value
+    || (std::is_integral<key_type>::value && std::is_signed<key_type>::value
+        && (sizeof(key_type) == 4 || sizeof(key_type) == 8));
+};
+
+
+/* arithmetic keys: branchless binary search down to a small window, then a SIMD count */
+template <class key_type>
+struct NodeSearch<key_type, typename std::enable_if<is_simd_key<key_type>::value>::type>
+{
+  typedef typename SimdKey<key_type>::type simd_type;
+
+  // 二分到剩下一个cache line的key，再整段比较
+  static const size_t simd_window = 64 / sizeof(key_type);
+
+  static size_t upper_bound(const key_type *keys, size_t n, const key_type &key) {
+    return search(keys, n, key, false);
+  }
+
+  static size_t lower_bound(const key_type *keys, size_t n, const key_type &key) {
+    return search(keys, n, key, true);
+  }
+
+private:
+  static size_t search(const key_type *keys, size_t n, key_type key, bool strict) {
+    const key_type *base = keys;
+    size_t half;
+
+    /* everything before base satisfies the predicate, everything after base + n doesn't */
+    while (n > simd_window) {
+      half = n / 2;
+      base = (strict ? base[half] < key : base[half] <= key) ? base + half : base;
+      n -= half;
+    }
+    return (base - keys) + SimdCount<simd_type>::count((const simd_type*)base, n, (simd_type)key, strict);
+  }
+};
+
+
+/* interpolation: 非arithmetic的key就是NodeSearch */
+template <class key_type, class Enable = void>
+struct InterpolationSearch : public NodeSearch<key_type>
+{
+};
+
+template <class key_type>
+struct InterpolationSearch<key_type, typename std::enable_if<std::is_arithmetic<key_type>::value>::type>
+{
+  typedef typename std::conditional<is_simd_key<key_type>::value, typename SimdKey<key_type>::type, key_type>::type count_type;
+
+  // 预测的位置附近一个cache line的key
+  static const size_t window = 64 / sizeof(key_type);
+
+  // 小的node二分一两次就到一个cache line了，比算预测的除法便宜
+  static size_t upper_bound(const key_type *keys, size_t n, const key_type &key) {
+    if (n < 4 * window) return NodeSearch<key_type>::upper_bound(keys, n, key);
+    return search(keys, n, key, false);
+  }
+
+  static size_t lower_bound(const key_type *keys, size_t n, const key_type &key) {
+    if (n < 4 * window) return NodeSearch<key_type>::lower_bound(keys, n, key);
+    return search(keys, n, key, true);
+  }
+
+private:
+  static size_t fallback(const key_type *keys, size_t n, key_type key, bool strict) {
+    return strict ? NodeSearch<key_type>::lower_bound(keys, n, key) : NodeSearch<key_type>::upper_bound(keys, n, key);
+  }
+
+  static size_t search(const key_type *keys, size_t n, key_type key, bool strict) {
+    size_t base, c;
+    double f;
+
+    /* double so that the difference of two int64 keys can't overflow. f is NaN when the two ends round
+       to the same double; a key outside the node is clamped to the first or the last window */
+    f = ((double) key - (double) keys[0]) / ((double) keys[n - 1] - (double) keys[0]);
+    if (!(f >= 0)) f = 0;
+    if (f > 1) f = 1;
+    base = (size_t) (long) (f * (double) (long) (n - window));
+
+    /* 0 < c < window: keys[base + c - 1] is before the key and keys[base + c] isn't, so that's the answer.
+       Otherwise the answer may be left or right of the window */
+    c = SimdCount<count_type>::count((const count_type*) (keys + base), window, (count_type) key, strict);
+    if (c == 0 && base > 0) return fallback(keys, base, key, strict);
+    if (c == window && base + window < n) return base + window + fallback(keys + base + window, n - base - window, key, strict);
+    return base + c;
+  }
+};
+
+
+/* 从from开始比较a、b的前n个字节，返回第一个不同的位置 (都相同就是n) */
+inline size_t mismatch_from(const char *a, const char *b, size_t from, size_t n) {
+  size_t i = from;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t x, y;
+  for (; i + 8 <= n; i += 8) {
+    memcpy(&x, a + i, 8);
+    memcpy(&y, b + i, 8);
+    if (x != y) return i + __builtin_ctzll(x ^ y) / 8;
+  }
+#endif
+  for (; i < n && a[i] == b[i]; i++);
+  return i;
+}
+
+
+/* string keys: binary search with the lcp of the key and the two ends of the range.
+   all the keys between keys[lo - 1] and keys[hi] share min(lcp_lo, lcp_hi) bytes with the key,
+   so the next comparison starts from there. Keys in the same node usually share a long prefix
+   (e.g. "tenant/region/...") and the prefix is only compared once or twice per node. */
+template <>
+struct NodeSearch<std::string>
+{
+  static size_t upper_bound(const std::string *keys, size_t n, const std::string &key) {
+    return search(keys, n, key, false);
+  }
+
+  static size_t lower_bound(const std::string *keys, size_t n, const std::string &key) {
+    return search(keys, n, key, true);
+  }
+
+private:
+  // key < k 返回负数，相等返回0，key > k 返回正数，common返回两个的lcp
+  static int compare_from(const std::string &key, const std::string &k, size_t from, size_t &common) {
+    size_t len = (key.size() < k.size()) ? key.size() : k.size();
+    common = mismatch_from(key.data(), k.data(), from, len);
+    if (common < len) return (unsigned char) key[common] < (unsigned char) k[common] ? -1 : 1;
+    if (key.size() == k.size()) return 0;
+    return (key.size() < k.size()) ? -1 : 1;
+  }
+
+  // strict: 第一个 keys[i] >= key;  否则: 第一个 keys[i] > key
+  static size_t search(const std::string *keys, size_t n, const std::string &key, bool strict) {
+    size_t lo = 0, hi = n, mid, common;
+    size_t lcp_lo = 0, lcp_hi = 0;  // key和keys[lo - 1]、keys[hi]的lcp，两头没有key的时候是0
+    int c;
+
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      c = compare_from(key, keys[mid], (lcp_lo < lcp_hi) ? lcp_lo : lcp_hi, common);
+      if (c < 0 || (c == 0 && strict)) {
+        hi = mid;
+        lcp_hi = common;
+      } else {
+        lo = mid + 1;
+        lcp_lo = common;
+      }
+    }
+    return lo;
+  }
+};
+
+
+template <class key_type>
+struct KeySeparator
+{
+  static key_type between(const key_type &left, const key_type &right) {
+    (void) left;
+    return right;
+  }
+};
+
+/* suffix truncation: right的前 lcp(left, right) + 1 个字节。left < right，所以这个前缀 > left 并且 <= right */
+template <>
+struct KeySeparator<std::string>
+{
+  static std::string between(const std::string &left, const std::string &right) {
+    size_t len = (left.size() < right.size()) ? left.size() : right.size();
+    return right.substr(0, mismatch_from(left.data(), right.data(), 0, len) + 1);
+  }
+};
+
+}; // end of namespace
@@ -0,0 +1,142 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <ostream>
+#include <cstdint>
+#include <cstddef>
+
+
+/**
+
+      B+Tree statistics synopsis
+
+  Tree::stats() returns a TreeStats:
+
+    the shape of the tree, computed by walking it when stats() is called (always available)
+      size, height, nodes_per_level, keys_per_level, fill_per_level ([0] is the root level),
+      leaf_fill, inner_nodes, leaf_nodes, node_bytes, tombstones (lazy_erase, slots erased but not removed yet)
+
+    operation counters, only when compiled with -DBPLUSTREE_STATS (otherwise counters_enabled is false and they are 0)
+      inserts, finds, erases, lower_bounds, subscripts, nodes_visited, direct_inserts,
+      leaf_splits, inner_splits, root_splits, leaf_borrows, inner_borrows, leaf_merges, inner_merges, root_collapses, purges
+
+  Tree::reset_stats()                      - set the operation counters to 0
+  ostream << TreeStats                     - print it, one line per item (the STATS command of bin/main)
+
+  Without BPLUSTREE_STATS the counters are not members of Tree and BPLUSTREE_STAT/BPLUSTREE_STAT_ADD
+  expand to nothing, so a production build pays nothing.
+
+*/
+
+namespace BPlusTree {
+
+struct TreeStats
+{
+  bool counters_enabled = false;
+
+  /* operation counters */
+  uint64_t inserts = 0, finds = 0, erases = 0, lower_bounds = 0, subscripts = 0;
+  uint64_t nodes_visited = 0;   // nodes searched by the descents of insert, find, erase and lower_bound
+  uint64_t direct_inserts = 0;  // inserts that skipped the descent (appends to the last leaf, hinted inserts)
+  uint64_t leaf_splits = 0, inner_splits = 0, root_splits = 0;
+  uint64_t leaf_borrows = 0, inner_borrows = 0;   // erase/batch moved keys from a sibling
+  uint64_t leaf_merges = 0, inner_merges = 0;
+  uint64_t root_collapses = 0;                    // the root lost its last key and the tree got lower
+  uint64_t purges = 0;                            // lazy_erase: leaves whose tombstones were removed
+
+  /* the shape */
+  size_t size = 0, height = 0;
+  std::vector <size_t> nodes_per_level, keys_per_level;
+  std::vector <double> fill_per_level;  // keys / (nodes * max keys per node)
+  double leaf_fill = 0;
+  size_t inner_nodes = 0, leaf_nodes = 0;
+  size_t node_bytes = 0;                // memory of the nodes themselves (heap owned by keys and values not included)
+  size_t tombstones = 0;                // lazy_erase: keys in the leaves that are erased but not removed yet
+};
+
+inline std::ostream &operator<<(std::ostream &os, const TreeStats &s) {
+  size_t l;
+
+  os << "size            " << s.size << "\n";
+  os << "height          " << s.height << "\n";
+  os << "nodes           " << s.inner_nodes << " inner, " << s.leaf_nodes << " leaf\n";
+  for (l = 0; l < s.nodes_per_level.size(); l++) {
+    os << "level " << l << "         " << s.nodes_per_level[l] << " nodes, " << s.keys_per_level[l] << " keys, "
+       << (int) (s.fill_per_level[l] * 100 + 0.5) << "% full\n";
+  }
+  os << "leaf fill       " << (int) (s.leaf_fill * 100 + 0.5) << "%\n";
+  os << "node bytes      " << s.node_bytes << "\n";
+  os << "tombstones      " << s.tombstones << "\n";
+  if (!s.counters_enabled) {
+    os << "counters        off (compile with -DBPLUSTREE_STATS)\n";
+    return os;
+  }
+  os << "inserts         " << s.inserts << "\n";
+  os << "finds           " << s.finds << "\n";
+  os << "erases          " << s.erases << "\n";
+  os << "lower_bounds    " << s.lower_bounds << "\n";
+  os << "subscripts      " << s.subscripts << "\n";
+  os << "nodes visited   " << s.nodes_visited << "\n";
+  os << "direct inserts  " << s.direct_inserts << "\n";
+  os << "splits          " << s.leaf_splits << " leaf, " << s.inner_splits << " inner, " << s.root_splits << " root\n";
+  os << "borrows         " << s.leaf_borrows << " leaf, " << s.inner_borrows << " inner\n";
+  os << "merges          " << s.leaf_merges << " leaf, " << s.inner_merges << " inner\n";
+  os << "root collapses  " << s.root_collapses << "\n";
+  os << "purges          " << s.purges << "\n";
+  return os;
+}
+
+#ifdef BPLUSTREE_STATS
+
+/* Tree里的计数器。const的查找也要计数，所以是mutable的atomic；
+   只用relaxed的load + store，不用lock前缀的指令，几个reader同时计数的时候可能少算几次 */
+struct TreeCounters
+{
+  std::atomic <uint64_t> inserts{0}, finds{0}, erases{0}, lower_bounds{0}, subscripts{0}, nodes_visited{0}, direct_inserts{0};
+  std::atomic <uint64_t> leaf_splits{0}, inner_splits{0}, root_splits{0};
+  std::atomic <uint64_t> leaf_borrows{0}, inner_borrows{0}, leaf_merges{0}, inner_merges{0}, root_collapses{0}, purges{0};
+
+  static void add(std::atomic <uint64_t> &c, uint64_t n) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  void copy_to(TreeStats &s) const {
+    s.counters_enabled = true;
+    s.inserts = inserts.load(std::memory_order_relaxed);
+    s.finds = finds.load(std::memory_order_relaxed);
+    s.erases = erases.load(std::memory_order_relaxed);
+    s.lower_bounds = lower_bounds.load(std::memory_order_relaxed);
+    s.subscripts = subscripts.load(std::memory_order_relaxed);
+    s.nodes_visited = nodes_visited.load(std::memory_order_relaxed);
+    s.direct_inserts = direct_inserts.load(std::memory_order_relaxed);
+    s.leaf_splits = leaf_splits.load(std::memory_order_relaxed);
+    s.inner_splits = inner_splits.load(std::memory_order_relaxed);
+    s.root_splits = root_splits.load(std::memory_order_relaxed);
+    s.leaf_borrows = leaf_borrows.load(std::memory_order_relaxed);
+    s.inner_borrows = inner_borrows.load(std::memory_order_relaxed);
+    s.leaf_merges = leaf_merges.load(std::memory_order_relaxed);
+    s.inner_merges = inner_merges.load(std::memory_order_relaxed);
+    s.root_collapses = root_collapses.load(std::memory_order_relaxed);
+    s.purges = purges.load(std::memory_order_relaxed);
+  }
+
+  void reset() {
+    for (std::atomic <uint64_t> *c : {&inserts, &finds, &erases, &lower_bounds, &subscripts, &nodes_visited, &direct_inserts,
+                                      &leaf_splits, &inner_splits, &root_splits, &leaf_borrows, &inner_borrows,
+                                      &leaf_merges, &inner_merges, &root_collapses, &purges}) {
+      c->store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+#define BPLUSTREE_STAT_ADD(field, n) (TreeCounters::add(counters.field, (n)))
+#define BPLUSTREE_STAT(field) BPLUSTREE_STAT_ADD(field, 1)
+
+#else
+
+#define BPLUSTREE_STAT_ADD(field, n) ((void) 0)
+#define BPLUSTREE_STAT(field) ((void) 0)
+
+#endif
+
+}; // end of namespace
@@ -0,0 +1,589 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "b+tree.h"
+#include "b+tree_codec.h"
+
+
+/**
+
+      B+Tree write-ahead log synopsis
+
+  enum class WalSync { none, group, each };
+      none:  a commit is written to the OS (survives a process crash, not a power failure)
+      group: commits that arrive together share one fdatasync (group commit)
+      each:  every commit gets its own fdatasync
+
+  class WriteAheadLog
+  {
+  public:
+    WriteAheadLog(bool sync);                  // sync: fdatasync after writing
+    void open(const string &file);             // append to file (created and its directory synced if it doesn't exist)
+    uint64_t append(const string &payload);    // buffer a record, return its lsn (end offset of all the records so far)
+    void commit(uint64_t lsn);                 // return when every record up to lsn is written (and synced)
+    void flush();                              // commit everything appended so far
+    void rotate(const string &file);           // write and sync the rest of the current file, continue in file
+    size_t syncs() const;                      // number of fdatasync calls
+    static size_t replay(const string &file, Func f, bool last = true);  // f(p, end) for every complete record, cut off a torn tail
+                                                                        // (only the last log may have one, otherwise it throws)
+  };
+
+  template <class key_type, class val_type, size_t max_children = 3, class allocator_type = NodeSlabAllocator<> >
+  class DurableTree
+  {
+  public:
+    typedef Tree<key_type, val_type, max_children, allocator_type> tree_type;
+
+    DurableTree(const string &path, WalSync sync = WalSync::group);  // recover from path.ckpt and path.log.<n>
+    ~DurableTree();                                                  // flush the log (no checkpoint)
+
+    void insert(const key_type &key, const val_type &val);
+    void erase(const key_type &key);
+    void update(const key_type &key, Func f);   // f(val &) on the value of key (val_type() if it doesn't exist), like tree[key]
+    bool find(const key_type &key, val_type &val) const;
+    bool contains(const key_type &key) const;
+    size_t size() const;
+    void read(Func f) const;                    // f(const tree_type &) with the writers locked out
+    void checkpoint();                          // write the tree to path.ckpt, start a new log, drop the old ones
+    const WriteAheadLog &log() const;
+  };
+
+  All the functions of DurableTree can be called from many threads.
+  insert/erase/update change the tree, then return after their record is committed. Readers can see
+  a change before it is committed. If a commit fails (a write or fdatasync error) the tree may hold
+  changes the log doesn't have: the call throws runtime_error and so does every later call, reopen
+  the DurableTree to recover what is on disk.
+
+  Files: path.ckpt       a checkpoint: header (magic, version, next log number, count), records, crc32
+         path.log.<n>    log records: 32 bit payload length, crc32 of the payload, payload
+                         payload: 1 key val (insert) or 2 key (erase), encoded by Codec
+
+*/
+
+namespace BPlusTree {
+
+enum class WalSync { none, group, each };
+
+inline bool file_exists(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+// 整个文件读进out，文件不存在返回false
+inline bool read_file(const std::string &path, std::string &out) {
+  char buf[1 << 16];
+  ssize_t n;
+  int fd = ::open(path.c_str(), O_RDONLY);
+
+  if (fd < 0) {
+    if (errno == ENOENT) return false;
+    throw std::runtime_error("B+Tree: cannot open " + path + ": " + strerror(errno));
+  }
+  out.clear();
+  while ((n = ::read(fd, buf, sizeof(buf))) > 0) out.append(buf, n);
+  ::close(fd);
+  if (n < 0) throw std::runtime_error("B+Tree: cannot read " + path + ": " + strerror(errno));
+  return true;
+}
+
+// 新建、rename、删除文件之后sync所在的目录，目录项才算写到磁盘上了
+inline void sync_dir(const std::string &path) {
+  size_t slash = path.find_last_of('/');
+  std::string dir = (slash == std::string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+  int fd = ::open(dir.c_str(), O_RDONLY);
+
+  if (fd < 0) return;
+  fsync(fd);
+  ::close(fd);
+}
+
+// 最大的n，path.<suffix><n>存在 (比如path.log.<n>)，一个都没有的时候是0
+inline uint64_t last_numbered_file(const std::string &path, const std::string &suffix) {
+  size_t slash = path.find_last_of('/');
+  std::string dir = (slash == std::string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+  std::string prefix = ((slash == std::string::npos) ? path : path.substr(slash + 1)) + suffix;
+  DIR *d = opendir(dir.c_str());
+  struct dirent *e;
+  uint64_t last = 0;
+  const char *p;
+
+  if (d == nullptr) throw std::runtime_error("B+Tree: cannot open " + dir + ": " + strerror(errno));
+  while ((e = readdir(d)) != nullptr) {
+    if (strncmp(e->d_name, prefix.c_str(), prefix.size()) != 0) continue;
+    p = e->d_name + prefix.size();
+    if (*p == '\0' || strspn(p, "0123456789") != strlen(p)) continue;
+    last = std::max(last, (uint64_t) strtoull(p, nullptr, 10));
+  }
+  closedir(d);
+  return last;
+}
+
+
+/* group commit: append只是把record放进buffer。commit的时候如果没有人在写，
+   这个线程就是leader，把buffer里所有的record一次写出去再fdatasync，
+   写的过程中别的线程append的record留给下一个leader。等着的线程被唤醒时
+   如果自己的lsn已经写完了就直接返回，所以一次fdatasync可以提交很多个线程的record。
+*/
+class WriteAheadLog
+{
+public:
+
+  explicit WriteAheadLog(bool sync) : fd(-1), sync(sync), appended(0), durable(0), syncing(false), num_syncs(0) {}
+
+  ~WriteAheadLog() {
+    try {
+      flush();
+    } catch (...) {
+    }
+    if (fd >= 0) ::close(fd);
+  }
+
+  WriteAheadLog(const WriteAheadLog &) = delete;
+  WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+  // 新建的log要sync目录，不然rotate之后commit的record所在的文件在断电后可能不见了
+  void open(const std::string &file) {
+    bool created = !file_exists(file);
+    fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) throw std::runtime_error("B+Tree: cannot open " + file + ": " + strerror(errno));
+    if (created && sync) sync_dir(file);
+  }
+
+  uint64_t append(const std::string &payload) {
+    uint32_t header[2] = {(uint32_t) payload.size(), crc32(payload.data(), payload.size())};
+    std::lock_guard <std::mutex> g(lock);
+
+    buffer.append(reinterpret_cast<const char*>(header), sizeof(header));
+    buffer.append(payload);
+    appended += sizeof(header) + payload.size();
+    return appended;
+  }
+
+  void commit(uint64_t lsn) {
+    std::unique_lock <std::mutex> g(lock);
+    std::string out, err;
+    uint64_t target;
+
+    while (durable < lsn) {
+      if (!error.empty()) throw std::runtime_error(error);
+      if (syncing) {
+        cond.wait(g);
+        continue;
+      }
+
+      /* become the leader: write everything in the buffer, the others wait */
+      syncing = true;
+      out.clear();
+      out.swap(buffer);
+      target = appended;
+      g.unlock();
+      err = write_out(out, sync);
+      g.lock();
+
+      syncing = false;
+      if (err.empty()) durable = target;
+      else error = err;
+      cond.notify_all();
+    }
+  }
+
+  void flush() {
+    uint64_t lsn;
+    {
+      std::lock_guard <std::mutex> g(lock);
+      lsn = appended;
+    }
+    commit(lsn);
+  }
+
+  void rotate(const std::string &file) {
+    std::unique_lock <std::mutex> g(lock);
+    std::string err;
+
+    while (syncing) cond.wait(g);
+    if (!error.empty()) throw std::runtime_error(error);
+
+    err = write_out(buffer, true);
+    if (!err.empty()) {
+      error = err;
+      cond.notify_all();
+      throw std::runtime_error(err);
+    }
+    buffer.clear();
+    durable = appended;
+    ::close(fd);
+    open(file);
+    cond.notify_all();
+  }
+
+  size_t syncs() const {
+    return num_syncs;
+  }
+
+  /* 依次对每个完整的record调用f(payload, payload_end)，返回record的个数。
+     最后一个log (last) 的最后一个record可能只写了一半 (进程在write的时候死了)，从第一个不完整或者crc不对的record开始截掉。
+     更早的log在rotate的时候已经整个sync过了，里面有坏的record说明文件坏了，不能跳过它接着replay后面的log */
+  template <class Func>
+  static size_t replay(const std::string &file, Func f, bool last = true) {
+    std::string data;
+    const char *p, *end;
+    uint32_t header[2];
+    size_t count = 0;
+
+    if (!read_file(file, data)) return 0;
+    p = data.data();
+    end = p + data.size();
+    while ((size_t) (end - p) >= sizeof(header)) {
+      memcpy(header, p, sizeof(header));
+      if ((size_t) (end - p) - sizeof(header) < header[0]) break;
+      if (crc32(p + sizeof(header), header[0]) != header[1]) break;
+      f(p + sizeof(header), p + sizeof(header) + header[0]);
+      p += sizeof(header) + header[0];
+      count++;
+    }
+
+    if (p != end && !last) {
+      throw std::runtime_error("B+Tree: " + file + " has a bad record at offset " + std::to_string(p - data.data()));
+    }
+    if (p != end && truncate(file.c_str(), p - data.data()) != 0) {
+      throw std::runtime_error("B+Tree: cannot truncate " + file + ": " + strerror(errno));
+    }
+    return count;
+  }
+
+private:
+  int fd;
+  bool sync;
+  std::mutex lock;
+  std::condition_variable cond;
+  std::string buffer;      // append了还没写出去的record
+  uint64_t appended;       // 所有append过的record的字节数
+  uint64_t durable;        // 已经写(并且sync)了的字节数
+  bool syncing;            // 有leader在写
+  std::atomic <size_t> num_syncs;
+  std::string error;       // 写失败过，之后的commit都失败
+
+  // 返回错误信息，成功的话是空的
+  std::string write_out(const std::string &out, bool do_sync) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < out.size()) {
+      n = ::write(fd, out.data() + done, out.size() - done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) return std::string("B+Tree: log write failed: ") + strerror(errno);
+      done += n;
+    }
+    if (do_sync) {
+      if (fdatasync(fd) != 0) return std::string("B+Tree: log fdatasync failed: ") + strerror(errno);
+      num_syncs++;
+    }
+    return "";
+  }
+};
+
+
+template <class key_type, class val_type, size_t max_children = 3, class allocator_type = NodeSlabAllocator<> >
+class DurableTree
+{
+
+public:
+
+  typedef Tree<key_type, val_type, max_children, allocator_type> tree_type;
+
+private:
+
+  static const uint64_t checkpoint_magic = 0x74706b6365657254ULL;  // "Treeckpt"
+  static const uint32_t checkpoint_version = 1;
+  static const char op_insert = 1;
+  static const char op_erase = 2;
+  static const size_t checkpoint_buffer = 1 << 20;  // checkpoint攒够这么多字节写一次
+
+  struct CheckpointHeader
+  {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t next_log;   // 这个checkpoint之后的修改从path.log.<next_log>开始
+    uint64_t count;
+  };
+
+public:
+
+DurableTree(const std::string &path, WalSync sync = WalSync::group)
+  : path(path), mode(sync), wal(sync != WalSync::none), log_number(1), failed(false) {
+  uint64_t n, last;
+
+  load_checkpoint();
+
+  /* logs older than the checkpoint are left over from a checkpoint that crashed before deleting them */
+  for (n = log_number - 1; n > 0 && file_exists(log_name(n)); n--) unlink(log_name(n).c_str());
+
+  /* the logs after the checkpoint must follow each other, a missing one means acknowledged writes are gone */
+  last = last_numbered_file(path, ".log.");
+  for (n = log_number; n <= last; n++) {
+    if (!file_exists(log_name(n))) throw std::runtime_error("B+Tree: " + log_name(n) + " is missing, but later logs exist");
+  }
+
+  /* replay them in order, keep appending to the last one */
+  for (n = log_number; n <= last; n++) {
+    WriteAheadLog::replay(log_name(n), [this](const char *p, const char *end) { apply(p, end); }, n == last);
+    log_number = n;
+  }
+  wal.open(log_name(log_number));
+  sync_dir(path);
+}
+
+DurableTree(const DurableTree &) = delete;
+DurableTree &operator=(const DurableTree &) = delete;
+
+void insert(const key_type &key, const val_type &val) {
+  std::string rec(1, op_insert);
+  Codec<key_type>::put(rec, key);
+  Codec<val_type>::put(rec, val);
+  write(rec, [&]() { tree.insert(key, val); });
+}
+
+void erase(const key_type &key) {
+  std::string rec(1, op_erase);
+  Codec<key_type>::put(rec, key);
+  write(rec, [&]() { tree.erase(key); });
+}
+
+// tree[key]的写法没法知道值什么时候被改了，所以用f改，改完的值记到log里
+template <class Func>
+void update(const key_type &key, Func f) {
+  std::unique_lock <std::mutex> g(lock);
+  std::string rec(1, op_insert);
+  uint64_t lsn;
+
+  check();
+  Codec<key_type>::put(rec, key);
+  tree.update(key, [&](val_type &v) {
+    f(v);
+    Codec<val_type>::put(rec, v);
+  });
+  lsn = wal.append(rec);
+  if (mode == WalSync::each) {
+    commit(lsn);
+    return;
+  }
+  g.unlock();
+  commit(lsn);
+}
+
+bool find(const key_type &key, val_type &val) const {
+  std::lock_guard <std::mutex> g(lock);
+  check();
+  typename tree_type::iterator it = tree.find(key);
+  if (it == tree.end()) return false;
+  val = it.get_val();
+  return true;
+}
+
+bool contains(const key_type &key) const {
+  std::lock_guard <std::mutex> g(lock);
+  check();
+  return tree.find(key) != tree.end();
+}
+
+size_t size() const {
+  std::lock_guard <std::mutex> g(lock);
+  check();
+  return tree.size();
+}
+
+template <class Func>
+void read(Func f) const {
+  std::lock_guard <std::mutex> g(lock);
+  check();
+  f(tree);
+}
+
+/* 只在拿snapshot、换log文件的时候挡住writer，写checkpoint的时候writer可以继续改tree、写新的log。
+   新的checkpoint rename好了以后，旧的log就都用不到了。新log的目录项在rotate里就sync了，
+   所以lock放开之后commit到新log的record不会因为断电丢掉文件 */
+void checkpoint() {
+  std::lock_guard <std::mutex> cg(checkpoint_lock);
+  uint64_t next, n;
+
+  typename tree_type::Snapshot snap = [&]() {
+    std::lock_guard <std::mutex> g(lock);
+    check();
+    next = log_number + 1;
+    try {
+      wal.rotate(log_name(next));
+    } catch (...) {
+      failed.store(true);
+      throw;
+    }
+    log_number = next;
+    return tree.snapshot();
+  }();
+
+  write_checkpoint(snap, next);
+  sync_dir(path);  // the rename must be on disk before the logs it replaces are gone
+  for (n = next - 1; n > 0 && file_exists(log_name(n)); n--) unlink(log_name(n).c_str());
+  sync_dir(path);
+}
+
+const WriteAheadLog &log() const {
+  return wal;
+}
+
+
+
+private:
+  std::string path;
+  WalSync mode;
+  tree_type tree;
+  WriteAheadLog wal;
+  uint64_t log_number;               // 正在写的log是path.log.<log_number>
+  mutable std::mutex lock;           // 保护tree，record也是拿着它append的，所以log里的顺序就是修改的顺序
+  std::mutex checkpoint_lock;
+  std::atomic <bool> failed;         // commit失败过，tree里可能有log里没有的修改
+
+std::string log_name(uint64_t n) const {
+  return path + ".log." + std::to_string(n);
+}
+
+// 改tree、append record都在lock里。each的时候在lock里sync，一次只有一个record
+template <class Func>
+void write(const std::string &rec, Func modify) {
+  uint64_t lsn;
+  {
+    std::lock_guard <std::mutex> g(lock);
+    check();
+    modify();
+    lsn = wal.append(rec);
+    if (mode == WalSync::each) {
+      commit(lsn);
+      return;
+    }
+  }
+  commit(lsn);
+}
+
+// 修改在commit之前就进了tree，commit失败以后tree比log新，只能重新打开从文件恢复
+void commit(uint64_t lsn) {
+  try {
+    wal.commit(lsn);
+  } catch (...) {
+    failed.store(true);
+    throw;
+  }
+}
+
+void check() const {
+  if (failed.load()) throw std::runtime_error("B+Tree: a log write of " + path + " failed, reopen the tree to recover");
+}
+
+void apply(const char *p, const char *end) {
+  char op = (p != end) ? *p++ : 0;
+  key_type key;
+  val_type val;
+
+  if (op == 0 || !Codec<key_type>::get(p, end, key)) throw std::runtime_error("B+Tree: bad record in the log of " + path);
+  if (op == op_insert) {
+    if (!Codec<val_type>::get(p, end, val)) throw std::runtime_error("B+Tree: bad record in the log of " + path);
+    tree.insert(key, val);
+  } else if (op == op_erase) {
+    tree.erase(key);
+  } else {
+    throw std::runtime_error("B+Tree: bad record in the log of " + path);
+  }
+}
+
+void load_checkpoint() {
+  std::string data;
+  CheckpointHeader h;
+  const char *p, *end;
+  uint32_t crc;
+  std::vector <std::pair<key_type, val_type> > records;
+  uint64_t i;
+
+  if (!read_file(path + ".ckpt", data)) return;
+  if (data.size() < sizeof(h) + sizeof(crc)) throw std::runtime_error("B+Tree: " + path + ".ckpt is truncated");
+  memcpy(&h, data.data(), sizeof(h));
+  memcpy(&crc, data.data() + data.size() - sizeof(crc), sizeof(crc));
+  if (h.magic != checkpoint_magic || h.version != checkpoint_version) throw std::runtime_error("B+Tree: " + path + ".ckpt is not a checkpoint");
+  if (crc32(data.data(), data.size() - sizeof(crc)) != crc) throw std::runtime_error("B+Tree: " + path + ".ckpt has a bad checksum");
+
+  p = data.data() + sizeof(h);
+  end = data.data() + data.size() - sizeof(crc);
+  records.resize(h.count);
+  for (i = 0; i < h.count; i++) {
+    if (!Codec<key_type>::get(p, end, records[i].first) || !Codec<val_type>::get(p, end, records[i].second)) {
+      throw std::runtime_error("B+Tree: " + path + ".ckpt is truncated");
+    }
+  }
+  tree.bulk_load(records.begin(), records.end());  // checkpoint里的key是有序的
+  log_number = h.next_log;
+}
+
+// 先写path.ckpt.tmp，sync之后rename，这样path.ckpt总是一个完整的checkpoint
+void write_checkpoint(const typename tree_type::Snapshot &snap, uint64_t next) {
+  std::string tmp = path + ".ckpt.tmp", out;
+  CheckpointHeader h;
+  uint32_t crc = 0;
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0) throw std::runtime_error("B+Tree: cannot open " + tmp + ": " + strerror(errno));
+
+  auto put = [&](bool last) {
+    size_t done = 0;
+    ssize_t n;
+    if (!last && out.size() < checkpoint_buffer) return;
+    crc = crc32(out.data(), out.size(), crc);
+    if (last) out.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+    while (done < out.size()) {
+      n = ::write(fd, out.data() + done, out.size() - done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        ::close(fd);
+        throw std::runtime_error("B+Tree: cannot write " + tmp + ": " + strerror(errno));
+      }
+      done += n;
+    }
+    out.clear();
+  };
+
+  memset(&h, 0, sizeof(h));
+  h.magic = checkpoint_magic;
+  h.version = checkpoint_version;
+  h.next_log = next;
+  h.count = snap.size();
+  out.append(reinterpret_cast<const char*>(&h), sizeof(h));
+  for (auto it = snap.begin(); it != snap.end(); ++it) {
+    Codec<key_type>::put(out, it.get_key());
+    Codec<val_type>::put(out, it.get_val());
+    put(false);
+  }
+  put(true);
+
+  if (fsync(fd) != 0) {
+    ::close(fd);
+    throw std::runtime_error("B+Tree: cannot sync " + tmp + ": " + strerror(errno));
+  }
+  ::close(fd);
+  if (rename(tmp.c_str(), (path + ".ckpt").c_str()) != 0) {
+    throw std::runtime_error("B+Tree: cannot rename " + tmp + ": " + strerror(errno));
+  }
+}
+
+};
+
+}; // end of namespace
@@ -0,0 +1,410 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include "b+tree.h"
+#include "b+tree_buffered.h"
+using namespace BPlusTree;
+using namespace std;
+
+/* Benchmark driver: Tree with max_children from 3 to 256 against std::map and std::unordered_map.
+
+   For every key type (int64, double, string) and key distribution (sequential, uniform, zipfian)
+   n operations of each kind are timed, in this order on the same container:
+
+     insert       n inserts (sequential: keys 0..n-1 in order, uniform: the n keys shuffled,
+                  zipfian: n draws, so popular keys are overwritten and fewer than n keys end up in the container)
+     find         n lookups drawn from the same distribution
+     lower_bound  n lower_bound calls drawn from the distribution (not for unordered_map)
+     seek         the same n keys sorted, one lower_bound each, like a merge join (Tree: through one Cursor)
+     subscript    n operator[] increments drawn from the distribution
+     scan         iteration over the whole container (ops = number of records)
+     erase        the n keys of the insert phase, in the same order
+     queue        the distinct keys in ascending order go through a window of n/4 records:
+                  every insert of a new largest key is followed by an erase of the smallest one (ops = inserts + erases)
+
+   The keys behind a distribution are a fixed set of n distinct keys; the zipfian ranks are scattered
+   over that set so that the popular keys are not neighbours. Results are one row per
+   (structure, fanout, key type, distribution, operation), as CSV (default) or JSON.
+   "tree-lazy" is the Tree with lazy_erase = true (erase leaves tombstones).
+   "tree-buffered" is the BufferedTree (buffer_size = 8 * fanout), its subscript is a find and an insert.
+*/
+
+struct Row {
+  string structure;
+  size_t fanout;       // 0 for the std containers
+  string key_type, distribution, op;
+  size_t n;
+  double mops, ns_per_op;
+};
+
+struct Options {
+  size_t n = 200000;
+  bool json = false;
+  string out;
+  string only;         // run only the structures whose name contains this
+};
+
+
+/* ---------------- keys ---------------- */
+
+template <class key_type> struct KeyMaker;
+
+template <> struct KeyMaker<int64_t> {
+  static const char *name() { return "int64"; }
+  static int64_t make(uint64_t id) { return (int64_t) id; }
+};
+
+template <> struct KeyMaker<double> {
+  static const char *name() { return "double"; }
+  static double make(uint64_t id) { return id * 0.5 + 0.25; }
+};
+
+// 有相同前缀的key，和真实的string key差不多
+template <> struct KeyMaker<string> {
+  static const char *name() { return "string"; }
+  static string make(uint64_t id) {
+    char buf[40];
+    snprintf(buf, sizeof(buf), "user:%012llu", (unsigned long long) id);
+    return buf;
+  }
+};
+
+/* Zipfian over [0, n) with theta 0.99 (Gray et al., "Quickly generating billion-record synthetic databases") */
+class Zipfian {
+public:
+  Zipfian(size_t n, double theta = 0.99) : n(n), theta(theta) {
+    size_t i;
+    zetan = 0;
+    for (i = 1; i <= n; i++) zetan += 1.0 / pow((double) i, theta);
+    alpha = 1.0 / (1.0 - theta);
+    eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - (1.0 + 1.0 / pow(2.0, theta)) / zetan);
+  }
+
+  template <class Rng>
+  size_t operator()(Rng &rng) {
+    double u = uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * zetan;
+    size_t r;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, theta)) return 1;
+    r = (size_t) (n * pow(eta * u - eta + 1, alpha));
+    return min(r, n - 1);
+  }
+
+private:
+  size_t n;
+  double theta, zetan, alpha, eta;
+};
+
+enum class Dist { sequential, uniform, zipfian };
+static const char *dist_name(Dist d) {
+  return d == Dist::sequential ? "sequential" : (d == Dist::uniform ? "uniform" : "zipfian");
+}
+
+template <class key_type>
+struct Workload {
+  vector <key_type> inserts;   // insert and erase order
+  vector <key_type> queries;   // find, lower_bound and operator[]
+};
+
+template <class key_type>
+Workload<key_type> make_workload(size_t n, Dist d) {
+  Workload<key_type> w;
+  vector <uint64_t> ids(n), scatter(n);
+  mt19937_64 rng(12345);
+  size_t i;
+
+  for (i = 0; i < n; i++) ids[i] = scatter[i] = i;
+  shuffle(scatter.begin(), scatter.end(), rng);
+
+  if (d == Dist::sequential) {
+    for (i = 0; i < n; i++) w.inserts.push_back(KeyMaker<key_type>::make(i));
+    for (i = 0; i < n; i++) w.queries.push_back(KeyMaker<key_type>::make(i));
+  } else if (d == Dist::uniform) {
+    shuffle(ids.begin(), ids.end(), rng);
+    for (i = 0; i < n; i++) w.inserts.push_back(KeyMaker<key_type>::make(ids[i]));
+    for (i = 0; i < n; i++) w.queries.push_back(KeyMaker<key_type>::make(rng() % n));
+  } else {
+    Zipfian z(n);
+    for (i = 0; i < n; i++) w.inserts.push_back(KeyMaker<key_type>::make(scatter[z(rng)]));
+    for (i = 0; i < n; i++) w.queries.push_back(KeyMaker<key_type>::make(scatter[z(rng)]));
+  }
+  return w;
+}
+
+
+/* ---------------- the same operations on every structure ---------------- */
+
+template <class T>
+struct Ops {  // Tree
+  typedef typename T::iterator iterator;
+  template <class K, class V> static void insert(T &t, const K &k, const V &v) { t.insert(k, v); }
+  template <class K> static bool find(const T &t, const K &k) { return t.find(k) != t.end(); }
+  template <class K> static bool lower_bound(const T &t, const K &k) { return t.lower_bound(k) != t.end(); }
+  template <class K> static size_t seek(const T &t, const vector <K> &keys) {
+    typename T::Cursor c = t.cursor();
+    size_t hits = 0;
+    for (const K &k : keys) hits += c.lower_bound(k) != t.end();
+    return hits;
+  }
+  template <class K> static void erase(T &t, const K &k) { t.erase(k); }
+  template <class K> static void increment(T &t, const K &k) { t[k] += 1; }
+  static size_t scan(const T &t) {
+    size_t n = 0;
+    for (iterator it = t.begin(); it != t.end(); ++it) n += (it.get_val() != 0) + 1;
+    return n;
+  }
+  static const bool ordered = true;
+};
+
+template <class K, class V, size_t M, size_t B, class A>
+struct Ops< BufferedTree<K, V, M, B, A> > {
+  typedef BufferedTree<K, V, M, B, A> T;
+  typedef typename T::iterator iterator;
+  static void insert(T &t, const K &k, const V &v) { t.insert(k, v); }
+  static bool find(const T &t, const K &k) { return t.contains(k); }
+  static bool lower_bound(const T &t, const K &k) { return t.lower_bound(k) != t.end(); }
+  static size_t seek(const T &t, const vector <K> &keys) {
+    size_t hits = 0;
+    for (const K &k : keys) hits += t.lower_bound(k) != t.end();
+    return hits;
+  }
+  static void erase(T &t, const K &k) { t.erase(k); }
+  static void increment(T &t, const K &k) {
+    V v = V();
+    t.find(k, v);
+    t.insert(k, v + 1);
+  }
+  static size_t scan(const T &t) {
+    size_t n = 0;
+    for (iterator it = t.begin(); it != t.end(); ++it) n += (it.get_val() != 0) + 1;
+    return n;
+  }
+  static const bool ordered = true;
+};
+
+template <class K, class V>
+struct Ops< map<K, V> > {
+  typedef map<K, V> T;
+  static void insert(T &t, const K &k, const V &v) { t[k] = v; }
+  static bool find(const T &t, const K &k) { return t.find(k) != t.end(); }
+  static bool lower_bound(const T &t, const K &k) { return t.lower_bound(k) != t.end(); }
+  static size_t seek(const T &t, const vector <K> &keys) {
+    size_t hits = 0;
+    for (const K &k : keys) hits += t.lower_bound(k) != t.end();
+    return hits;
+  }
+  static void erase(T &t, const K &k) { t.erase(k); }
+  static void increment(T &t, const K &k) { t[k] += 1; }
+  static size_t scan(const T &t) {
+    size_t n = 0;
+    for (typename T::const_iterator it = t.begin(); it != t.end(); ++it) n += (it->second != 0) + 1;
+    return n;
+  }
+  static const bool ordered = true;
+};
+
+template <class K, class V>
+struct Ops< unordered_map<K, V> > {
+  typedef unordered_map<K, V> T;
+  static void insert(T &t, const K &k, const V &v) { t[k] = v; }
+  static bool find(const T &t, const K &k) { return t.find(k) != t.end(); }
+  static bool lower_bound(const T &, const K &) { return false; }
+  static size_t seek(const T &, const vector <K> &) { return 0; }
+  static void erase(T &t, const K &k) { t.erase(k); }
+  static void increment(T &t, const K &k) { t[k] += 1; }
+  static size_t scan(const T &t) {
+    size_t n = 0;
+    for (typename T::const_iterator it = t.begin(); it != t.end(); ++it) n += (it->second != 0) + 1;
+    return n;
+  }
+  static const bool ordered = false;
+};
+
+static volatile size_t sink;  // 结果写到这里，编译器不能把循环删掉
+
+template <class T, class key_type>
+void run(const string &structure, size_t fanout, Dist d, const Workload<key_type> &w, vector <Row> &rows) {
+  typedef Ops<T> ops;
+  typedef chrono::steady_clock clock;
+  T t;
+  size_t i, hits, records, n = w.inserts.size();
+  clock::time_point start;
+
+  auto record = [&](const char *op, size_t count) {
+    double sec = chrono::duration<double>(clock::now() - start).count();
+    Row r;
+    r.structure = structure;
+    r.fanout = fanout;
+    r.key_type = KeyMaker<key_type>::name();
+    r.distribution = dist_name(d);
+    r.op = op;
+    r.n = count;
+    r.mops = count / sec / 1e6;
+    r.ns_per_op = sec * 1e9 / count;
+    rows.push_back(r);
+  };
+
+  start = clock::now();
+  for (i = 0; i < n; i++) ops::insert(t, w.inserts[i], (long long) i);
+  record("insert", n);
+
+  start = clock::now();
+  for (i = 0, hits = 0; i < n; i++) hits += ops::find(t, w.queries[i]);
+  record("find", n);
+  sink = hits;
+
+  if (ops::ordered) {
+    start = clock::now();
+    for (i = 0, hits = 0; i < n; i++) hits += ops::lower_bound(t, w.queries[i]);
+    record("lower_bound", n);
+    sink = hits;
+
+    vector <key_type> sorted(w.queries);
+    sort(sorted.begin(), sorted.end());
+    start = clock::now();
+    sink = ops::seek(t, sorted);
+    record("seek", n);
+  }
+
+  start = clock::now();
+  for (i = 0; i < n; i++) ops::increment(t, w.queries[i]);
+  record("subscript", n);
+
+  records = t.size();  // BufferedTree::size() flushes the buffers, not part of the scan
+  start = clock::now();
+  hits = ops::scan(t);
+  record("scan", records);
+  sink = hits;
+
+  start = clock::now();
+  for (i = 0; i < n; i++) ops::erase(t, w.inserts[i]);
+  record("erase", n);
+
+  if (t.size() != 0) fprintf(stderr, "%s: %zu records left after erase\n", structure.c_str(), (size_t) t.size());
+
+  vector <key_type> q(w.inserts);
+  size_t window = n / 4;
+  sort(q.begin(), q.end());
+  q.erase(unique(q.begin(), q.end()), q.end());
+  start = clock::now();
+  for (i = 0; i < q.size(); i++) {
+    ops::insert(t, q[i], (long long) i);
+    if (i >= window) ops::erase(t, q[i - window]);
+  }
+  record("queue", q.size() + (q.size() > window ? q.size() - window : 0));
+}
+
+
+/* ---------------- the matrix ---------------- */
+
+template <class key_type, size_t M>
+void run_tree(const Options &o, Dist d, const Workload<key_type> &w, vector <Row> &rows) {
+  if (string("tree").find(o.only) != string::npos) {
+    run<Tree<key_type, long long, M>, key_type>("tree", M, d, w, rows);
+  }
+  if (string("tree-lazy").find(o.only) != string::npos) {
+    run<Tree<key_type, long long, M, NodeSlabAllocator<>, false, true>, key_type>("tree-lazy", M, d, w, rows);
+  }
+  if (string("tree-buffered").find(o.only) != string::npos) {
+    run<BufferedTree<key_type, long long, M>, key_type>("tree-buffered", M, d, w, rows);
+  }
+}
+
+template <class key_type>
+void run_key_type(const Options &o, vector <Row> &rows) {
+  Dist dists[] = {Dist::sequential, Dist::uniform, Dist::zipfian};
+  size_t i, before;
+
+  for (Dist d : dists) {
+    Workload<key_type> w = make_workload<key_type>(o.n, d);
+    before = rows.size();
+
+    run_tree<key_type, 3>(o, d, w, rows);
+    run_tree<key_type, 8>(o, d, w, rows);
+    run_tree<key_type, 16>(o, d, w, rows);
+    run_tree<key_type, 32>(o, d, w, rows);
+    run_tree<key_type, 64>(o, d, w, rows);
+    run_tree<key_type, 128>(o, d, w, rows);
+    run_tree<key_type, 256>(o, d, w, rows);
+    if (string("std::map").find(o.only) != string::npos) {
+      run<map<key_type, long long>, key_type>("std::map", 0, d, w, rows);
+    }
+    if (string("std::unordered_map").find(o.only) != string::npos) {
+      run<unordered_map<key_type, long long>, key_type>("std::unordered_map", 0, d, w, rows);
+    }
+
+    for (i = before; i < rows.size(); i++) {
+      fprintf(stderr, "%-20s %4zu %-7s %-11s %-12s %9.2f Mops/s\n", rows[i].structure.c_str(), rows[i].fanout,
+              rows[i].key_type.c_str(), rows[i].distribution.c_str(), rows[i].op.c_str(), rows[i].mops);
+    }
+  }
+}
+
+static void write_csv(FILE *f, const vector <Row> &rows) {
+  fprintf(f, "structure,fanout,key_type,distribution,op,n,mops,ns_per_op\n");
+  for (const Row &r : rows) {
+    fprintf(f, "%s,%zu,%s,%s,%s,%zu,%.4f,%.2f\n", r.structure.c_str(), r.fanout, r.key_type.c_str(),
+            r.distribution.c_str(), r.op.c_str(), r.n, r.mops, r.ns_per_op);
+  }
+}
+
+static void write_json(FILE *f, const vector <Row> &rows) {
+  size_t i;
+  fprintf(f, "[\n");
+  for (i = 0; i < rows.size(); i++) {
+    const Row &r = rows[i];
+    fprintf(f, "  {\"structure\": \"%s\", \"fanout\": %zu, \"key_type\": \"%s\", \"distribution\": \"%s\", "
+               "\"op\": \"%s\", \"n\": %zu, \"mops\": %.4f, \"ns_per_op\": %.2f}%s\n",
+            r.structure.c_str(), r.fanout, r.key_type.c_str(), r.distribution.c_str(), r.op.c_str(), r.n,
+            r.mops, r.ns_per_op, i + 1 < rows.size() ? "," : "");
+  }
+  fprintf(f, "]\n");
+}
+
+static void usage() {
+  fprintf(stderr, "usage: bench [-n num_keys] [--json] [-o file] [--only tree|tree-lazy|tree-buffered|std::map|std::unordered_map]\n");
+  fprintf(stderr, "  results go to stdout (or file) as CSV, or JSON with --json; progress goes to stderr\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  Options o;
+  vector <Row> rows;
+  FILE *f = stdout;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) o.n = atol(argv[++i]);
+    else if (strcmp(argv[i], "--json") == 0) o.json = true;
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) o.out = argv[++i];
+    else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) o.only = argv[++i];
+    else usage();
+  }
+  if (o.n == 0) usage();
+
+  run_key_type<int64_t>(o, rows);
+  run_key_type<double>(o, rows);
+  run_key_type<string>(o, rows);
+
+  if (!o.out.empty() && (f = fopen(o.out.c_str(), "w")) == nullptr) {
+    perror(o.out.c_str());
+    return 1;
+  }
+  if (o.json) write_json(f, rows);
+  else write_csv(f, rows);
+  if (f != stdout) fclose(f);
+
+  return 0;
+}
@@ -0,0 +1,84 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include "b+tree.h"
+using namespace BPlusTree;
+using namespace std;
+
+/* Start-up time of a tree from an image, against building it again.
+
+   insert:        insert the n records one by one (what a program without images does at start-up)
+   save:          Tree::save
+   load:          Tree::load, check the crc32 and bulk_load from the image
+   open_readonly: open the image and answer 1000 random lookups from the mapped file
+   The lookups are then repeated on the loaded tree and the mapped image.
+*/
+
+typedef Tree<long long, long long, 64> mtree;
+
+static double ms_since(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1e3;
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 10000000;
+  string path = "image_bench.img";
+  vector <long long> keys, queries;
+  chrono::steady_clock::time_point start;
+  size_t i, hits = 0;
+  mt19937_64 rng(42);
+
+  if (argc > 3 || (argc >= 2 && strcmp(argv[1], "--help") == 0)) {
+    fprintf(stderr, "usage: image_bench [num_keys] [file]\n");
+    exit(1);
+  }
+  if (argc >= 2) n = atol(argv[1]);
+  if (argc >= 3) path = argv[2];
+
+  for (i = 0; i < n; i++) keys.push_back((long long) (rng() >> 1));
+  for (i = 0; i < 1000000; i++) queries.push_back((i % 2 == 0) ? keys[rng() % n] : (long long) (rng() >> 1));
+
+  printf("%zu records\n", n);
+  {
+    mtree t;
+    start = chrono::steady_clock::now();
+    for (i = 0; i < n; i++) t.insert(keys[i], i);
+    printf("%-28s %10.1f ms\n", "insert", ms_since(start));
+
+    start = chrono::steady_clock::now();
+    t.save(path);
+    printf("%-28s %10.1f ms\n", "save", ms_since(start));
+  }
+  {
+    mtree t;
+    start = chrono::steady_clock::now();
+    t.load(path);
+    printf("%-28s %10.1f ms\n", "load", ms_since(start));
+
+    start = chrono::steady_clock::now();
+    for (i = 0; i < queries.size(); i++) hits += (t.find(queries[i]) != t.end());
+    printf("%-28s %10.1f ms\n", "1M lookups, loaded tree", ms_since(start));
+  }
+  {
+    start = chrono::steady_clock::now();
+    MappedTree <long long, long long> image = mtree::open_readonly(path);
+    for (i = 0; i < 1000; i++) hits += image.contains(queries[i]);
+    printf("%-28s %10.1f ms\n", "open_readonly + 1000 lookups", ms_since(start));
+
+    start = chrono::steady_clock::now();
+    for (i = 0; i < queries.size(); i++) hits += image.contains(queries[i]);
+    printf("%-28s %10.1f ms\n", "1M lookups, mapped image", ms_since(start));
+  }
+  unlink(path.c_str());
+
+  if (hits == 0) fprintf(stderr, "unexpected result\n");
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include <sstream>
 #include <fstream>
 #include <cstring>
+#define BPLUSTREE_STATS  // the STATS command shows the operation counters too
 #include "b+tree.h"
 using namespace BPlusTree;
 using namespace std;
@@ -22,6 +23,7 @@ void print_commands(FILE *f)
   fprintf(f, "LB key ...             - Print the pair whose key >= the given key\n");
   fprintf(f, "UB key ...             - Print the pair whose key >  the given key\n");
   fprintf(f, "CLEAR/C                - Clear the tree\n");
+  fprintf(f, "STATS [RESET]          - Print the shape of the tree and the operation counters, or reset the counters\n");
 
  
 }
@@ -196,6 +198,16 @@ int main(int argc, char **argv)
       }
     } else if (sv[0] == "CLEAR" || sv[0] == "C") {
       t.clear();
+
+    } else if (sv[0] == "STATS") {
+      if (size == 2) to_uppercase(sv[1]);
+      if (size == 2 && sv[1] == "RESET") {
+        t.reset_stats();
+      } else if (size != 1) {
+        printf("usage: STATS [RESET]\n");
+      } else {
+        cout << t.stats() << flush;
+      }
     }
 
   } // end of while 
@@ -0,0 +1,114 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include "b+tree.h"
+#include "b+tree_paged.h"
+using namespace BPlusTree;
+using namespace std;
+
+/* Throughput of PagedTree against the in-memory Tree.
+
+   Every run inserts n random keys, looks up n random keys (half of them present),
+   scans the whole tree and erases half of the keys. PagedTree is run with buffer
+   pools of 1%, 10% and 100% of the pages the tree needs, so the numbers go from
+   "almost every access is a read or write" to "everything fits in memory".
+*/
+
+typedef Tree<long long, long long, 64> mtree;
+typedef PagedTree<long long, long long, 4096> ptree;
+
+struct Result {
+  double insert, find, scan, erase;  // Mops/s
+};
+
+static double mops(size_t ops, chrono::steady_clock::time_point start) {
+  return ops / chrono::duration<double>(chrono::steady_clock::now() - start).count() / 1e6;
+}
+
+template <class TreeType>
+Result run(TreeType &t, const vector <long long> &keys, const vector <long long> &queries) {
+  chrono::steady_clock::time_point start;
+  Result r;
+  size_t i, hits = 0, n = 0;
+
+  start = chrono::steady_clock::now();
+  for (i = 0; i < keys.size(); i++) t.insert(keys[i], i);
+  r.insert = mops(keys.size(), start);
+
+  start = chrono::steady_clock::now();
+  for (i = 0; i < queries.size(); i++) hits += (t.find(queries[i]) != t.end());
+  r.find = mops(queries.size(), start);
+
+  start = chrono::steady_clock::now();
+  for (typename TreeType::iterator it = t.begin(); it != t.end(); ++it) n++;
+  r.scan = mops(n, start);
+
+  start = chrono::steady_clock::now();
+  for (i = 0; i < keys.size(); i += 2) t.erase(keys[i]);
+  r.erase = mops(keys.size() / 2, start);
+
+  if (hits == 0 || n != t.size() + (keys.size() + 1) / 2) fprintf(stderr, "unexpected result\n");
+  return r;
+}
+
+static void print(const char *name, size_t pool, const Result &r, const BufferPoolStats *s) {
+  printf("%-8s %10zu %10.2f %10.2f %10.2f %10.2f", name, pool, r.insert, r.find, r.scan, r.erase);
+  if (s != nullptr) printf(" %10.1f%% %10zu %10zu", 100.0 * s->hits / (s->hits + s->misses), s->reads, s->writes);
+  printf("\n");
+  fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 1000000;
+  string path = "paged_bench.db";
+  vector <long long> keys, queries;
+  vector <double> fractions = {0.01, 0.1, 1.0};
+  size_t i, pages, frames;
+  mt19937_64 rng(42);
+
+  if (argc > 3 || (argc >= 2 && strcmp(argv[1], "--help") == 0)) {
+    fprintf(stderr, "usage: paged_bench [num_keys] [file]\n");
+    exit(1);
+  }
+  if (argc >= 2) n = atol(argv[1]);
+  if (argc >= 3) path = argv[2];
+
+  /* unique random keys, queried in a different random order */
+  for (i = 0; i < n; i++) keys.push_back((long long) (rng() >> 1));
+  sort(keys.begin(), keys.end());
+  keys.erase(unique(keys.begin(), keys.end()), keys.end());
+  shuffle(keys.begin(), keys.end(), rng);
+  for (i = 0; i < keys.size(); i++) queries.push_back((i % 2 == 0) ? keys[rng() % keys.size()] : (long long) (rng() >> 1));
+
+  // 随机插入后leaf大约2/3满
+  pages = keys.size() / ((ptree::max_degree - 1) * 2 / 3) + 16;
+
+  printf("%zu keys, %zu keys per page, about %zu pages\n", keys.size(), ptree::max_degree - 1, pages);
+  printf("%-8s %10s %10s %10s %10s %10s %11s %10s %10s\n", "tree", "pool", "insert", "find", "scan", "erase",
+         "hit rate", "reads", "writes");
+
+  {
+    mtree t;
+    print("memory", 0, run(t, keys, queries), nullptr);
+  }
+
+  for (i = 0; i < fractions.size(); i++) {
+    frames = max((size_t) (pages * fractions[i]), BufferPool::min_frames);
+    unlink(path.c_str());
+    ptree t(path, frames);
+    Result r = run(t, keys, queries);
+    t.flush();
+    print("paged", frames, r, &t.pool_stats());
+  }
+  unlink(path.c_str());
+
+  return 0;
+}
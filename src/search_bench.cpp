@@ -0,0 +1,173 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include "b+tree.h"
+using namespace BPlusTree;
+using namespace std;
+
+/* In-node search: NodeSearch (branchless binary search down to a cache line, then a SIMD count)
+   against InterpolationSearch (predict the slot from the two ends of the node, count the cache line around it).
+
+   Key distributions, all int64:
+     dense       consecutive IDs with a hole now and then
+     timestamps  increasing by a random step of 1..1000
+     uniform     sorted random 62 bit keys
+     lognormal   skewed globally, but a node only holds neighbouring keys, so inside a node it is smooth
+     clustered   runs of 1..64 consecutive IDs far apart (e.g. IDs of many tenants), skewed inside a node too
+
+   Part 1, one node: 4096 nodes of the same size cut out of the sorted keys (so they don't all sit in L1),
+   lower_bound of a key of the node or of a key between its first and last key.
+   Part 2, the whole tree: Tree<int64_t, int64_t, M> with both search types, inserts in random order, then find.
+*/
+
+typedef int64_t key_type;
+
+enum Dist { DENSE, TIMESTAMPS, UNIFORM, LOGNORMAL, CLUSTERED };
+static const Dist dists[] = {DENSE, TIMESTAMPS, UNIFORM, LOGNORMAL, CLUSTERED};
+static const char *dist_names[] = {"dense", "timestamps", "uniform", "lognormal", "clustered"};
+
+// n个排好序、不重复的key
+static vector <key_type> make_keys(Dist d, size_t n, mt19937_64 &rng) {
+  vector <key_type> keys;
+  lognormal_distribution<double> logn(0, 2);
+  key_type k = 1000;
+  size_t run = 0;
+
+  while (keys.size() < n) {
+    switch (d) {
+      case DENSE:      k += (rng() % 16 == 0) ? 2 : 1; break;
+      case TIMESTAMPS: k += 1 + rng() % 1000; break;
+      case UNIFORM:    k = (key_type) (rng() >> 2); break;
+      case LOGNORMAL:  k = (key_type) (logn(rng) * 1e12); break;
+      case CLUSTERED:
+        if (run == 0) {
+          run = 1 + rng() % 64;
+          k += (key_type) (rng() % (1ull << 40));
+        }
+        k++;
+        run--;
+        break;
+    }
+    keys.push_back(k);
+    if ((d == UNIFORM || d == LOGNORMAL) && keys.size() == n) {
+      sort(keys.begin(), keys.end());
+      keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    }
+  }
+  return keys;
+}
+
+static double ns_since(chrono::steady_clock::time_point start, size_t ops) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1e9 / ops;
+}
+
+static volatile size_t sink;
+
+template <class S>
+double time_nodes(const vector <key_type> &keys, size_t node, const vector <size_t> &which, const vector <key_type> &queries) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  size_t i, sum = 0;
+
+  for (i = 0; i < queries.size(); i++) sum += S::lower_bound(keys.data() + which[i] * node, node, queries[i]);
+  sink = sum;
+  return ns_since(start, queries.size());
+}
+
+static void node_search(size_t lookups, mt19937_64 &rng) {
+  const size_t nodes = 4096;
+  vector <size_t> sizes = {8, 16, 32, 64, 128, 256};
+  vector <key_type> keys, queries;
+  vector <size_t> which;
+  size_t i, s, j;
+  key_type lo, hi;
+  double binary, interp;
+
+  printf("one node: lower_bound, ns per lookup\n");
+  printf("%-11s %6s %10s %10s %8s\n", "keys", "node", "binary", "interp", "speedup");
+  for (Dist d : dists) {
+    for (s = 0; s < sizes.size(); s++) {
+      keys = make_keys(d, nodes * sizes[s], rng);
+      which.clear();
+      queries.clear();
+      for (i = 0; i < lookups; i++) {
+        j = rng() % nodes;
+        lo = keys[j * sizes[s]];
+        hi = keys[j * sizes[s] + sizes[s] - 1];
+        which.push_back(j);
+        queries.push_back((i % 2 == 0) ? keys[j * sizes[s] + rng() % sizes[s]] : lo + (key_type) (rng() % (uint64_t) (hi - lo + 1)));
+      }
+      binary = time_nodes< NodeSearch<key_type> >(keys, sizes[s], which, queries);
+      interp = time_nodes< InterpolationSearch<key_type> >(keys, sizes[s], which, queries);
+      printf("%-11s %6zu %10.2f %10.2f %7.2fx\n", dist_names[d], sizes[s], binary, interp, binary / interp);
+      fflush(stdout);
+    }
+  }
+}
+
+template <class T>
+void time_tree(const vector <key_type> &keys, const vector <key_type> &queries, double &insert, double &find) {
+  chrono::steady_clock::time_point start;
+  T t;
+  size_t i, hits = 0;
+
+  start = chrono::steady_clock::now();
+  for (i = 0; i < keys.size(); i++) t.insert(keys[i], (key_type) i);
+  insert = ns_since(start, keys.size());
+
+  start = chrono::steady_clock::now();
+  for (i = 0; i < queries.size(); i++) hits += (t.find(queries[i]) != t.end());
+  find = ns_since(start, queries.size());
+  sink = hits;
+}
+
+template <size_t M>
+void tree_search(Dist d, const vector <key_type> &keys, const vector <key_type> &queries) {
+  double insert[2], find[2];
+
+  time_tree< Tree<key_type, key_type, M> >(keys, queries, insert[0], find[0]);
+  time_tree< Tree<key_type, key_type, M, NodeSlabAllocator<>, false, false, InterpolationSearch<key_type> > >(keys, queries, insert[1], find[1]);
+  printf("%-11s %6zu %10.2f %10.2f %7.2fx %10.2f %10.2f %7.2fx\n", dist_names[d], M,
+         insert[0], insert[1], insert[0] / insert[1], find[0], find[1], find[0] / find[1]);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 1000000;
+  vector <key_type> keys, queries;
+  mt19937_64 rng(42);
+  size_t i;
+
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "--help") == 0)) {
+    fprintf(stderr, "usage: search_bench [num_keys]\n");
+    exit(1);
+  }
+  if (argc == 2) n = atol(argv[1]);
+  if (n == 0) {
+    fprintf(stderr, "usage: search_bench [num_keys]\n");
+    exit(1);
+  }
+
+  node_search(n, rng);
+
+  printf("\nTree with %zu keys, ns per operation\n", n);
+  printf("%-11s %6s %10s %10s %8s %10s %10s %8s\n", "keys", "M", "insert", "interp", "speedup", "find", "interp", "speedup");
+  for (Dist d : dists) {
+    keys = make_keys(d, n, rng);
+    shuffle(keys.begin(), keys.end(), rng);
+    queries.clear();
+    for (i = 0; i < keys.size(); i++) queries.push_back(keys[rng() % keys.size()]);
+    tree_search<16>(d, keys, queries);
+    tree_search<64>(d, keys, queries);
+    tree_search<256>(d, keys, queries);
+  }
+  return 0;
+}
@@ -0,0 +1,169 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include "b+tree.h"
+#include "b+tree_concurrent.h"
+using namespace BPlusTree;
+using namespace std;
+
+/* Multi-threaded stress test and throughput driver for ConcurrentTree.
+
+   For 1, 2, 4 ... max_threads threads:
+     1. check: every thread inserts/finds/erases random keys of its own key set (key % threads == id)
+        while also reading the other threads' keys, then the tree is compared with what every thread expects.
+     2. read:  every thread looks up random keys of a prefilled tree.
+     3. mixed: 90% lookups, 10% inserts/erases.
+   read and mixed are also run on a Tree guarded by one std::mutex as the baseline.
+*/
+
+typedef ConcurrentTree<long long, long long, 64> ctree;
+typedef Tree<long long, long long, 64> stree;
+
+struct LockedTree {
+  stree t;
+  mutex m;
+  bool insert(long long k, long long v) { lock_guard <mutex> g(m); t.insert(k, v); return true; }
+  bool find(long long k, long long &v) {
+    lock_guard <mutex> g(m);
+    stree::iterator it = t.find(k);
+    if (it == t.end()) return false;
+    v = it.get_val();
+    return true;
+  }
+  bool erase(long long k) { lock_guard <mutex> g(m); t.erase(k); return true; }
+};
+
+template <class Func>
+double run_threads(size_t num_threads, Func f) {
+  vector <thread> threads;
+  size_t i;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  for (i = 0; i < num_threads; i++) threads.push_back(thread(f, i));
+  for (i = 0; i < num_threads; i++) threads[i].join();
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+bool check(size_t num_threads, size_t ops, size_t key_range) {
+  ctree t;
+  vector < vector <char> > expect(num_threads, vector <char>(key_range, 0));
+  vector <size_t> errors(num_threads, 0);
+  long long k, v;
+  size_t i, total = 0, bad = 0;
+
+  run_threads(num_threads, [&](size_t id) {
+    mt19937_64 rng(id * 7919 + 1);
+    vector <char> &mine = expect[id];
+    long long key, val;
+    size_t op, j;
+
+    for (j = 0; j < ops; j++) {
+      key = (rng() % (key_range / num_threads)) * num_threads + id;
+      op = rng() % 10;
+      if (op < 5) {
+        if (t.insert(key, key * 3) == (mine[key] != 0)) errors[id]++;
+        mine[key] = 1;
+      } else if (op < 7) {
+        if (t.erase(key) != (mine[key] != 0)) errors[id]++;
+        mine[key] = 0;
+      } else if (op < 9) {
+        if (t.find(key, val) != (mine[key] != 0) || (mine[key] && val != key * 3)) errors[id]++;
+      } else {
+        /* somebody else's key, the answer can't be checked but it must not crash */
+        t.contains(rng() % key_range);
+      }
+    }
+  });
+
+  for (i = 0; i < num_threads; i++) bad += errors[i];
+  for (k = 0; k < (long long) key_range; k++) {
+    if (expect[k % num_threads][k]) {
+      total++;
+      if (!t.find(k, v) || v != k * 3) bad++;
+    } else if (t.contains(k)) {
+      bad++;
+    }
+  }
+  if (t.size() != total) bad++;
+
+  if (bad != 0) fprintf(stderr, "check failed with %zu threads: %zu errors\n", num_threads, bad);
+  return bad == 0;
+}
+
+template <class TreeType>
+double read_mops(TreeType &t, size_t num_threads, size_t ops, size_t key_range) {
+  vector <size_t> hits(num_threads, 0);
+  double sec = run_threads(num_threads, [&](size_t id) {
+    mt19937_64 rng(id + 11);
+    long long v;
+    size_t j;
+    for (j = 0; j < ops; j++) hits[id] += t.find(rng() % key_range, v);
+  });
+  return num_threads * ops / sec / 1e6;
+}
+
+template <class TreeType>
+double mixed_mops(TreeType &t, size_t num_threads, size_t ops, size_t key_range) {
+  double sec = run_threads(num_threads, [&](size_t id) {
+    mt19937_64 rng(id + 23);
+    long long key, v;
+    size_t j, op;
+    for (j = 0; j < ops; j++) {
+      key = rng() % key_range;
+      op = rng() % 20;
+      if (op == 0) t.insert(key, key);
+      else if (op == 1) t.erase(key);
+      else t.find(key, v);
+    }
+  });
+  return num_threads * ops / sec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+  size_t max_threads = default_threads();
+  size_t ops = 1000000;
+  size_t key_range = 1000000;
+  size_t threads;
+  long long k;
+  bool ok = true;
+
+  if (argc > 3 || (argc >= 2 && strcmp(argv[1], "--help") == 0)) {
+    fprintf(stderr, "usage: stress [max_threads] [ops_per_thread]\n");
+    exit(1);
+  }
+  if (argc >= 2) max_threads = atoi(argv[1]);
+  if (argc >= 3) ops = atoi(argv[2]);
+  if (max_threads == 0) max_threads = 1;
+
+  printf("%8s %8s %14s %14s\n", "threads", "workload", "blink Mops/s", "mutex Mops/s");
+  for (threads = 1; ; threads = min(threads * 2, max_threads)) {
+    ok = check(threads, ops, key_range) && ok;
+
+    ctree ct;
+    LockedTree lt;
+    for (k = 0; k < (long long) key_range; k += 2) {
+      ct.insert(k, k);
+      lt.t.insert(k, k);
+    }
+
+    printf("%8zu %8s %14.2f %14.2f\n", threads, "read",
+           read_mops(ct, threads, ops, key_range), read_mops(lt, threads, ops, key_range));
+    printf("%8zu %8s %14.2f %14.2f\n", threads, "mixed",
+           mixed_mops(ct, threads, ops, key_range), mixed_mops(lt, threads, ops, key_range));
+    fflush(stdout);
+
+    if (threads == max_threads) break;
+  }
+
+  if (!ok) return 1;
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,176 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include "b+tree.h"
+using namespace BPlusTree;
+using namespace std;
+
+/* Differential tests of Tree against std::map, run by `make test`.
+
+   Every test applies the same random operations to a Tree and a std::map and then compares
+   size(), the records in order (iterators and for_each_range) and find on every key.
+   String keys share a long prefix, so they live on the heap and a key that was moved
+   from (or moved onto itself) shows up as an empty string.
+   Every test stops at its first difference; the exit status is 1 if any test failed.
+*/
+
+static size_t failures = 0;
+
+#define CHECK(...) do { if (!(__VA_ARGS__)) { fprintf(stderr, "%s:%d: %s failed (%s)\n", __FILE__, __LINE__, #__VA_ARGS__, name); failures++; return; } } while (0)
+
+template <class T> struct fanout;
+template <class K, class V, size_t M, class A, bool O, bool L, class S>
+struct fanout< Tree<K, V, M, A, O, L, S> > { static const size_t value = M; };
+
+static string make_key(long i) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "tenant/region/obj-%06ld", i);
+  return buf;
+}
+
+template <class T>
+static void compare(const char *name, const T &t, const map<string, long> &m) {
+  vector <pair<string, long> > seen;
+
+  CHECK(t.size() == m.size());
+  for (typename T::iterator it = t.begin(); it != t.end(); ++it) seen.push_back(make_pair(it.get_key(), it.get_val()));
+  CHECK(seen == vector <pair<string, long> >(m.begin(), m.end()));
+  seen.clear();
+  t.for_each_range(string(), string("u"), [&](const string &k, const long &v) { seen.push_back(make_pair(k, v)); });
+  CHECK(seen == vector <pair<string, long> >(m.begin(), m.end()));
+  for (auto &r : m) {
+    CHECK(t.find(r.first) != t.end() && t.find(r.first).get_val() == r.second);
+  }
+}
+
+// 200 random keys (seed 1), erase_range [282, 296): the separators of the surviving nodes must stay intact
+template <class T>
+static void erase_range_small(const char *name) {
+  T t;
+  map <string, long> m;
+  mt19937_64 rng(1);
+  long i, k;
+
+  for (i = 0; i < 200; i++) {
+    k = rng() % 1000;
+    t.insert(make_key(k), i);
+    m[make_key(k)] = i;
+  }
+  CHECK(t.erase_range(make_key(282), make_key(296)) == (size_t) distance(m.lower_bound(make_key(282)), m.lower_bound(make_key(296))));
+  m.erase(m.lower_bound(make_key(282)), m.lower_bound(make_key(296)));
+  compare(name, t, m);
+}
+
+// random inserts, erase_range and erase(first, last) against std::map
+template <class T>
+static void erase_range_random(const char *name, unsigned seed) {
+  T t;
+  map <string, long> m;
+  mt19937_64 rng(seed);
+  long i, round, lo, hi;
+
+  for (round = 0; round < 200; round++) {
+    for (i = 0; i < 50; i++) {
+      lo = rng() % 5000;
+      t.insert(make_key(lo), round);
+      m[make_key(lo)] = round;
+    }
+
+    lo = rng() % 5000;
+    hi = lo + rng() % (round % 10 == 0 ? 3000 : 100);
+    if (round % 2 == 0) {
+      CHECK(t.erase_range(make_key(lo), make_key(hi)) == (size_t) distance(m.lower_bound(make_key(lo)), m.lower_bound(make_key(hi))));
+    } else {
+      typename T::iterator next = t.erase(t.lower_bound(make_key(lo)), t.lower_bound(make_key(hi)));
+      auto expected = m.lower_bound(make_key(hi));
+      CHECK(expected == m.end() ? next == t.end() : next.get_key() == expected->first);
+    }
+    m.erase(m.lower_bound(make_key(lo)), m.lower_bound(make_key(hi)));
+    compare(name, t, m);
+    if (failures) return;
+  }
+}
+
+// erase from the front while a snapshot is alive: the snapshot must keep every key
+template <class T>
+static void erase_under_snapshot(const char *name) {
+  T t;
+  map <string, long> m;
+  long i;
+
+  for (i = 0; i < 2000; i++) {
+    t.insert(make_key(i), i);
+    m[make_key(i)] = i;
+  }
+  typename T::Snapshot s = t.snapshot();
+  for (i = 0; i < 1000; i++) t.erase(make_key(i));
+  t.erase_range(make_key(1500), make_key(1700));
+
+  CHECK(s.size() == m.size());
+  for (auto &r : m) {
+    CHECK(s.contains(r.first));
+  }
+  m.erase(m.begin(), m.lower_bound(make_key(1000)));
+  m.erase(m.lower_bound(make_key(1500)), m.lower_bound(make_key(1700)));
+  compare(name, t, m);
+}
+
+/* every 1000th key, then short ascending runs from each of them: only appends to the last leaf may split
+   at the end, every other leaf must keep at least (max_children - 1) / 2 keys.
+   Then a plain append: every leaf but the last must be full. Without lazy_erase a block is a whole leaf. */
+template <class T, size_t max_children>
+static void leaf_occupancy(const char *name) {
+  T t, appended;
+  map <string, long> m;
+  typename T::block_iterator b, next;
+  long base, i;
+
+  for (base = 0; base <= 100000; base += 1000) {
+    t.insert(make_key(base), base);
+    m[make_key(base)] = base;
+  }
+  for (base = 0; base <= 100000; base += 1000) {
+    for (i = 1; i <= 3; i++) {
+      t.insert(make_key(base + i), base + i);
+      m[make_key(base + i)] = base + i;
+    }
+  }
+  compare(name, t, m);
+  for (b = t.block_begin(); b != t.block_end(); b = next) {
+    next = b;
+    ++next;
+    CHECK(next == t.block_end() || b.size() >= (max_children - 1) / 2);
+  }
+
+  for (i = 0; i < 10000; i++) appended.insert(make_key(i), i);
+  for (b = appended.block_begin(); b != appended.block_end(); b = next) {
+    next = b;
+    ++next;
+    CHECK(next == appended.block_end() || b.size() == max_children - 1);
+  }
+}
+
+template <class T>
+static void run(const char *name) {
+  size_t before = failures;
+  unsigned seed;
+
+  erase_range_small<T>(name);
+  for (seed = 1; seed <= 5; seed++) erase_range_random<T>(name, seed);
+  erase_under_snapshot<T>(name);
+  leaf_occupancy<T, fanout<T>::value>(name);
+  printf("%-24s %s\n", name, failures == before ? "ok" : "FAILED");
+}
+
+int main() {
+  run< Tree<string, long, 3> >("string, 3");
+  run< Tree<string, long, 4> >("string, 4");
+  run< Tree<string, long, 16> >("string, 16");
+  run< Tree<string, long, 4, NodeSlabAllocator<>, true> >("string, 4, counted");
+  run< Tree<string, long, 4, NodeSlabAllocator<>, false, true> >("string, 4, lazy_erase");
+  return failures == 0 ? 0 : 1;
+}
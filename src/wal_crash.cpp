@@ -0,0 +1,207 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <new>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "b+tree_wal.h"
+using namespace BPlusTree;
+using namespace std;
+
+/* Kill-and-recover test and sync benchmark for DurableTree.
+
+   crash: a child process runs writer threads on a DurableTree (every thread owns the keys
+          key % threads == id) and checkpoints now and then. Before an operation a thread
+          publishes it as in flight, after the call returns it records the value as acknowledged,
+          both in shared memory. The parent kills the child with SIGKILL at a random moment,
+          recovers the tree and checks that every key has its acknowledged value, or the value
+          of the operation that was in flight on that key.
+   sync:  throughput of WalSync::none/group/each with 1, 2, 4 ... threads, and how many
+          commits shared one fdatasync.
+*/
+
+typedef DurableTree<long long, long long, 64> dtree;
+
+static const long long absent = -1;
+static const size_t key_range = 100000;
+static const size_t checkpoint_every = 50;  // 线程0的操作数。一轮只有几百个group commit，间隔要小，kill才会落在checkpoint里
+
+struct Shared {
+  atomic <long long> acked[key_range];      // 每个key最后一次返回了的值，absent是被删了
+  atomic <long long> inflight_key[64];      // 线程正在做的操作，-1是没有
+  atomic <long long> inflight_val[64];
+  atomic <long long> checkpoints;           // 这一轮开始了几次checkpoint
+};
+
+static void writer(const string &path, size_t threads, Shared *sh, unsigned seed) {
+  dtree t(path, WalSync::group);
+  vector <thread> ts;
+  size_t id;
+
+  for (id = 0; id < threads; id++) {
+    ts.push_back(thread([&, id]() {
+      mt19937_64 rng(seed * 131 + id);
+      long long key, val;
+      size_t op;
+
+      for (op = 0; ; op++) {
+        key = (rng() % (key_range / threads)) * threads + id;
+        val = (rng() % 4 == 0) ? absent : (long long) (rng() % 1000000);
+        sh->inflight_val[id].store(val);
+        sh->inflight_key[id].store(key);
+        if (val == absent) t.erase(key);
+        else if (rng() % 2) t.insert(key, val);
+        else t.update(key, [val](long long &v) { v = val; });
+        sh->acked[key].store(val);
+        sh->inflight_key[id].store(-1);
+        if (id == 0 && op % checkpoint_every == checkpoint_every - 1) {
+          sh->checkpoints++;
+          t.checkpoint();
+        }
+      }
+    }));
+  }
+  for (id = 0; id < threads; id++) ts[id].join();
+}
+
+static bool recover_and_check(const string &path, size_t threads, Shared *sh, size_t round) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  dtree t(path, WalSync::group);
+  double ms = chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1e3;
+  size_t k, id, bad = 0, count = 0;
+  long long v, got;
+  bool ok;
+
+  for (k = 0; k < key_range; k++) {
+    got = t.find(k, v) ? v : absent;
+    ok = (got == sh->acked[k].load());
+    for (id = 0; !ok && id < threads; id++) {
+      ok = (sh->inflight_key[id].load() == (long long) k && sh->inflight_val[id].load() == got);
+    }
+    if (!ok) bad++;
+    sh->acked[k].store(got);  // 下一轮从恢复出来的状态继续
+    if (got != absent) count++;
+  }
+  for (id = 0; id < threads; id++) sh->inflight_key[id].store(-1);
+  if (count != t.size()) bad++;
+
+  printf("round %3zu: %3lld checkpoints, recovered %7zu records in %7.1f ms, %s\n", round, sh->checkpoints.load(), count, ms,
+         bad == 0 ? "ok" : "MISMATCH");
+  if (bad != 0) fprintf(stderr, "round %zu: %zu keys differ from the acknowledged state\n", round, bad);
+  fflush(stdout);
+  sh->checkpoints.store(0);
+  return bad == 0;
+}
+
+static void remove_files(const string &path) {
+  size_t n, misses = 0;
+  unlink((path + ".ckpt").c_str());
+  unlink((path + ".ckpt.tmp").c_str());
+  for (n = 1; misses < 1000; n++) {  // log的编号是连续的，后面1000个都没有就是删完了
+    misses = (unlink((path + ".log." + to_string(n)).c_str()) == 0) ? 0 : misses + 1;
+  }
+}
+
+static bool crash_test(const string &path, size_t rounds, size_t threads) {
+  Shared *sh = (Shared *) mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  mt19937_64 rng(7);
+  size_t k, r;
+  pid_t child;
+  bool ok = true;
+
+  if (sh == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  new (sh) Shared();
+  for (k = 0; k < key_range; k++) sh->acked[k].store(absent);
+  for (k = 0; k < 64; k++) sh->inflight_key[k].store(-1);
+  sh->checkpoints.store(0);
+  remove_files(path);
+
+  for (r = 0; r < rounds; r++) {
+    child = fork();
+    if (child == 0) {
+      writer(path, threads, sh, r + 1);
+      _exit(0);
+    }
+    usleep(50000 + rng() % 250000);
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    ok = recover_and_check(path, threads, sh, r) && ok;
+  }
+
+  remove_files(path);
+  munmap(sh, sizeof(Shared));
+  return ok;
+}
+
+static void sync_bench(const string &path, size_t max_threads) {
+  const char *names[] = {"none", "group", "each"};
+  WalSync modes[] = {WalSync::none, WalSync::group, WalSync::each};
+  size_t m, threads, id;
+  double sec = 0.5;
+
+  printf("\n%8s %8s %12s %12s %14s\n", "sync", "threads", "kops/s", "fdatasyncs", "commits/sync");
+  for (m = 0; m < 3; m++) {
+    for (threads = 1; ; threads = min(threads * 2, max_threads)) {
+      remove_files(path);
+      {
+        dtree t(path, modes[m]);
+        vector <thread> ts;
+        atomic <size_t> ops(0);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        for (id = 0; id < threads; id++) {
+          ts.push_back(thread([&, id]() {
+            mt19937_64 rng(id);
+            size_t n = 0;
+            while (chrono::duration<double>(chrono::steady_clock::now() - start).count() < sec) {
+              t.insert(rng() % key_range, n++);
+            }
+            ops += n;
+          }));
+        }
+        for (id = 0; id < threads; id++) ts[id].join();
+
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        size_t syncs = t.log().syncs();
+        printf("%8s %8zu %12.1f %12zu %14.1f\n", names[m], threads, ops / elapsed / 1e3, syncs,
+               syncs == 0 ? 0.0 : (double) ops / syncs);
+        fflush(stdout);
+      }
+      if (threads == max_threads) break;
+    }
+  }
+  remove_files(path);
+}
+
+int main(int argc, char **argv)
+{
+  size_t rounds = 10;
+  size_t threads = 4;
+  string path = "wal_crash";
+
+  if (argc > 3 || (argc >= 2 && strcmp(argv[1], "--help") == 0)) {
+    fprintf(stderr, "usage: wal_crash [rounds] [path]   (path.ckpt and path.log.<n> are created)\n");
+    exit(1);
+  }
+  if (argc >= 2) rounds = atoi(argv[1]);
+  if (argc >= 3) path = argv[2];
+
+  bool ok = crash_test(path, rounds, threads);
+  sync_bench(path, 16);
+
+  if (!ok) return 1;
+  printf("OK\n");
+  return 0;
+}